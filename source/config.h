@@ -19,12 +19,6 @@ constexpr size_t num_key_cols = std::size(keys_pins_cols);
 constexpr uint16_t display_width = 128;
 constexpr uint16_t display_height = 32;
 
-constexpr uint16_t display_left_third = display_width / 3;
-constexpr uint16_t display_right_third = display_width - (display_width / 3);
-
-constexpr uint16_t display_top_third = display_height / 3;
-constexpr uint16_t display_bottom_third = display_height - (display_height / 3);
-
 constexpr uint32_t i2c_pin_sda = 16;
 constexpr uint32_t i2c_pin_scl = 17;
 
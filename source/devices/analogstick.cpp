@@ -2,23 +2,169 @@
 // Created by Sidney on 04/07/2025.
 //
 
+#include <algorithm>
+#include <cstdlib>
+#include <hardware/dma.h>
+#include <hardware/clocks.h>
+#include <pico/time.h>
 #include "analogstick.h"
 
+static_assert((ANALOGSTICK_OVERSAMPLING & (ANALOGSTICK_OVERSAMPLING - 1)) == 0);
+
+constexpr uint16_t default_half_range = 1600;
+constexpr uint16_t calibration_save_step = 64;
+constexpr uint32_t max_filter_steps = 16; // The filter has long settled on the average by then
+
 void analogstick_t::init(uint32_t x_gpio, uint32_t y_gpio)
 {
-	m_x_value = x_gpio;
-	m_y_gpio = y_gpio;
+	m_inputs[0] = x_gpio - 26;
+	m_inputs[1] = y_gpio - 26;
 
 	adc_init();
-	adc_gpio_init(m_x_gpio);
-	adc_gpio_init(m_y_gpio);
+	adc_gpio_init(x_gpio);
+	adc_gpio_init(y_gpio);
+
+	adc_set_round_robin((1 << m_inputs[0]) | (1 << m_inputs[1]));
+	adc_fifo_setup(true, true, 1, false, false);
+	adc_set_clkdiv((float)clock_get_hz(clk_adc) / ANALOGSTICK_SAMPLE_RATE - 1.0f);
+
+	m_dma_channel = dma_claim_unused_channel(true);
+	start_sampling();
+
+	// Let the ring fill up once, the filter starts out on the plain average. Whatever the stick reads at power up
+	// is the centre until a stored calibration replaces it
+	sleep_ms((sample_count * 1000) / ANALOGSTICK_SAMPLE_RATE + 1);
+	update();
+
+	// Not worth saving until the range grew from there
+	calibrate_centre();
+	mark_calibration_saved();
+}
+
+void analogstick_t::start_sampling()
+{
+	adc_run(false);
+	m_ring_passes = 0;
+
+	if(dma_channel_is_busy(m_dma_channel))
+		dma_channel_abort(m_dma_channel);
+
+	while(!(adc_hw->cs & ADC_CS_READY_BITS))
+		tight_loop_contents();
+
+	adc_fifo_drain();
+
+	// Round robin goes up from the lowest input, so even samples always belong to the same axis
+	adc_select_input(std::min(m_inputs[0], m_inputs[1]));
+
+	dma_channel_config config = dma_channel_get_default_config(m_dma_channel);
+	channel_config_set_transfer_data_size(&config, DMA_SIZE_16);
+	channel_config_set_read_increment(&config, false);
+	channel_config_set_write_increment(&config, true);
+	channel_config_set_ring(&config, true, __builtin_ctz(sizeof(m_samples)));
+	channel_config_set_dreq(&config, DREQ_ADC);
+
+	dma_channel_configure(m_dma_channel, &config, m_samples, &adc_hw->fifo, 0xffffffff, true);
+	adc_run(true);
 }
 
 void analogstick_t::update()
 {
-	adc_select_input(0);
-	m_x_value = adc_read();
+	// The transfer count runs out after about 24 days of sampling
+	if(!dma_channel_is_busy(m_dma_channel))
+		start_sampling();
+
+	// The filter steps once per pass over the ring, so it settles just as fast no matter how often this gets called.
+	// Passes missed in between are caught up on with the latest average
+	const uint32_t passes = (0xffffffff - dma_channel_hw_addr(m_dma_channel)->transfer_count) / sample_count;
+	const uint32_t steps = std::min<uint32_t>(passes - m_ring_passes, max_filter_steps);
+
+	if(m_has_samples && steps == 0)
+		return;
+
+	m_ring_passes = passes;
+
+	for(size_t axis = 0; axis < 2; ++ axis)
+	{
+		const size_t first = (m_inputs[axis] == std::min(m_inputs[0], m_inputs[1])) ? 0 : 1;
+
+		uint32_t sum = 0;
+
+		for(size_t i = first; i < sample_count; i += 2)
+			sum += m_samples[i] & 0xfff;
+
+		const int32_t average = (int32_t)((sum << 4) / ANALOGSTICK_OVERSAMPLING);
+
+		if(m_has_samples)
+		{
+			for(uint32_t i = 0; i < steps; ++ i)
+				m_filtered[axis] += (average - m_filtered[axis]) >> ANALOGSTICK_FILTER_SHIFT;
+		}
+		else
+			m_filtered[axis] = average;
+
+		const uint16_t value = (uint16_t)(m_filtered[axis] >> 4);
+
+		uint16_t &minimum = m_calibration.minimum[axis];
+		uint16_t &maximum = m_calibration.maximum[axis];
+		const uint16_t centre = m_calibration.centre[axis];
+
+		minimum = std::min(minimum, value);
+		maximum = std::max(maximum, value);
+
+		if(m_saved_calibration.minimum[axis] - minimum >= calibration_save_step || maximum - m_saved_calibration.maximum[axis] >= calibration_save_step)
+			m_calibration_changed = true;
+
+		// Each half is scaled on its own, the centre is rarely in the middle of the range
+		int32_t position;
+
+		if(value >= centre)
+			position = ((int32_t)(value - centre) * 2047) / std::max<int32_t>(maximum - centre, 1);
+		else
+			position = -((int32_t)(centre - value) * 2048) / std::max<int32_t>(centre - minimum, 1);
+
+		if(abs(position) < ANALOGSTICK_DEADZONE)
+			position = 0;
+
+		m_position[axis] = (int16_t)position;
+	}
+
+	m_has_samples = true;
+}
+
+void analogstick_t::reset_range(size_t axis)
+{
+	const uint16_t centre = m_calibration.centre[axis];
 
-	adc_select_input(1);
-	m_y_value = adc_read();
-}
\ No newline at end of file
+	m_calibration.minimum[axis] = (uint16_t)std::max<int32_t>(centre - default_half_range, 0);
+	m_calibration.maximum[axis] = (uint16_t)std::min<int32_t>(centre + default_half_range, 4095);
+}
+
+void analogstick_t::calibrate_centre()
+{
+	for(size_t axis = 0; axis < 2; ++ axis)
+	{
+		m_calibration.centre[axis] = (uint16_t)(m_filtered[axis] >> 4);
+		reset_range(axis);
+	}
+
+	m_calibration_changed = true;
+}
+void analogstick_t::set_calibration(const analogstick_calibration_t &calibration)
+{
+	m_calibration = calibration;
+	m_saved_calibration = calibration;
+
+	for(size_t axis = 0; axis < 2; ++ axis)
+	{
+		if(m_calibration.minimum[axis] >= m_calibration.centre[axis] || m_calibration.maximum[axis] <= m_calibration.centre[axis])
+			reset_range(axis);
+	}
+
+	m_calibration_changed = false;
+}
+void analogstick_t::mark_calibration_saved()
+{
+	m_saved_calibration = m_calibration;
+	m_calibration_changed = false;
+}
@@ -8,6 +8,22 @@
 #include <cstdint>
 #include <hardware/adc.h>
 
+#define ANALOGSTICK_SAMPLE_RATE  2000 // Conversions per second, shared between both axes
+#define ANALOGSTICK_OVERSAMPLING 16   // Samples per axis averaged on every update, power of two
+#define ANALOGSTICK_FILTER_SHIFT 2    // IIR filter, every pass over the ring moves 1/4 of the way towards its average
+
+// Positions are relative to the calibrated centre and range, -2048 to 2047
+#define ANALOGSTICK_DEADZONE         160
+
+struct analogstick_calibration_t
+{
+	uint16_t centre[2];
+	uint16_t minimum[2];
+	uint16_t maximum[2];
+};
+
+// Both axes are converted round robin by the free running ADC and streamed into a ring buffer by DMA,
+// update() only averages and filters what's already there
 class analogstick_t
 {
 public:
@@ -16,15 +32,38 @@ public:
 	void init(uint32_t x_gpio, uint32_t y_gpio);
 	void update();
 
-	uint16_t get_x_value(uint16_t scalar) const { return m_x_value / (4096 / scalar); }
-	uint16_t get_y_value(uint16_t scalar) const { return m_y_value / (4096 / scalar); }
+	int16_t get_x_position() const { return m_position[0]; }
+	int16_t get_y_position() const { return m_position[1]; }
+
+	// The range keeps growing while the stick gets moved further than ever before, the centre is only ever
+	// taken from a stick at rest
+	void calibrate_centre();
+	void set_calibration(const analogstick_calibration_t &calibration);
+	const analogstick_calibration_t &get_calibration() const { return m_calibration; }
+
+	// Set once the calibration moved far enough from the last saved one to be worth saving again
+	bool has_calibration_changed() const { return m_calibration_changed; }
+	void mark_calibration_saved();
 
 private:
-	uint32_t m_x_gpio = 0;
-	uint32_t m_y_gpio = 0;
+	static constexpr size_t sample_count = 2 * ANALOGSTICK_OVERSAMPLING;
+
+	void start_sampling();
+	void reset_range(size_t axis);
+
+	uint32_t m_inputs[2] = {}; // ADC input per axis
+	int m_dma_channel = -1;
+	uint32_t m_ring_passes = 0; // Completed by DMA since sampling started, as of the last filter step
+
+	int32_t m_filtered[2] = {}; // 4 fractional bits
+	bool m_has_samples = false;
+	int16_t m_position[2] = {};
+
+	analogstick_calibration_t m_calibration = {};
+	analogstick_calibration_t m_saved_calibration = {};
+	bool m_calibration_changed = false;
 
-	uint16_t m_x_value = 0;
-	uint16_t m_y_value = 0;
+	alignas(sample_count * sizeof(uint16_t)) uint16_t m_samples[sample_count] = {};
 };
 
 #endif //ANALOGSTICK_H
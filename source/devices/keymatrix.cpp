@@ -35,6 +35,7 @@ void keymatrix_t::update()
 		return;
 
 	m_last_update = now;
+	m_scan_time_us = time_us_64();
 	m_changes = 0;
 
 	for(size_t i = 0; i < m_rows.size(); i ++)
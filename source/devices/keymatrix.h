@@ -24,6 +24,10 @@ public:
 
 	bool has_any_events() const { return m_state != 0 || m_changes != 0; }
 
+	// One bit per key, row by row
+	uint32_t get_state_mask() const { return m_state; }
+	uint64_t get_scan_time_us() const { return m_scan_time_us; }
+
 private:
 	uint32_t index_for_coord(uint32_t row, uint32_t column) const { return row * m_columns.size() + column; };
 
@@ -32,6 +36,7 @@ private:
 	uint32_t m_pending = 0;
 
 	uint32_t m_last_update = 0;
+	uint64_t m_scan_time_us = 0;
 
 	std::span<const uint32_t> m_rows;
 	std::span<const uint32_t> m_columns;
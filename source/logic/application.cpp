@@ -3,13 +3,28 @@
 //
 
 #include <config.h>
+#include <algorithm>
+#include <cctype>
 #include <cstring>
 #include <gui/drawing.h>
 #include <usb/usb_descriptor.h>
 #include <pico/bootrom.h>
-#include <ff.h>
 #include <tiny-json.h>
 #include "application.h"
+#include "settings.h"
+
+// Keys of the persisted runtime settings. The active page of a keymap is stored under its name hash combined with
+// setting_page, the current keymap by name hash, with 0 standing for the system keymap. Only the per keymap pages
+// are evictable, there's one of those for every keymap ever used
+enum : uint32_t
+{
+	setting_brightness = 1,
+	setting_keymap = 2,
+	setting_page = 3,
+	setting_stick_centre = 4, // x | y << 16
+	setting_stick_x_range = 5, // minimum | maximum << 16
+	setting_stick_y_range = 6
+};
 
 void application::init()
 {
@@ -29,8 +44,25 @@ void application::init()
 	m_keymatrix.init(keys_pins_rows, keys_pins_cols);
 	m_analogstick.init(analog_pin_x, analog_pin_y);
 
-	m_previous_analog_x = m_analogstick.get_x_value(display_width);
-	m_previous_analog_y = m_analogstick.get_y_value(display_height);
+	uint32_t centre, x_range, y_range;
+	if(settings_get(setting_stick_centre, &centre) && settings_get(setting_stick_x_range, &x_range) && settings_get(setting_stick_y_range, &y_range))
+	{
+		analogstick_calibration_t calibration;
+		calibration.centre[0] = centre & 0xffff;
+		calibration.centre[1] = centre >> 16;
+		calibration.minimum[0] = x_range & 0xffff;
+		calibration.maximum[0] = x_range >> 16;
+		calibration.minimum[1] = y_range & 0xffff;
+		calibration.maximum[1] = y_range >> 16;
+
+		m_analogstick.set_calibration(calibration);
+	}
+
+	m_stickgesture.suppress();
+
+	uint32_t brightness;
+	if(settings_get(setting_brightness, &brightness))
+		m_brightness = (uint8_t)brightness;
 
 	load_configuration();
 
@@ -46,130 +78,382 @@ void application::usb_ejected()
 
 void application::load_configuration()
 {
-	for(auto &key : m_keymaps)
-		delete key;
+	// Remember where the user was, so a reload can put them back there
+	uint32_t current_name_hash = 0;
+	bool was_on_system = false;
 
-	m_keymaps.clear();
+	if(!m_keymaps.empty())
+	{
+		current_name_hash = get_active_entry().config.name_hash;
+		was_on_system = get_active_entry().is_pinned;
+	}
+	else
+	{
+		// First load since power up, go back to where the user was before
+		uint32_t name_hash;
+		if(settings_get(setting_keymap, &name_hash))
+		{
+			current_name_hash = name_hash;
+			was_on_system = (name_hash == 0);
+		}
+	}
 
+	std::vector<keymap_entry_t> previous = std::move(m_keymaps);
+	m_keymaps.clear();
 
+	flashfs_unmap_file(&m_config);
 	parse_configuration();
-	m_keymaps.push_back(build_system_keymap());
 
-	m_current_keymap = 0;
-	m_needs_redraw = true;
-}
+	retain_keymaps(previous);
 
-void application::parse_configuration()
-{
-	if(m_config_data)
+	for(auto &entry : previous)
 	{
-		delete[] m_config_data;
-		m_config_data = nullptr;
+		if(!entry.is_pinned)
+			delete entry.keymap;
 	}
 
-	FIL file;
+	for(char *source : m_pushed_sources)
+		delete[] source;
 
-	FILINFO info;
-	if(f_stat("/config.json", &info) != FR_OK)
-		return;
+	m_pushed_sources.clear();
+
+	keymap_entry_t system;
+	system.is_pinned = true;
 
-	if(f_open(&file, "/config.json", FA_OPEN_EXISTING | FA_READ) == FR_OK)
+	for(auto &entry : previous)
 	{
-		m_config_data = new char[info.fsize];
-		if(!m_config_data)
-			return;
+		if(entry.is_pinned)
+			system = entry;
+	}
 
-		size_t pool_size = 512;
-		constexpr size_t max_pool_size = (100 * 1024) / sizeof(json_t); // Max 100kb of RAM
+	if(!system.keymap)
+		system.keymap = build_system_keymap();
 
-		while(pool_size < max_pool_size)
-		{
-			json_t *pool = new json_t[pool_size];
-			if(!pool)
-				break;
+	m_keymaps.push_back(system);
 
-			UINT read;
-			if(f_read(&file, m_config_data, info.fsize, &read) != FR_OK)
+	m_current_keymap = m_keymaps.size();
+
+	if(was_on_system)
+		m_current_keymap = m_keymaps.size() - 1;
+	else if(current_name_hash)
+	{
+		for(size_t i = 0; i < m_keymaps.size(); ++ i)
+		{
+			if(m_keymaps[i].config.name_hash == current_name_hash && load_keymap(i))
 			{
-				delete[] pool;
+				m_current_keymap = i;
 				break;
 			}
+		}
+	}
 
-			const json_t *parent = json_create(m_config_data, pool, pool_size);
-			if(!parent)
-			{
-				delete[] pool;
-				pool_size = pool_size + 512;
-			}
+	// Otherwise start out on the first keymap that parses, the system keymap at the end always does
+	if(m_current_keymap == m_keymaps.size())
+	{
+		m_current_keymap = 0;
 
-			if(json_getType(parent) != JSON_ARRAY)
-			{
-				delete[] pool;
-				break;
-			}
+		while(!load_keymap(m_current_keymap))
+			m_current_keymap ++;
+	}
+
+	m_needs_redraw = true;
 
-			for(const json_t *keymap = json_getChild(parent); keymap; keymap = json_getSibling(keymap))
+	activate_layer();
+}
+
+// Moves parsed keymaps whose content (including that of their bases) didn't change over to the new index, and
+// carries over the active page of every keymap that still exists by name. Anything left in `previous` is stale
+void application::retain_keymaps(std::vector<keymap_entry_t> &previous)
+{
+	std::vector<bool> claimed(previous.size(), false);
+
+	for(keymap_entry_t &entry : m_keymaps)
+	{
+		for(size_t i = 0; i < previous.size(); ++ i)
+		{
+			keymap_entry_t &old = previous[i];
+
+			if(old.is_pinned || claimed[i] || old.config.name_hash != entry.config.name_hash)
+				continue;
+
+			entry.active_page = old.active_page;
+
+			if(old.hash == entry.hash)
 			{
-				keymap_t *result = parse_keymap(keymap);
-				if(!result)
-					continue;
+				entry.keymap = old.keymap;
+				entry.last_used = old.last_used;
+				entry.is_invalid = old.is_invalid;
 
-				m_keymaps.push_back(result);
+				old.keymap = nullptr;
 			}
 
-			delete[] pool;
+			claimed[i] = true;
 			break;
 		}
 	}
+
+	// A retained keymap must not outlive its base. Matching hashes make that the rule, but duplicate names could
+	// still pair a keymap with a base that didn't survive, so drop those and let them parse again
+	for(keymap_entry_t &entry : m_keymaps)
+	{
+		if(!entry.keymap || !entry.keymap->base)
+			continue;
+
+		const bool has_base = (entry.base != keymap_t::no_index && m_keymaps[entry.base].keymap == entry.keymap->base);
+
+		if(!has_base)
+		{
+			delete entry.keymap;
+			entry.keymap = nullptr;
+		}
+	}
+
+	for(auto &entry : m_keymaps)
+	{
+		if(entry.keymap)
+			m_keymap_clock = std::max(m_keymap_clock, entry.last_used);
+	}
 }
 
-bool application::update_keypad()
+void application::activate_layer()
 {
-	if(m_process_input)
-		process_input();
+	keymap_entry_t &entry = get_active_entry();
+
+	if(entry.active_page >= entry.keymap->layers.size())
+		entry.active_page = 0;
 
-	const uint16_t stick_x = m_analogstick.get_x_value(display_width);
-	const uint16_t stick_y = m_analogstick.get_y_value(display_height);
+	m_layer_stack.clear();
+	resolve_layer_stack();
+}
+
+void application::resolve_layer_stack()
+{
+	const keymap_entry_t &entry = get_active_entry();
+
+	uint8_t stack[LAYER_STACK_DEPTH + 1];
+	const size_t count = m_layer_stack.get_stack(entry.active_page, stack);
 
-	bool has_stick_input = false;
+	entry.keymap->resolve_stack(stack, count, &m_layer, &m_layer_scratch);
+	m_comboresolver.set_combos(m_layer, entry.keymap->combo_window_ms);
+
+	m_needs_redraw = true;
+}
 
-	if(stick_x < display_left_third && m_previous_analog_x >= display_left_third)
+void application::update_layer_stack(uint8_t key, bool is_press)
+{
+	const resolved_keylayer_t::entry_t *entry = is_press ? m_layer.get_entry(key, m_is_mod) : nullptr;
+
+	if(m_layer_stack.update(key, is_press, entry, get_active_entry().keymap->layers.size()))
+		resolve_layer_stack();
+}
+
+void application::parse_configuration()
+{
+	if(!flashfs_map_file("/config.json", &m_config))
+		return;
+
+	std::vector<config_entry_t> entries;
+	if(!config_index(m_config.data, m_config.size, entries))
+		return;
+
+	m_keymaps.reserve(entries.size() + 1);
+
+	for(const config_entry_t &config : entries)
 	{
-		if(m_process_input)
-			keymap_cycle_layer(false);
+		keymap_entry_t entry;
+		entry.config = config;
+		entry.hash = config.content_hash;
 
-		m_is_mod = false;
-		has_stick_input = true;
+		uint32_t active_page;
+		if(config.name_hash && settings_get(config_hash_combine(config.name_hash, setting_page), &active_page))
+			entry.active_page = (uint8_t)active_page;
+
+		// Bases have to come earlier in the config, which also rules out cycles
+		if(config.inherit_hash)
+		{
+			for(size_t i = 0; i < m_keymaps.size(); ++ i)
+			{
+				if(m_keymaps[i].config.name_hash == config.inherit_hash)
+				{
+					entry.base = (uint16_t)i;
+					entry.hash = config_hash_combine(entry.hash, m_keymaps[i].hash);
+
+					break;
+				}
+			}
+		}
+
+		m_keymaps.push_back(entry);
 	}
-	else if(stick_x > display_right_third && m_previous_analog_x <= display_right_third)
+}
+
+// Upper bound on the number of json_t tiny-json needs. Every value is either the root, or follows a '[', ':' or ','
+static size_t count_json_values(const char *data, size_t size)
+{
+	size_t count = 1;
+
+	for(size_t i = 0; i < size; ++ i)
 	{
-		if(m_process_input)
-			keymap_cycle_layer(true);
+		if(data[i] == '[' || data[i] == ':' || data[i] == ',')
+			count ++;
+	}
 
-		m_is_mod = false;
-		has_stick_input = true;
+	return count;
+}
+
+static keymap_t *parse_keymap_text(const char *text, size_t length, const keymap_t *base)
+{
+	// tiny-json parses in place, so work on a scratch copy of just this keymap and leave the source untouched
+	char *scratch = new char[length + 1];
+	memcpy(scratch, text, length);
+	scratch[length] = '\0';
+
+	constexpr size_t max_pool_size = (100 * 1024) / sizeof(json_t); // Max 100kb of RAM
+	const size_t pool_size = std::min(count_json_values(scratch, length), max_pool_size);
+
+	json_t *pool = new json_t[pool_size];
+	keymap_t *keymap = nullptr;
+
+	if(const json_t *json = json_create(scratch, pool, pool_size))
+		keymap = parse_keymap(json, base);
+
+	delete[] pool;
+	delete[] scratch;
+
+	return keymap;
+}
+
+keymap_t *application::load_keymap(size_t index)
+{
+	keymap_entry_t &entry = m_keymaps[index];
+	entry.last_used = ++ m_keymap_clock;
+
+	if(entry.keymap || entry.is_invalid)
+		return entry.keymap;
+
+	const keymap_t *base = nullptr;
+
+	if(entry.base != keymap_t::no_index)
+		base = load_keymap(entry.base);
+
+	const char *source = entry.source ? entry.source : m_config.data;
+	entry.keymap = parse_keymap_text(source + entry.config.offset, entry.config.length, base);
+
+	entry.is_invalid = (entry.keymap == nullptr);
+
+	if(entry.keymap)
+		evict_keymaps(index);
+
+	return entry.keymap;
+}
+// Drops the parsed keymap and every keymap inheriting from it, they parse again on their next activation
+void application::unload_keymap(size_t index)
+{
+	keymap_entry_t &entry = m_keymaps[index];
+	if(!entry.keymap || entry.is_pinned)
+		return;
+
+	for(size_t i = 0; i < m_keymaps.size(); ++ i)
+	{
+		if(m_keymaps[i].keymap && m_keymaps[i].keymap->base == entry.keymap)
+			unload_keymap(i);
 	}
-	else if(stick_y < display_top_third && m_previous_analog_y >= display_top_third)
+
+	delete entry.keymap;
+
+	entry.keymap = nullptr;
+	entry.is_invalid = false;
+}
+
+void application::evict_keymaps(size_t keep)
+{
+	while(true)
 	{
-		if(m_process_input)
-			keymap_cycle(false);
+		size_t resident = 0;
+		size_t victim = m_keymaps.size();
 
-		m_is_mod = false;
-		has_stick_input = true;
+		for(size_t i = 0; i < m_keymaps.size(); ++ i)
+		{
+			const keymap_entry_t &entry = m_keymaps[i];
+
+			if(!entry.keymap || entry.is_pinned)
+				continue;
+
+			resident ++;
+
+			if(i == keep || i == m_current_keymap || is_keymap_base(entry.keymap))
+				continue;
+
+			if(victim == m_keymaps.size() || entry.last_used < m_keymaps[victim].last_used)
+				victim = i;
+		}
+
+		if(resident <= MAX_RESIDENT_KEYMAPS || victim == m_keymaps.size())
+			return;
+
+		delete m_keymaps[victim].keymap;
+		m_keymaps[victim].keymap = nullptr;
+	}
+}
+
+bool application::is_keymap_base(const keymap_t *keymap) const
+{
+	for(const keymap_entry_t &entry : m_keymaps)
+	{
+		if(entry.keymap && entry.keymap->base == keymap)
+			return true;
 	}
-	else if(stick_y > display_bottom_third && m_previous_analog_y <= display_bottom_third)
+
+	return false;
+}
+
+bool application::update_keypad()
+{
+	if(m_process_input)
+		process_input();
+	else
+		discard_key_events();
+
+	update_stickmouse();
+
+	// The mouse owns the stick until it's released again
+	if(m_stickmouse.is_active())
 	{
-		if(m_process_input)
-			keymap_cycle(true);
+		m_stickgesture.suppress();
+		return false;
+	}
+
+	stickgesture_event_t event;
+	if(!m_stickgesture.update(m_analogstick.get_x_position(), m_analogstick.get_y_position(), time_us_64(), &event))
+		return false;
+
+	const gesturebinding_t binding = get_active_entry().keymap->gestures[(size_t)event.gesture];
+
+	if(m_process_input && binding.is_bound && (binding.repeat || !event.is_repeat))
+		execute_action(binding.action);
 
+	if(event.gesture != gesture_t::centre)
 		m_is_mod = false;
-		has_stick_input = true;
-	}
 
-	m_previous_analog_x = stick_x;
-	m_previous_analog_y = stick_y;
+	return true;
+}
 
-	return has_stick_input;
+void application::update_stickmouse()
+{
+	const stickconfig_t &stick = get_active_entry().keymap->stick;
+
+	// Holding mod turns the stick back into the layer switch
+	const bool is_pointer = m_process_input && !m_is_mod && stick.mode != stickconfig_t::mode_t::layers;
+
+	if(is_pointer)
+		m_stickmouse.advance(stick, m_analogstick.get_x_position(), m_analogstick.get_y_position(), time_us_64());
+	else
+		m_stickmouse.advance(stick, 0, 0, time_us_64());
+
+	stickmouse_report_t report;
+
+	if(tud_hid_ready() && m_stickmouse.take_report(&report))
+		tud_hid_mouse_report(REPORT_ID_MOUSE, report.buttons, report.x, report.y, report.wheel, report.pan);
 }
 
 void application::update()
@@ -179,11 +463,11 @@ void application::update()
 		switch(m_next_state)
 		{
 			case state_t::keypad:
+				usb_set_medium_present(false);
 				load_configuration();
-				usb_set_enabled_features(USB_FEATURE_HID);
 				break;
 			case state_t::configure:
-				usb_set_enabled_features(USB_FEATURE_MSC);
+				usb_set_medium_present(true);
 				break;
 		}
 
@@ -193,9 +477,38 @@ void application::update()
 		return;
 	}
 
+	// Rewriting config.json and parsing it again takes too long for the raw HID callback. One per tick, a whole
+	// config pushed with persist doesn't stall key scanning either
+	if(m_state == state_t::keypad && !m_pending_keymaps.empty())
+	{
+		const pendingkeymap_t pending = m_pending_keymaps.front();
+		m_pending_keymaps.erase(m_pending_keymaps.begin());
+
+		const rawhid_status_t status = persist_keymap(pending.config, pending.text);
+		delete[] pending.text;
+
+		// The activate was answered long ago, the host finds out through the state
+		if(status != rawhid_status_t::ok)
+		{
+			m_persist_failures ++;
+			m_persist_status = status;
+		}
+	}
+
 	m_keymatrix.update();
 	m_analogstick.update();
 
+	if(m_analogstick.has_calibration_changed())
+	{
+		const analogstick_calibration_t &calibration = m_analogstick.get_calibration();
+
+		settings_set(setting_stick_centre, calibration.centre[0] | (calibration.centre[1] << 16));
+		settings_set(setting_stick_x_range, calibration.minimum[0] | (calibration.maximum[0] << 16));
+		settings_set(setting_stick_y_range, calibration.minimum[1] | (calibration.maximum[1] << 16));
+
+		m_analogstick.mark_calibration_saved();
+	}
+
 	const uint32_t now = to_ms_since_boot(get_absolute_time());
 
 	switch(m_state)
@@ -210,6 +523,14 @@ void application::update()
 				m_last_input = now;
 				m_needs_redraw = true;
 			}
+			else if(m_stickmouse.is_active())
+			{
+				// Pointing keeps the screen on, but there's nothing to redraw
+				if(tud_suspended())
+					tud_remote_wakeup();
+
+				m_last_input = now;
+			}
 
 			// Misc logic handling and state transitions
 			if(!m_process_input && m_is_screen_on)
@@ -228,6 +549,14 @@ void application::update()
 			break;
 	}
 
+	// Coarse steps, every redraw holds up the commit for a full display transfer
+	const int16_t commit_progress = flashfs_is_committing() ? (flashfs_get_commit_progress() / 10) * 10 : -1;
+	if(commit_progress != m_commit_progress)
+	{
+		m_commit_progress = commit_progress;
+		m_needs_redraw = true;
+	}
+
 	if(m_needs_redraw)
 	{
 		m_needs_redraw = false;
@@ -268,114 +597,534 @@ void application::set_display_on(bool display_on)
 
 void application::keymap_cycle_layer(bool cycle_next)
 {
-	keymap_t *map = get_active_keymap();
-	uint8_t layer = map->active_page;
+	keymap_entry_t &entry = get_active_entry();
+	const size_t count = entry.keymap->layers.size();
+
+	uint8_t layer = entry.active_page;
 
 	if(!cycle_next)
 	{
 		if(layer == 0)
-			layer = map->layers.size() - 1;
+			layer = count - 1;
 		else
 			layer = layer - 1;
 	}
 	else
-		layer = (layer + 1) % map->layers.size();
+		layer = (layer + 1) % count;
 
-	map->active_page = layer;
+	set_active_page(layer);
 }
 void application::keymap_cycle(bool cycle_next)
 {
-	if(!cycle_next)
+	const size_t count = m_keymaps.size();
+
+	// Keymaps that fail to parse are skipped, the system keymap always loads so this terminates
+	do
 	{
-		if(m_current_keymap == 0)
-			m_current_keymap = m_keymaps.size() - 1;
+		if(!cycle_next)
+		{
+			if(m_current_keymap == 0)
+				m_current_keymap = count - 1;
+			else
+				m_current_keymap = m_current_keymap - 1;
+		}
 		else
-			m_current_keymap = m_current_keymap - 1;
+			m_current_keymap = (m_current_keymap + 1) % count;
+	}
+	while(!load_keymap(m_current_keymap));
+
+	set_active_keymap(m_current_keymap);
+}
+void application::set_active_keymap(size_t index)
+{
+	m_current_keymap = index;
+
+	// Keymaps without a name can't be found again after a reload
+	const keymap_entry_t &entry = get_active_entry();
+	if(entry.is_pinned || entry.config.name_hash)
+		settings_set(setting_keymap, entry.is_pinned ? 0 : entry.config.name_hash);
+
+	activate_layer();
+	m_needs_redraw = true;
+}
+void application::set_active_page(uint8_t page)
+{
+	keymap_entry_t &entry = get_active_entry();
+	entry.active_page = page;
+
+	activate_layer();
+	m_needs_redraw = true;
+
+	if(entry.config.name_hash)
+		settings_set(config_hash_combine(entry.config.name_hash, setting_page), entry.active_page, true);
+}
+
+rawhid_status_t application::select_keymap(size_t index)
+{
+	if(index >= m_keymaps.size() || !load_keymap(index))
+		return rawhid_status_t::not_found;
+
+	// Hosts tend to send the same selection over and over, don't redraw for those
+	if(index != m_current_keymap)
+		set_active_keymap(index);
+
+	return rawhid_status_t::ok;
+}
+rawhid_status_t application::select_keymap_by_name(uint32_t name_hash)
+{
+	for(size_t i = 0; i < m_keymaps.size() && name_hash; ++ i)
+	{
+		if(m_keymaps[i].config.name_hash == name_hash && !m_keymaps[i].is_pinned)
+			return select_keymap(i);
+	}
+
+	return rawhid_status_t::not_found;
+}
+rawhid_status_t application::select_layer(uint8_t layer)
+{
+	if(layer >= get_active_entry().keymap->layers.size())
+		return rawhid_status_t::not_found;
+
+	if(layer != get_active_entry().active_page)
+		set_active_page(layer);
+
+	return rawhid_status_t::ok;
+}
+void application::get_state(rawhid_state_t *state)
+{
+	const keymap_entry_t &entry = get_active_entry();
+
+	state->keymap = (uint16_t)m_current_keymap;
+	state->keymap_count = (uint16_t)m_keymaps.size();
+	state->name_hash = entry.is_pinned ? 0 : entry.config.name_hash;
+	state->layer = entry.active_page;
+	state->layer_count = (uint8_t)entry.keymap->layers.size();
+	state->persists_pending = (uint8_t)std::min<size_t>(m_pending_keymaps.size(), 0xff);
+	state->persist_failures = m_persist_failures;
+	state->persist_status = m_persist_status;
+}
+
+rawhid_status_t application::push_keymap(const char *data, size_t length, bool persist)
+{
+	// Persisting writes config.json through FatFs, which must not happen while the host has the volume
+	if(persist && (m_state != state_t::keypad || m_next_state != state_t::keypad))
+		return rawhid_status_t::busy;
+
+	// Indexed as a config of its own, so it ends up with the same hashes it would have within config.json
+	char *source = new char[length + 2];
+	source[0] = '[';
+	memcpy(source + 1, data, length);
+	source[length + 1] = ']';
+
+	std::vector<config_entry_t> entries;
+	if(!config_index(source, length + 2, entries) || entries.size() != 1)
+	{
+		delete[] source;
+		return rawhid_status_t::invalid_keymap;
+	}
+
+	keymap_entry_t entry;
+	entry.config = entries[0];
+	entry.source = source;
+	entry.hash = entry.config.content_hash;
+
+	// Takes the place of the first keymap with the same name, new ones go right before the system keymap
+	const size_t system = m_keymaps.size() - 1;
+	size_t index = system;
+
+	for(size_t i = 0; i < system && entry.config.name_hash; ++ i)
+	{
+		if(m_keymaps[i].config.name_hash == entry.config.name_hash)
+		{
+			index = i;
+			break;
+		}
+	}
+
+	// Same as within the config, bases have to come first
+	for(size_t i = 0; i < index && entry.config.inherit_hash; ++ i)
+	{
+		if(m_keymaps[i].config.name_hash == entry.config.inherit_hash)
+		{
+			entry.base = (uint16_t)i;
+			entry.hash = config_hash_combine(entry.hash, m_keymaps[i].hash);
+
+			break;
+		}
+	}
+
+	// Parse before touching anything, a broken keymap leaves everything as it was
+	const keymap_t *base = (entry.base != keymap_t::no_index) ? load_keymap(entry.base) : nullptr;
+	entry.keymap = parse_keymap_text(source + entry.config.offset, entry.config.length, base);
+
+	if(!entry.keymap)
+	{
+		delete[] source;
+		return rawhid_status_t::invalid_keymap;
+	}
+
+	entry.last_used = ++ m_keymap_clock;
+
+	if(index == system)
+	{
+		m_keymaps.insert(m_keymaps.begin() + index, entry);
+
+		if(m_current_keymap >= index)
+			m_current_keymap ++;
+	}
+	else
+	{
+		keymap_entry_t &previous = m_keymaps[index];
+		entry.active_page = previous.active_page;
+
+		unload_keymap(index);
+
+		auto iterator = std::find(m_pushed_sources.begin(), m_pushed_sources.end(), previous.source);
+		if(iterator != m_pushed_sources.end())
+		{
+			delete[] *iterator;
+			m_pushed_sources.erase(iterator);
+		}
+
+		previous = entry;
+	}
+
+	m_pushed_sources.push_back(source);
+
+	set_active_keymap(index);
+	evict_keymaps(index);
+
+	if(persist)
+	{
+		pendingkeymap_t pending;
+		pending.config = entry.config;
+		pending.config.offset = 0;
+		pending.text = new char[entry.config.length];
+
+		memcpy(pending.text, source + entry.config.offset, entry.config.length);
+		m_pending_keymaps.push_back(pending);
+	}
+
+	return rawhid_status_t::ok;
+}
+
+// Splices the keymap into config.json in place of the one with the same name, or appends it to the array
+rawhid_status_t application::persist_keymap(const config_entry_t &config, const char *source)
+{
+	const char *text = source + config.offset;
+
+	static const char empty_config[] = "[\n]\n";
+
+	const char *data = m_config.data ? m_config.data : empty_config;
+	const size_t size = m_config.data ? m_config.size : strlen(empty_config);
+
+	// Never clobber a config the user still has to fix
+	std::vector<config_entry_t> entries;
+	if(!config_index(data, size, entries))
+		return rawhid_status_t::invalid_keymap;
+
+	flashfs_part_t parts[5];
+	size_t count = 0;
+
+	const config_entry_t *existing = nullptr;
+
+	for(const config_entry_t &entry : entries)
+	{
+		if(config.name_hash && entry.name_hash == config.name_hash)
+		{
+			existing = &entry;
+			break;
+		}
+	}
+
+	if(existing)
+	{
+		const size_t end = existing->offset + existing->length;
+
+		parts[count ++] = { data, existing->offset };
+		parts[count ++] = { text, config.length };
+		parts[count ++] = { data + end, size - end };
 	}
 	else
-		m_current_keymap = (m_current_keymap + 1) % m_keymaps.size();
+	{
+		size_t close = size;
+		while(data[close - 1] != ']')
+			close --;
+
+		close --;
+
+		size_t last = close;
+		while(last > 0 && isspace((unsigned char)data[last - 1]))
+			last --;
+
+		const char *separator = (data[last - 1] == '[') ? "\n\t" : ",\n\t";
+
+		parts[count ++] = { data, last };
+		parts[count ++] = { separator, strlen(separator) };
+		parts[count ++] = { text, config.length };
+		parts[count ++] = { "\n", 1 };
+		parts[count ++] = { data + close, size - close };
+	}
+
+	const bool result = flashfs_write_file("/config.json", parts, count);
+
+	// Offsets into the old config are stale now. The pushed keymap is kept, its hash matches the new entry
+	load_configuration();
+	return result ? rawhid_status_t::ok : rawhid_status_t::io_error;
+}
+
+void application::collect_key_events()
+{
+	const uint32_t matrix = m_keymatrix.get_state_mask();
+	const uint32_t changes = matrix ^ m_matrix_state;
+
+	for(uint8_t index = 0; index < num_keys; ++ index)
+	{
+		if(!(changes & (1 << index)))
+			continue;
+
+		keyevent_t event = {};
+		event.time_us = m_keymatrix.get_scan_time_us();
+		event.key = index;
+		event.is_press = matrix & (1 << index);
+
+		m_comboresolver.push(event);
+	}
+
+	m_matrix_state = matrix;
+
+	const uint64_t now_us = time_us_64();
+	m_comboresolver.update(now_us);
+
+	// Combos come out as keys of their own, so they can be tap-hold keys too
+	keyevent_t event;
+
+	while(m_comboresolver.pop(&event))
+	{
+		const resolved_keylayer_t::entry_t *entry = m_layer.get_entry(event.key, m_is_mod);
+		m_keyresolver.push(event, (event.is_press && entry) ? entry->get_tap_hold() : nullptr);
+	}
+
+	m_keyresolver.update(now_us);
+}
+
+void application::discard_key_events()
+{
+	// Keys held right now only count once they're pressed again
+	m_matrix_state = m_keymatrix.get_state_mask();
+	m_key_state = 0;
+
+	m_comboresolver.reset();
+	m_keyresolver.reset();
+
+	// Only toggled and waiting one-shot layers outlive the keys
+	if(m_layer_stack.release_keys())
+		resolve_layer_stack();
 }
 
 void application::process_input()
 {
-	hid_keyboard_report_t state = {};
-	uint8_t pressed = 0;
+	collect_key_events();
 
-	keymap_t *map = get_active_keymap();
-	const keylayer_t &layer = map->layers[map->active_page];
+	// One change per report, so events that were held back keep their order on the host
+	uint32_t pressed_keys = 0;
+	uint32_t changed_keys = 0;
 
-	for(uint32_t i = 0; i < num_key_rows; ++ i)
+	keyevent_t event;
+
+	if(!m_is_report_pending && m_keyresolver.pop(&event))
 	{
-		for(uint32_t j = 0; j < num_key_cols; j ++)
+		const uint32_t bit = 1 << event.key;
+
+		if(event.is_press)
 		{
-			const keymacro_t &macro = layer.macros[i * num_key_cols + j];
+			m_key_state |= bit;
+			pressed_keys = bit;
+		}
+		else
+		{
+			m_key_state &= ~bit;
+		}
+
+		m_key_roles[event.key] = event.role;
+		m_is_report_pending = true;
+
+		changed_keys = bit;
+
+		update_layer_stack(event.key, event.is_press);
+	}
+
+	hid_keyboard_report_t &state = m_matrix_report;
+	uint8_t pressed = 0;
+
+	state = {};
+
+	for(uint32_t index = 0; index < num_key_slots; ++ index)
+	{
+		const uint32_t bit = 1 << index;
+
+		const resolved_keylayer_t::entry_t *entry = m_layer.get_entry(index, false);
+		if(!entry)
+			continue;
 
-			if(macro.type == keymacro_t::type_t::mod)
+		const keymacro_t macro = entry->macro;
+
+		if(macro.get_type() == keymacro_t::type_t::mod)
+		{
+			if(macro.get_persist())
 			{
-				if(macro.mod.persist)
-				{
-					if(m_keymatrix.has_changed_to_enabled(i, j))
-						m_is_mod = !m_is_mod;
-				}
-				else
-				{
-					m_is_mod = m_keymatrix.get_state(i, j);
-				}
+				if(pressed_keys & bit)
+					m_is_mod = !m_is_mod;
+			}
+			else if(index < num_keys || (changed_keys & bit))
+			{
+				m_is_mod = m_key_state & bit;
 			}
 		}
+		else if(entry->get_tap_hold() && (entry->get_tap_hold()->flags & taphold_t::hold_mod))
+		{
+			if((changed_keys & bit) && m_key_roles[index] == keyrole_t::hold)
+				m_is_mod = m_key_state & bit;
+		}
 	}
 
-	for(uint32_t i = 0; i < num_key_rows; ++ i)
+	for(uint32_t index = 0; index < num_key_slots; ++ index)
 	{
-		for(uint32_t j = 0; j < num_key_cols; j ++)
+		const uint32_t bit = 1 << index;
+
+		if(!(m_key_state & bit))
+			continue;
+
+		const resolved_keylayer_t::entry_t *entry = m_layer.get_entry(index, m_is_mod);
+		if(!entry)
+			continue;
+
+		const keymacro_t macro = entry->macro;
+
+		switch(macro.get_type())
 		{
-			if(m_keymatrix.get_state(i, j))
+			case keymacro_t::type_t::hid_key:
 			{
-				const keymacro_t &macro = m_is_mod ? layer.mod_macros[i * num_key_cols + j] : layer.macros[i * num_key_cols + j];
-
-				switch(macro.type)
+				if(pressed < 6)
 				{
-					case keymacro_t::type_t::hid_key:
-					{
-						if(pressed < 6)
-						{
-							state.modifier |= macro.hid_key.modifier;
-							state.keycode[pressed ++] = macro.hid_key.keycode;
-						}
+					state.modifier |= entry->modifier;
+					state.keycode[pressed ++] = macro.get_keycode();
+				}
 
-						break;
-					}
+				break;
+			}
 
-					case keymacro_t::type_t::action:
-					{
-						execute_action(macro.action.action);
-						break;
-					}
+			case keymacro_t::type_t::action:
+			{
+				// Once per press, holding a key used to repeat the action on every update
+				if(pressed_keys & bit)
+					execute_action(macro.get_action());
 
-					case keymacro_t::type_t::none:
-					case keymacro_t::type_t::mod:
-						break;
+				break;
+			}
+
+			case keymacro_t::type_t::sequence:
+			{
+				if((pressed_keys & bit) && entry->get_sequence())
+					m_sequenceplayer.start(entry->get_sequence());
+
+				break;
+			}
+
+			case keymacro_t::type_t::tap_hold:
+			{
+				const taphold_t *tap_hold = entry->get_tap_hold();
+
+				if(!tap_hold)
+					break;
+
+				if(m_key_roles[index] == keyrole_t::hold)
+				{
+					if(!(tap_hold->flags & taphold_t::hold_mod))
+						state.modifier |= tap_hold->hold_modifier;
+				}
+				else if(pressed < 6)
+				{
+					// Tapped keys are only down for as long as the release takes to come out
+					state.modifier |= entry->modifier;
+					state.keycode[pressed ++] = tap_hold->keycode;
 				}
 
+				break;
 			}
+
+			case keymacro_t::type_t::none:
+			case keymacro_t::type_t::mod:
+			case keymacro_t::type_t::layer:
+			case keymacro_t::type_t::transparent:
+				break;
 		}
 	}
 
-	if(!tud_hid_ready())
-		return;
+	send_keyboard_report();
+}
 
-	if(pressed > 0 || (pressed == 0 && m_any_key_down))
+void application::hid_report_sent()
+{
+	// Straight from the completion, so a playing sequence gets a report out on every poll
+	if(m_state == state_t::keypad && m_process_input)
+		send_keyboard_report();
+}
+
+void application::send_keyboard_report()
+{
+	const uint64_t now_us = time_us_64();
+
+	while(true)
 	{
-		if(pressed > 0)
+		// A playing sequence adds its keys on top of whatever is held on the matrix
+		const bool has_advanced = m_sequenceplayer.advance(now_us);
+
+		hid_keyboard_report_t state = m_matrix_report;
+		uint8_t pressed = (uint8_t)(std::find(state.keycode, state.keycode + 6, HID_KEY_NONE) - state.keycode);
+
+		const hid_keyboard_report_t &sequence = m_sequenceplayer.get_report();
+		state.modifier |= sequence.modifier | m_stickmouse.get_modifier();
+
+		for(uint8_t keycode : sequence.keycode)
 		{
-			tud_hid_keyboard_report(REPORT_ID_KEYBOARD, state.modifier, state.keycode);
-			m_any_key_down = true;
+			if(keycode != HID_KEY_NONE && pressed < 6 && std::find(state.keycode, state.keycode + pressed, keycode) == state.keycode + pressed)
+				state.keycode[pressed ++] = keycode;
 		}
-		else if(m_any_key_down)
+
+		if(!tud_hid_ready())
+		{
+			// Nothing goes out while the host is away, so nothing should wait for it either
+			if(!tud_mounted() || tud_suspended())
+			{
+				m_sequenceplayer.mark_sent();
+				m_is_report_pending = false;
+			}
+
+			return;
+		}
+
+		// Only changes go out, so the endpoint stays free for mouse reports in between. A sequence step that
+		// changes nothing, eg. a key that's also held on the matrix, moves straight on to the next one
+		if(memcmp(&state, &m_keyboard_report, sizeof(state)) == 0)
+		{
+			m_sequenceplayer.mark_sent();
+			m_is_report_pending = false;
+
+			if(has_advanced)
+				continue;
+
+			return;
+		}
+
+		if(tud_hid_keyboard_report(REPORT_ID_KEYBOARD, state.modifier, state.keycode))
 		{
-			tud_hid_keyboard_report(REPORT_ID_KEYBOARD, 0, nullptr);
-			m_any_key_down = false;
+			m_keyboard_report = state;
+			m_sequenceplayer.mark_sent();
+			m_is_report_pending = false;
 		}
+
+		return;
 	}
 }
 
@@ -409,6 +1158,7 @@ void application::execute_action(action_t action)
 				m_brightness = 5;
 
 			m_display.set_contrast(m_brightness);
+			settings_set(setting_brightness, m_brightness);
 			break;
 		}
 
@@ -420,6 +1170,28 @@ void application::execute_action(action_t action)
 				m_brightness = 255;
 
 			m_display.set_contrast(m_brightness);
+			settings_set(setting_brightness, m_brightness);
+			break;
+		}
+
+		case action_t::calibrate_stick:
+		{
+			// Meant to be pressed with the stick at rest, the range is learned again from there
+			m_analogstick.calibrate_centre();
+			break;
+		}
+
+		case action_t::previous_layer:
+		case action_t::next_layer:
+		{
+			keymap_cycle_layer(action == action_t::next_layer);
+			break;
+		}
+
+		case action_t::previous_keymap:
+		case action_t::next_keymap:
+		{
+			keymap_cycle(action == action_t::next_keymap);
 			break;
 		}
 	}
@@ -432,7 +1204,10 @@ void application::draw()
 	switch(m_state)
 	{
 		case state_t::keypad:
-			draw_active_keymap();
+			if(m_commit_progress >= 0)
+				draw_commit_progress();
+			else
+				draw_active_keymap();
 			break;
 
 		case state_t::configure:
@@ -441,20 +1216,35 @@ void application::draw()
 	}
 }
 
+void application::draw_commit_progress()
+{
+	const uint16_t bar_y = (display_height + font_height) / 2 + 4;
+	const uint16_t bar_width = display_width - 16;
+
+	draw_string(&m_display, "Saving...", true, 0, (display_height - font_height) / 2, display_width, text_justification_t::center);
+
+	m_display.stroke_line_horizontal(8, bar_y, bar_width, true);
+	m_display.stroke_line_horizontal(8, bar_y + 5, bar_width, true);
+	m_display.fill_rect(8, bar_y, 1, 6, true);
+	m_display.fill_rect(8 + bar_width - 1, bar_y, 1, 6, true);
+
+	m_display.fill_rect(8, bar_y, (bar_width * m_commit_progress) / 100, 6, true);
+}
+
 void application::draw_active_keymap()
 {
-	keymap_t *keymap = get_active_keymap();
-	const keylayer_t &layer = keymap->layers[keymap->active_page];
+	const keymap_entry_t &entry = get_active_entry();
+	const keymap_t *keymap = entry.keymap;
 
 	{
-		uint16_t offset = draw_string(&m_display, keymap->name, true, 0, 0, display_width);
+		uint16_t offset = draw_string(&m_display, keymap->get_name(), true, 0, 0, display_width);
 
-		if(layer.name)
+		if(m_layer.name)
 		{
 			offset += 1;
 			offset += draw_string(&m_display, "|", true, offset, 0, display_width) + 1;
 
-			draw_string(&m_display, layer.name, true, offset, 0, display_width);
+			draw_string(&m_display, m_layer.name, true, offset, 0, display_width);
 		}
 
 		m_display.stroke_line_horizontal(0, font_height, display_width, true);
@@ -462,7 +1252,7 @@ void application::draw_active_keymap()
 		if(keymap->layers.size() > 1)
 		{
 			char text[16];
-			sprintf(text, "%d/%d", (int)(keymap->active_page + 1), (int)keymap->layers.size());
+			sprintf(text, "%d/%d", (int)(entry.active_page + 1), (int)keymap->layers.size());
 
 			draw_string(&m_display, text, true, 0, 0, display_width, text_justification_t::right);
 		}
@@ -471,11 +1261,14 @@ void application::draw_active_keymap()
 	const uint32_t width = display_width / num_key_cols;
 	const uint32_t height = (display_height - 8) / num_key_rows;
 
+	const resolved_keylayer_t::entry_t *macros = m_layer.get_macros(m_is_mod);
+
 	for(uint32_t x = 0; x < num_key_cols; ++ x)
 	{
 		for(uint32_t y = 0; y < num_key_rows; ++ y)
 		{
-			const keymacro_t &macro = m_is_mod ? layer.mod_macros[y * num_key_cols + x] : layer.macros[y * num_key_cols + x];
+			const resolved_keylayer_t::entry_t &entry = macros[y * num_key_cols + x];
+			const keymacro_t macro = entry.macro;
 
 			char string[32] = {};
 			const uint8_t max_length = width / font_width;
@@ -489,22 +1282,25 @@ void application::draw_active_keymap()
 
 			uint8_t length = 0;
 
-			switch(macro.type)
+			switch(macro.get_type())
 			{
 				case keymacro_t::type_t::none:
+				case keymacro_t::type_t::transparent:
 					length += strlcpy(string + length, "None", max_length - length);
 					break;
 
 				case keymacro_t::type_t::hid_key:
+				case keymacro_t::type_t::tap_hold:
 				{
-					if(macro.hid_key.label && macro.hid_key.label[0] != '\0')
+					if(entry.label && entry.label[0] != '\0')
 					{
-						length += strlcpy(string + length, macro.hid_key.label, max_length - length);
+						length += strlcpy(string + length, entry.label, max_length - length);
 						break;
 					}
 
-					const uint8_t modifier = macro.hid_key.modifier;
-					const uint8_t keycode = macro.hid_key.keycode;
+					// Tap-hold keys show what they send on a tap
+					const uint8_t modifier = entry.modifier;
+					const uint8_t keycode = entry.get_tap_hold() ? entry.get_tap_hold()->keycode : macro.get_keycode();
 
 					if(modifier != 0)
 					{
@@ -684,7 +1480,7 @@ void application::draw_active_keymap()
 				}
 				case keymacro_t::type_t::action:
 				{
-					switch(macro.action.action)
+					switch(macro.get_action())
 					{
 						case action_t::flash:
 							length += strlcpy(string + length, "Flash", max_length - length);
@@ -698,6 +1494,21 @@ void application::draw_active_keymap()
 						case action_t::brightness_up:
 							length += strlcpy(string + length, "Brt +", max_length - length);
 							break;
+						case action_t::calibrate_stick:
+							length += strlcpy(string + length, "Calib", max_length - length);
+							break;
+						case action_t::previous_layer:
+							length += strlcpy(string + length, "Lyr -", max_length - length);
+							break;
+						case action_t::next_layer:
+							length += strlcpy(string + length, "Lyr +", max_length - length);
+							break;
+						case action_t::previous_keymap:
+							length += strlcpy(string + length, "Map -", max_length - length);
+							break;
+						case action_t::next_keymap:
+							length += strlcpy(string + length, "Map +", max_length - length);
+							break;
 					}
 
 					break;
@@ -706,6 +1517,32 @@ void application::draw_active_keymap()
 				case keymacro_t::type_t::mod:
 					length += strlcpy(string + length, "Mod", max_length - length);
 					break;
+
+				case keymacro_t::type_t::sequence:
+					length += strlcpy(string + length, (entry.label && entry.label[0] != '\0') ? entry.label : "Macro", max_length - length);
+					break;
+
+				case keymacro_t::type_t::layer:
+				{
+					if(entry.label && entry.label[0] != '\0')
+					{
+						length += strlcpy(string + length, entry.label, max_length - length);
+						break;
+					}
+
+					const char *prefix = "Lyr";
+
+					if(macro.get_layer_mode() == layermode_t::toggle)
+						prefix = "Tgl";
+					else if(macro.get_layer_mode() == layermode_t::one_shot)
+						prefix = "One";
+
+					const int written = snprintf(string + length, max_length - length, "%s %d", prefix, (int)macro.get_layer() + 1);
+					if(written > 0)
+						length = (uint8_t)std::min<int>(length + written, max_length - 1);
+
+					break;
+				}
 			}
 
 			if(length > 0)
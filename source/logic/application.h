@@ -10,10 +10,44 @@
 #include "../devices/analogstick.h"
 
 #include "keylayer.h"
+#include "configindex.h"
+#include "flashfs.h"
+#include "stickmouse.h"
+#include "stickgesture.h"
+#include "sequenceplayer.h"
+#include "comboresolver.h"
+#include "tapholdresolver.h"
+#include "layerstack.h"
+#include "../usb/usb_rawhid.h"
 
 #define SCREEN_TIMEOUT_CONNECTED_MS     (15 * 60 * 1000)
 #define SCREEN_TIMEOUT_DISCONNECTED_MS  (10 * 1000)
 
+#define MAX_RESIDENT_KEYMAPS 4
+
+struct keymap_entry_t
+{
+	config_entry_t config = {};
+	const char *source = nullptr; // Text the config range refers to, nullptr for config.json
+	keymap_t *keymap = nullptr;   // Parsed on first activation
+
+	uint32_t hash = 0;                  // Content hash, combined with that of the base
+	uint16_t base = keymap_t::no_index; // Index of the keymap this one inherits from
+
+	uint32_t last_used = 0;
+	uint8_t active_page = 0;
+
+	bool is_pinned = false;     // Never evicted, eg. the built-in system keymap
+	bool is_invalid = false;    // Failed to parse, skipped when cycling
+};
+
+// Keymap pushed with persist, spliced into config.json from update() rather than the raw HID callback
+struct pendingkeymap_t
+{
+	config_entry_t config; // Offset into text, which is a copy of its own
+	char *text;
+};
+
 class application
 {
 public:
@@ -25,6 +59,22 @@ public:
 	void usb_state_changed();
 	void usb_ejected();
 
+	// Replaces the keymap with the same name, or adds it, and switches to it. Pushed keymaps only live in RAM
+	// until the next reload, unless persisted into config.json, which happens from update() later on
+	rawhid_status_t push_keymap(const char *data, size_t length, bool persist);
+
+	rawhid_status_t select_keymap(size_t index);
+	rawhid_status_t select_keymap_by_name(uint32_t name_hash);
+	rawhid_status_t select_layer(uint8_t layer);
+	void get_state(rawhid_state_t *state);
+
+	// The host picked up the last keyboard or mouse report
+	void hid_report_sent();
+
+	// True while the stick drives the mouse, a sequence plays or key events are queued up, reports should go out
+	// at the poll rate then
+	bool wants_fast_updates() const { return m_stickmouse.is_active() || m_sequenceplayer.is_playing() || !m_comboresolver.is_idle() || !m_keyresolver.is_idle(); }
+
 private:
 	enum class state_t
 	{
@@ -34,18 +84,35 @@ private:
 
 	void load_configuration();
 	void parse_configuration();
+	void retain_keymaps(std::vector<keymap_entry_t> &previous);
 
 	void set_display_on(bool display_on);
 
 	void draw();
 	void draw_active_keymap();
+	void draw_commit_progress();
 
 	bool update_keypad();
+	void update_stickmouse();
 
+	void collect_key_events();
+	void discard_key_events();
 	void process_input();
+	void send_keyboard_report();
 	void execute_action(action_t action);
 
-	keymap_t *get_active_keymap() const { return m_keymaps[m_current_keymap]; }
+	keymap_entry_t &get_active_entry() { return m_keymaps[m_current_keymap]; }
+
+	keymap_t *load_keymap(size_t index);
+	void unload_keymap(size_t index);
+	void evict_keymaps(size_t keep);
+	bool is_keymap_base(const keymap_t *keymap) const;
+	void set_active_keymap(size_t index);
+	void set_active_page(uint8_t page);
+	rawhid_status_t persist_keymap(const config_entry_t &config, const char *text);
+	void activate_layer();
+	void resolve_layer_stack();
+	void update_layer_stack(uint8_t key, bool is_press);
 
 	void keymap_cycle_layer(bool cycle_next);
 	void keymap_cycle(bool cycle_next);
@@ -57,11 +124,10 @@ private:
 	keymatrix_t m_keymatrix;
 	analogstick_t m_analogstick;
 
-	uint16_t m_previous_analog_x;
-	uint16_t m_previous_analog_y;
+	stickmouse_t m_stickmouse;
+	stickgesture_t m_stickgesture;
 
 	bool m_is_mod = false;
-	bool m_any_key_down = false;
 	bool m_needs_redraw = false;
 
 	bool m_is_connected = false;
@@ -70,13 +136,37 @@ private:
 	uint8_t m_brightness = 5;
 	uint32_t m_last_input;
 
+	int16_t m_commit_progress = -1; // Last drawn, -1 while no commit is running
+
 	bool m_is_screen_on = false;
 	uint32_t m_screen_timeout = SCREEN_TIMEOUT_DISCONNECTED_MS;
 
-	std::vector<keymap_t *> m_keymaps;
-	size_t m_current_keymap = 0;
+	flashfs_mapping_t m_config;
+	std::vector<char *> m_pushed_sources; // Freed on reload
+	std::vector<pendingkeymap_t> m_pending_keymaps; // Oldest first
+	uint8_t m_persist_failures = 0;
+	rawhid_status_t m_persist_status = rawhid_status_t::ok; // Of the last failure
 
-	char *m_config_data = nullptr;
+	std::vector<keymap_entry_t> m_keymaps;
+	size_t m_current_keymap = 0;
+	uint32_t m_keymap_clock = 0;
+
+	// Active page with the layer stack on top, flattened again whenever the stack changes
+	resolved_keylayer_t m_layer;
+	resolved_keylayer_t m_layer_scratch; // Each stacked layer on its way into m_layer
+	layerstack_t m_layer_stack;
+
+	// Matrix changes pass through the combo and tap-hold resolvers before they count as key presses
+	comboresolver_t m_comboresolver;
+	tapholdresolver_t m_keyresolver;
+	uint32_t m_matrix_state = 0;
+	uint32_t m_key_state = 0; // One bit per key slot
+	keyrole_t m_key_roles[num_key_slots] = {};
+	bool m_is_report_pending = false; // A key event was applied, the next one waits until it's been reported
+
+	hid_keyboard_report_t m_matrix_report = {};   // Keys held on the matrix
+	hid_keyboard_report_t m_keyboard_report = {}; // Last one sent
+	sequenceplayer_t m_sequenceplayer;
 };
 
 #endif //MACROPAD_APPLICATION_H
\ No newline at end of file
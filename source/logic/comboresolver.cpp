@@ -0,0 +1,154 @@
+#include <algorithm>
+#include <iterator>
+#include "comboresolver.h"
+
+static uint16_t get_buffer_mask(const keyevent_t *events, size_t count)
+{
+	uint16_t mask = 0;
+
+	for(size_t i = 0; i < count; ++ i)
+		mask |= 1 << events[i].key;
+
+	return mask;
+}
+
+void comboresolver_t::set_combos(const resolved_keylayer_t &layer, uint16_t window_ms)
+{
+	m_combo_count = layer.combo_count;
+	m_combo_keys = 0;
+	m_window_us = window_ms * 1000;
+
+	for(size_t i = 0; i < m_combo_count; ++ i)
+	{
+		m_masks[i] = layer.combos[i].mask;
+		m_combo_keys |= m_masks[i];
+	}
+}
+
+void comboresolver_t::reset()
+{
+	m_buffer_count = 0;
+	m_consumed = 0;
+
+	std::fill(std::begin(m_active_masks), std::end(m_active_masks), 0);
+	m_output.clear();
+}
+
+void comboresolver_t::fire(size_t combo, size_t count)
+{
+	const uint16_t mask = m_masks[combo];
+
+	keyevent_t event = {};
+	event.time_us = m_buffer[count - 1].time_us;
+	event.key = (uint8_t)(num_keys + combo);
+	event.is_press = true;
+
+	m_output.push(event);
+
+	m_active_masks[combo] = mask;
+	m_consumed |= mask;
+
+	std::copy(m_buffer + count, m_buffer + m_buffer_count, m_buffer);
+	m_buffer_count -= count;
+}
+
+void comboresolver_t::release(size_t count)
+{
+	for(size_t i = 0; i < count; ++ i)
+		m_output.push(m_buffer[i]);
+
+	std::copy(m_buffer + count, m_buffer + m_buffer_count, m_buffer);
+	m_buffer_count -= count;
+}
+
+void comboresolver_t::settle(bool expired)
+{
+	while(m_buffer_count > 0)
+	{
+		// Longest run of buffered presses, from the first one on, that exactly matches a combo
+		for(size_t count = m_buffer_count; count > 0; -- count)
+		{
+			const uint16_t mask = get_buffer_mask(m_buffer, count);
+
+			bool could_grow = false;
+			size_t exact = max_layer_combos;
+
+			for(size_t i = 0; i < m_combo_count; ++ i)
+			{
+				if((m_masks[i] & mask) != mask)
+					continue;
+
+				if(m_masks[i] == mask)
+					exact = i;
+				else
+					could_grow = true;
+			}
+
+			// Everything that's down so far could still turn into a longer combo
+			if(count == m_buffer_count && could_grow && !expired)
+				return;
+
+			if(exact < max_layer_combos)
+			{
+				fire(exact, count);
+				break;
+			}
+
+			// Nothing matches, the first press goes out as it is and the rest gets another look
+			if(count == 1)
+				release(1);
+		}
+	}
+}
+
+void comboresolver_t::push(const keyevent_t &event)
+{
+	const uint16_t bit = 1 << event.key;
+
+	if(event.is_press)
+	{
+		if(m_combo_keys & bit)
+		{
+			m_buffer[m_buffer_count ++] = event;
+			settle(false);
+
+			return;
+		}
+
+		// Whatever is buffered was pressed first
+		settle(true);
+		m_output.push(event);
+
+		return;
+	}
+
+	if(m_buffer_count > 0 && (get_buffer_mask(m_buffer, m_buffer_count) & bit))
+		settle(true);
+
+	if(m_consumed & bit)
+	{
+		m_consumed &= ~bit;
+
+		for(size_t i = 0; i < max_layer_combos; ++ i)
+		{
+			if(!(m_active_masks[i] & bit))
+				continue;
+
+			keyevent_t combo = event;
+			combo.key = (uint8_t)(num_keys + i);
+
+			m_output.push(combo);
+			m_active_masks[i] = 0;
+		}
+
+		return;
+	}
+
+	m_output.push(event);
+}
+
+void comboresolver_t::update(uint64_t now_us)
+{
+	if(m_buffer_count > 0 && now_us >= m_buffer[0].time_us + m_window_us)
+		settle(true);
+}
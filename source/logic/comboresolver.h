@@ -0,0 +1,49 @@
+#ifndef MACROPAD_COMBORESOLVER_H
+#define MACROPAD_COMBORESOLVER_H
+
+#include <cstdint>
+#include "keylayer.h"
+#include "keyevent.h"
+
+// Turns keys pressed together into combos. Presses of keys that are part of a combo are held back until they
+// exactly match a combo that can't grow into a longer one, or until the combo window runs out. Matching is one
+// AND and compare per combo. Keys that are in no combo at all pass straight through. A combo comes out as a key
+// of its own, num_keys + its index, and is released along with the first of its keys
+class comboresolver_t
+{
+public:
+	comboresolver_t() = default;
+
+	// Combos that already went down still get released when the table changes
+	void set_combos(const resolved_keylayer_t &layer, uint16_t window_ms);
+
+	void push(const keyevent_t &event);
+	// Lets the combo window run out
+	void update(uint64_t now_us);
+
+	bool pop(keyevent_t *event) { return m_output.pop(event); }
+	bool is_idle() const { return m_buffer_count == 0 && m_output.is_empty(); }
+
+	void reset();
+
+private:
+	// Settles what's buffered, with expired set longer combos are no longer waited for
+	void settle(bool expired);
+	void fire(size_t combo, size_t count);
+	void release(size_t count);
+
+	uint16_t m_masks[max_layer_combos] = {};
+	size_t m_combo_count = 0;
+	uint16_t m_combo_keys = 0; // Keys that are part of any combo
+	uint32_t m_window_us = COMBO_DEFAULT_WINDOW_MS * 1000;
+
+	keyevent_t m_buffer[num_keys] = {}; // Held back presses in order
+	size_t m_buffer_count = 0;
+
+	uint16_t m_active_masks[max_layer_combos] = {}; // Keys of combos that are down
+	uint16_t m_consumed = 0; // Keys of combos that went down, their releases are swallowed
+
+	keyeventqueue_t m_output;
+};
+
+#endif //MACROPAD_COMBORESOLVER_H
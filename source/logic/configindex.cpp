@@ -0,0 +1,204 @@
+#include <cstring>
+#include "configindex.h"
+
+uint32_t config_hash(const char *data, size_t length)
+{
+	uint32_t hash = 2166136261u;
+
+	for(size_t i = 0; i < length; ++ i)
+	{
+		hash ^= (uint8_t)data[i];
+		hash *= 16777619u;
+	}
+
+	return hash ? hash : 1;
+}
+
+uint32_t config_hash_combine(uint32_t hash, uint32_t other)
+{
+	for(size_t i = 0; i < sizeof(other); ++ i)
+	{
+		hash ^= (other >> (i * 8)) & 0xff;
+		hash *= 16777619u;
+	}
+
+	return hash ? hash : 1;
+}
+
+struct scanner_t
+{
+	const char *data;
+	size_t size;
+	size_t position;
+
+	bool at_end() const { return position >= size; }
+	char peek() const { return at_end() ? '\0' : data[position]; }
+
+	void skip_whitespace()
+	{
+		while(!at_end() && (data[position] == ' ' || data[position] == '\t' || data[position] == '\n' || data[position] == '\r'))
+			position ++;
+	}
+
+	bool consume(char c)
+	{
+		skip_whitespace();
+
+		if(peek() != c)
+			return false;
+
+		position ++;
+		return true;
+	}
+
+	// Expects to be on the opening quote, leaves the range of the raw string contents
+	bool scan_string(size_t *start, size_t *length)
+	{
+		if(peek() != '"')
+			return false;
+
+		*start = ++ position;
+
+		while(!at_end() && data[position] != '"')
+		{
+			if(data[position] == '\\')
+				position ++;
+
+			position ++;
+		}
+
+		if(at_end())
+			return false;
+
+		*length = position - *start;
+		position ++;
+
+		return true;
+	}
+
+	bool skip_value()
+	{
+		skip_whitespace();
+
+		size_t depth = 0;
+
+		do
+		{
+			if(at_end())
+				return false;
+
+			const char c = data[position];
+
+			if(c == '"')
+			{
+				size_t start, length;
+				if(!scan_string(&start, &length))
+					return false;
+			}
+			else if(c == '{' || c == '[')
+			{
+				depth ++;
+				position ++;
+			}
+			else if(c == '}' || c == ']')
+			{
+				if(depth == 0)
+					return false;
+
+				depth --;
+				position ++;
+			}
+			else if(depth == 0)
+			{
+				// Primitive at the top level, runs until the next delimiter
+				while(!at_end() && !strchr(",}] \t\r\n", data[position]))
+					position ++;
+			}
+			else
+				position ++;
+		}
+		while(depth > 0);
+
+		return true;
+	}
+};
+
+static bool index_keymap(scanner_t &scanner, config_entry_t &entry)
+{
+	if(!scanner.consume('{'))
+		return false;
+
+	if(scanner.consume('}'))
+		return true;
+
+	do
+	{
+		scanner.skip_whitespace();
+
+		size_t key_start, key_length;
+		if(!scanner.scan_string(&key_start, &key_length))
+			return false;
+
+		if(!scanner.consume(':'))
+			return false;
+
+		scanner.skip_whitespace();
+
+		const char *key = scanner.data + key_start;
+		const bool is_name = (key_length == 4 && memcmp(key, "name", 4) == 0);
+		const bool is_inherit = (key_length == 7 && memcmp(key, "inherit", 7) == 0);
+
+		if((is_name || is_inherit) && scanner.peek() == '"')
+		{
+			size_t start, length;
+			if(!scanner.scan_string(&start, &length))
+				return false;
+
+			const uint32_t hash = config_hash(scanner.data + start, length);
+
+			if(is_name)
+				entry.name_hash = hash;
+			else
+				entry.inherit_hash = hash;
+		}
+		else if(!scanner.skip_value())
+			return false;
+	}
+	while(scanner.consume(','));
+
+	return scanner.consume('}');
+}
+
+bool config_index(const char *data, size_t size, std::vector<config_entry_t> &entries)
+{
+	scanner_t scanner = { data, size, 0 };
+
+	if(!scanner.consume('['))
+		return false;
+
+	if(scanner.consume(']'))
+		return true;
+
+	do
+	{
+		scanner.skip_whitespace();
+
+		config_entry_t entry = {};
+		entry.offset = scanner.position;
+
+		if(scanner.peek() == '{')
+		{
+			if(!index_keymap(scanner, entry))
+				return false;
+
+			entry.length = scanner.position - entry.offset;
+			entry.content_hash = config_hash(data + entry.offset, entry.length);
+			entries.push_back(entry);
+		}
+		else if(!scanner.skip_value())
+			return false;
+	}
+	while(scanner.consume(','));
+
+	return scanner.consume(']');
+}
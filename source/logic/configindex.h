@@ -0,0 +1,26 @@
+#ifndef MACROPAD_CONFIGINDEX_H
+#define MACROPAD_CONFIGINDEX_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+struct config_entry_t
+{
+	uint32_t offset; // Byte range of the keymap object within the config
+	uint32_t length;
+
+	uint32_t name_hash;    // Hash of the raw "name" string, 0 if missing
+	uint32_t inherit_hash; // Hash of the raw "inherit" string, 0 if missing
+	uint32_t content_hash; // Hash of the whole keymap object
+};
+
+// FNV-1a, never returns 0 so that 0 can mean "no string"
+uint32_t config_hash(const char *data, size_t length);
+uint32_t config_hash_combine(uint32_t hash, uint32_t other);
+
+// Walks the top level keymap array without building a DOM or modifying the data. Entries that aren't objects
+// are skipped, returns false if the config is malformed
+bool config_index(const char *data, size_t size, std::vector<config_entry_t> &entries);
+
+#endif //MACROPAD_CONFIGINDEX_H
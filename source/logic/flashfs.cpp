@@ -4,11 +4,13 @@
 
 #include <ff.h>
 #include <diskio.h>
+#include <algorithm>
 #include <cstring>
-#include <hardware/flash.h>
-#include <hardware/sync.h>
+#include <iterator>
 #include <bsp/board_api.h>
+#include <pico/time.h>
 #include "flashfs.h"
+#include "flashlog.h"
 
 static_assert(DISK_SECTOR_SIZE <= FF_MAX_SS);
 
@@ -20,163 +22,212 @@ typedef struct __attribute__((packed))
 	uint8_t  sectors_per_cluster;    // 0x0D: Sectors per cluster
 	uint16_t reserved_sectors;       // 0x0E: Reserved sectors
 	uint8_t  num_fats;              // 0x10: Number of FATs
-	uint16_t root_entries;          // 0x11: Root directory entries (0 for FAT32)
+	uint16_t root_entries;          // 0x11: Root directory entries
 	uint16_t total_sectors_16;      // 0x13: Total sectors (0 if > 65535)
 	uint8_t  media_descriptor;      // 0x15: Media descriptor
-	uint16_t fat_size_16;           // 0x16: FAT size in sectors (0 for FAT32)
+	uint16_t fat_size_16;           // 0x16: FAT size in sectors
 	uint16_t sectors_per_track;     // 0x18: Sectors per track
 	uint16_t num_heads;             // 0x1A: Number of heads
 	uint32_t hidden_sectors;        // 0x1C: Hidden sectors
 	uint32_t total_sectors_32;      // 0x20: Total sectors (if > 65535)
 
-	// FAT32 extended fields
-	uint32_t fat_size_32;           // 0x24: FAT size in sectors
-	uint16_t ext_flags;             // 0x28: Extended flags
-	uint16_t fs_version;            // 0x2A: Filesystem version
-	uint32_t root_cluster;          // 0x2C: Root directory cluster
-	uint16_t fs_info_sector;        // 0x30: FSInfo sector number
-	uint16_t backup_boot_sector;    // 0x32: Backup boot sector
-	uint8_t  reserved1[12];         // 0x34: Reserved
-	uint8_t  drive_number;          // 0x40: Drive number
-	uint8_t  reserved2;             // 0x41: Reserved
-	uint8_t  boot_signature;        // 0x42: Boot signature (0x29)
-	uint32_t volume_id;             // 0x43: Volume ID
-	char     volume_label[11];      // 0x47: Volume label
-	char     fs_type[8];            // 0x52: Filesystem type
-	uint8_t  boot_code[420];        // 0x5A: Boot code
+	// FAT12/16 extended fields
+	uint8_t  drive_number;          // 0x24: Drive number
+	uint8_t  reserved1;             // 0x25: Reserved
+	uint8_t  boot_signature;        // 0x26: Boot signature (0x29)
+	uint32_t volume_id;             // 0x27: Volume ID
+	char     volume_label[11];      // 0x2B: Volume label
+	char     fs_type[8];            // 0x36: Filesystem type
+	uint8_t  boot_code[448];        // 0x3E: Boot code
 	uint16_t boot_sector_signature; // 0x1FE: Boot sector signature (0xAA55)
-} fat32_boot_sector_t;
+} fat_boot_sector_t;
 
-typedef struct __attribute__((packed))
-{
-	uint32_t lead_signature;        // 0x00: Lead signature (0x41615252)
-	uint8_t  reserved1[480];        // 0x04: Reserved
-	uint32_t struct_signature;      // 0x1E4: Structure signature (0x61417272)
-	uint32_t free_count;            // 0x1E8: Free cluster count
-	uint32_t next_free;             // 0x1EC: Next free cluster
-	uint8_t  reserved2[12];         // 0x1F0: Reserved
-	uint32_t trail_signature;       // 0x1FC: Trail signature (0xAA550000)
-} fat32_fsinfo_t;
-
-void create_fat32_header(void *buffer, uint32_t total_sectors, uint32_t bytes_per_sector)
+static_assert(sizeof(fat_boot_sector_t) == 512);
+
+#define FAT_ROOT_ENTRIES 64
+#define FAT12_MAX_CLUSTERS 4084
+
+// Lays out a FAT12 volume, or FAT16 for large disk sizes. Only the boot sector and the start of each FAT hold
+// anything but zeroes, the rest of the volume is never written and reads back as zeroes
+void create_fat_volume(uint32_t total_sectors, uint32_t bytes_per_sector)
 {
-	// Choose sectors per cluster (power of 2, typically 1-128)
-	// For simplicity, use 1 sector per cluster for small drives
-	uint8_t sectors_per_cluster = (total_sectors < 65536) ? 1 : 8;
+	const uint32_t reserved_sectors = 1;
+	const uint32_t num_fats = 2;
+	const uint32_t root_sectors = (FAT_ROOT_ENTRIES * 32 + bytes_per_sector - 1) / bytes_per_sector;
 
-	// Calculate FAT size
-	uint32_t reserved_sectors = 32;  // Standard for FAT32
-	uint32_t num_fats = 2;           // Standard number of FATs
-	uint32_t root_cluster = 2;       // Root directory starts at cluster 2
+	// Sizing the FAT off the whole data area overestimates it slightly, which is harmless
+	const uint32_t max_clusters = total_sectors - reserved_sectors - root_sectors;
+	const bool is_fat12 = max_clusters <= FAT12_MAX_CLUSTERS;
 
-	// Estimate clusters and FAT size
-	uint32_t data_sectors = total_sectors - reserved_sectors;
-	uint32_t clusters = data_sectors / sectors_per_cluster;
-	uint32_t fat_size = (clusters * 4 + bytes_per_sector - 1) / bytes_per_sector;
+	const uint32_t fat_bytes = is_fat12 ? ((max_clusters + 2) * 3 + 1) / 2 : (max_clusters + 2) * 2;
+	const uint32_t fat_size = (fat_bytes + bytes_per_sector - 1) / bytes_per_sector;
 
-	// Adjust for FAT space
-	data_sectors = total_sectors - reserved_sectors - (num_fats * fat_size);
-	clusters = data_sectors / sectors_per_cluster;
+	uint8_t sector[DISK_SECTOR_SIZE];
 
 	// Initialize boot sector
-	fat32_boot_sector_t *boot = (fat32_boot_sector_t *)buffer;
-	memset(boot, 0, sizeof(fat32_boot_sector_t));
+	fat_boot_sector_t *boot = (fat_boot_sector_t *)sector;
+	memset(boot, 0, sizeof(fat_boot_sector_t));
 
 	// Jump instruction (typical x86 jump)
 	boot->jump_boot[0] = 0xEB;
-	boot->jump_boot[1] = 0xE9;
-	boot->jump_boot[2] = 0xE8;
+	boot->jump_boot[1] = 0x3C;
+	boot->jump_boot[2] = 0x90;
 
 	// OEM name
 	memcpy(boot->oem_name, "MSWIN4.1", 8);
 
 	// BPB (BIOS Parameter Block)
 	boot->bytes_per_sector = bytes_per_sector;
-	boot->sectors_per_cluster = sectors_per_cluster;
+	boot->sectors_per_cluster = 1;
 	boot->reserved_sectors = reserved_sectors;
 	boot->num_fats = num_fats;
-	boot->root_entries = 0;  // 0 for FAT32
+	boot->root_entries = FAT_ROOT_ENTRIES;
 	boot->total_sectors_16 = (total_sectors < 65536) ? total_sectors : 0;
 	boot->media_descriptor = 0xF8;  // Fixed disk
-	boot->fat_size_16 = 0;  // 0 for FAT32
+	boot->fat_size_16 = fat_size;
 	boot->sectors_per_track = 63;
 	boot->num_heads = 255;
 	boot->hidden_sectors = 0;
 	boot->total_sectors_32 = (total_sectors >= 65536) ? total_sectors : 0;
 
-	// FAT32 extended fields
-	boot->fat_size_32 = fat_size;
-	boot->ext_flags = 0;
-	boot->fs_version = 0;
-	boot->root_cluster = root_cluster;
-	boot->fs_info_sector = 1;
-	boot->backup_boot_sector = 6;
+	// FAT12/16 extended fields
 	boot->drive_number = 0x80;  // Hard disk
 	boot->boot_signature = 0x29;
 	boot->volume_id = 0x12345678;  // Arbitrary volume ID
 	memcpy(boot->volume_label, "NO NAME    ", 11);
-	memcpy(boot->fs_type, "FAT32   ", 8);
+	memcpy(boot->fs_type, is_fat12 ? "FAT12   " : "FAT16   ", 8);
 	boot->boot_sector_signature = 0xAA55;
 
-	// Create FSInfo sector
-	fat32_fsinfo_t *fsinfo = (fat32_fsinfo_t *)((uint8_t *)buffer + bytes_per_sector);
-	memset(fsinfo, 0, sizeof(fat32_fsinfo_t));
-	fsinfo->lead_signature = 0x41615252;
-	fsinfo->struct_signature = 0x61417272;
-	fsinfo->free_count = clusters - 1;  // All clusters except root
-	fsinfo->next_free = 3;  // First available cluster after root
-	fsinfo->trail_signature = 0xAA550000;
-
-	// Initialize first FAT
-	uint32_t *fat = (uint32_t *)((uint8_t *)buffer + reserved_sectors * bytes_per_sector);
-	fat[0] = 0x0FFFFFF8;  // Media descriptor in cluster 0
-	fat[1] = 0x0FFFFFFF;  // End of chain marker in cluster 1
-	fat[2] = 0x0FFFFFFF;  // Root directory end of chain
-
-	// Initialize second FAT (copy of first)
-	uint32_t *fat2 = (uint32_t *)((uint8_t *)fat + fat_size * bytes_per_sector);
-	memcpy(fat2, fat, fat_size * bytes_per_sector);
-
-	// Clear root directory area
-	uint8_t *root_dir = (uint8_t *)buffer + (reserved_sectors + num_fats * fat_size + (root_cluster - 2) * sectors_per_cluster) * bytes_per_sector;
-	memset(root_dir, 0, sectors_per_cluster * bytes_per_sector);
+	flashfs_write(sector, 0, 0, DISK_SECTOR_SIZE);
+
+	// Media descriptor in cluster 0, end of chain marker in cluster 1
+	memset(sector, 0, sizeof(sector));
+	sector[0] = 0xF8;
+	sector[1] = 0xFF;
+	sector[2] = 0xFF;
+
+	if(!is_fat12)
+		sector[3] = 0xFF;
+
+	for(uint32_t i = 0; i < num_fats; ++ i)
+		flashfs_write(sector, reserved_sectors + i * fat_size, 0, DISK_SECTOR_SIZE);
 }
 
-struct ram_flash_disk_t
+static FATFS fs;
+
+// Sectors written since they were last logged, everything else is served straight from flash
+static uint8_t *s_cache[DISK_SECTOR_COUNT];
+static uint32_t s_cache_stamp[DISK_SECTOR_COUNT];
+static uint32_t s_cache_clock = 0;
+static size_t s_cached_count = 0;
+
+static uint8_t s_scratch_sector[DISK_SECTOR_SIZE];
+
+static bool s_is_committing = false;
+static uint32_t s_commit_sector = 0; // Next sector the running commit looks at
+static uint32_t s_last_write_ms = 0;
+
+static void flashfs_read_sector(uint32_t lba, uint8_t *buffer)
 {
-	uint8_t version;
-	size_t size;
+	if(s_cache[lba])
+		memcpy(buffer, s_cache[lba], DISK_SECTOR_SIZE);
+	else
+		flashlog_read_sector(lba, buffer);
+}
+// Sectors that are about to be overwritten entirely don't need their old contents read back from the log
+static uint8_t *flashfs_get_writable_sector(uint32_t lba, bool is_overwrite)
+{
+	if(!s_cache[lba])
+	{
+		uint8_t *sector = new uint8_t[DISK_SECTOR_SIZE];
 
-	uint8_t data[DISK_SECTOR_COUNT][DISK_SECTOR_SIZE];
-};
+		if(!is_overwrite)
+			flashlog_read_sector(lba, sector);
 
-static ram_flash_disk_t ram_disk;
-static FATFS fs;
+		s_cache[lba] = sector;
+		s_cached_count ++;
+	}
+
+	s_cache_stamp[lba] = ++ s_cache_clock;
+	return s_cache[lba];
+}
+
+// Moves a cached sector into the log. It only survives a power cycle once the log gets committed
+static bool flashfs_write_back(uint32_t lba)
+{
+	flashlog_read_sector(lba, s_scratch_sector);
+
+	// Writes that put back what was there already don't need to be logged
+	if(memcmp(s_cache[lba], s_scratch_sector, DISK_SECTOR_SIZE) != 0 && !flashlog_write(lba, s_cache[lba]))
+		return false;
 
-#define FLASHFS_VERSION 1
-#define FLASH_SECTOR_COUNT 17
+	delete[] s_cache[lba];
 
-static_assert(FLASH_SECTOR_SIZE * FLASH_SECTOR_COUNT >= sizeof(ram_flash_disk_t));
-static_assert(PICO_FLASH_SIZE_BYTES >= FLASH_SECTOR_SIZE * FLASH_SECTOR_COUNT);
+	s_cache[lba] = nullptr;
+	s_cached_count --;
 
-#define FLASH_TARGET_OFFSET (PICO_FLASH_SIZE_BYTES - (FLASH_SECTOR_SIZE * FLASH_SECTOR_COUNT))
+	return true;
+}
 
-bool flashfs_read_disk(ram_flash_disk_t *target)
+// Returns the flash address of a run of sectors that were logged back to back and uncompressed, nullptr otherwise
+static const uint8_t *flashfs_get_flash_range(uint32_t lba, uint32_t count)
 {
-	const uint8_t *flash = (const uint8_t *)(XIP_BASE + FLASH_TARGET_OFFSET);
-	memcpy(target, flash, sizeof(ram_flash_disk_t));
+	if(lba + count > DISK_SECTOR_COUNT)
+		return nullptr;
+
+	const uint8_t *start = flashlog_get_sector_address(lba);
 
-	if(target->version != FLASHFS_VERSION || target->size != sizeof(ram_flash_disk_t))
+	for(uint32_t i = 0; i < count; ++ i)
 	{
-		target->version = FLASHFS_VERSION;
-		target->size = sizeof(ram_flash_disk_t);
+		if(!start || s_cache[lba + i] || flashlog_get_sector_address(lba + i) != start + i * DISK_SECTOR_SIZE)
+			return nullptr;
+	}
 
-		memset(target->data, 0, DISK_SECTOR_COUNT * DISK_SECTOR_SIZE);
-		create_fat32_header(target->data, DISK_SECTOR_COUNT, DISK_SECTOR_SIZE);
-		return false;
+	return start;
+}
+
+// Logs the run once more, uncompressed and in one piece, so it can be mapped. It holds what the sectors held before,
+// so the copies already in the log stay just as good until the next commit picks this one up
+static const uint8_t *flashfs_relocate_range(uint32_t lba, uint32_t count)
+{
+	if(lba + count > DISK_SECTOR_COUNT)
+		return nullptr;
+
+	uint8_t *buffer = new uint8_t[count * DISK_SECTOR_SIZE];
+
+	for(uint32_t i = 0; i < count; ++ i)
+		flashfs_read_sector(lba + i, buffer + i * DISK_SECTOR_SIZE);
+
+	const uint8_t *result = flashlog_write_range(lba, count, buffer);
+	delete[] buffer;
+
+	if(!result)
+		return nullptr;
+
+	// The log has the newest copies now
+	for(uint32_t i = lba; i < lba + count; ++ i)
+	{
+		if(!s_cache[i])
+			continue;
+
+		delete[] s_cache[i];
+
+		s_cache[i] = nullptr;
+		s_cached_count --;
 	}
 
-	return true;
+	return result;
+}
+
+static bool flashfs_mount_log()
+{
+	if(flashlog_mount())
+		return true;
+
+	flashlog_format();
+	create_fat_volume(DISK_SECTOR_COUNT, DISK_SECTOR_SIZE);
+
+	return false;
 }
 
 void flashfs_create_initial_files()
@@ -204,56 +255,261 @@ void flashfs_create_initial_files()
 
 void flashfs_init()
 {
-	const bool has_disk = flashfs_read_disk(&ram_disk);
+	const bool has_disk = flashfs_mount_log();
 
 	FRESULT res = f_mount(&fs, "/", 1);
 	assert(res == FR_OK);
 
 	if(!has_disk)
+	{
 		flashfs_create_initial_files();
+
+		// Commit the fresh volume right away so the flash copy always matches what the volume started out as
+		flashfs_flush();
+
+		while(flashfs_is_committing())
+			flashfs_task();
+	}
 }
 void flashfs_read(void *buffer, uint32_t lba, uint32_t offset, uint32_t length)
 {
-	uint8_t *addr = ram_disk.data[lba] + offset;
-	memcpy(buffer, addr, length);
+	uint8_t *target = (uint8_t *)buffer;
+
+	lba += offset / DISK_SECTOR_SIZE;
+	offset %= DISK_SECTOR_SIZE;
+
+	while(length > 0)
+	{
+		const uint32_t count = std::min<uint32_t>(length, DISK_SECTOR_SIZE - offset);
+
+		if(count == DISK_SECTOR_SIZE)
+			flashfs_read_sector(lba, target);
+		else
+		{
+			flashfs_read_sector(lba, s_scratch_sector);
+			memcpy(target, s_scratch_sector + offset, count);
+		}
+
+		target += count;
+		length -= count;
+
+		lba ++;
+		offset = 0;
+	}
+}
+void flashfs_write(const void *buffer, uint32_t lba, uint32_t offset, uint32_t length)
+{
+	const uint8_t *source = (const uint8_t *)buffer;
+
+	lba += offset / DISK_SECTOR_SIZE;
+	offset %= DISK_SECTOR_SIZE;
+
+	while(length > 0)
+	{
+		const uint32_t count = std::min<uint32_t>(length, DISK_SECTOR_SIZE - offset);
+		memcpy(flashfs_get_writable_sector(lba, count == DISK_SECTOR_SIZE) + offset, source, count);
+
+		source += count;
+		length -= count;
+
+		lba ++;
+		offset = 0;
+	}
+
+	s_last_write_ms = to_ms_since_boot(get_absolute_time());
+}
+
+bool flashfs_has_changes()
+{
+	return s_cached_count > 0 || flashlog_has_uncommitted();
 }
-void flashfs_write(void *buffer, uint32_t lba, uint32_t offset, uint32_t length)
+
+void flashfs_sync()
 {
-	uint8_t *addr = ram_disk.data[lba] + offset;
-	memcpy(addr, buffer, length);
+	// Nothing was written since the last commit, so there's no reason to touch the flash at all
+	if(!flashfs_has_changes())
+		return;
+
+	// The actual commit happens in small steps from flashfs_task(), a sync that comes in while one is running
+	// starts another pass so nothing that changed in the meantime gets missed
+	s_is_committing = true;
+	s_commit_sector = 0;
+
+	board_led_on();
 }
 void flashfs_flush()
 {
-	const uint32_t ints = save_and_disable_interrupts();
+	// The host modified the volume underneath FatFs, drop whatever it has cached
+	f_mount(&fs, "/", 1);
+	flashfs_sync();
+}
 
-	board_led_on();
-	flash_range_erase(FLASH_TARGET_OFFSET, FLASH_SECTOR_SIZE * FLASH_SECTOR_COUNT);
+bool flashfs_is_committing()
+{
+	return s_is_committing;
+}
+uint8_t flashfs_get_commit_progress()
+{
+	return (uint8_t)((s_commit_sector * 100) / DISK_SECTOR_COUNT);
+}
+
+static void flashfs_commit_step()
+{
+	// Make room ahead of time, one step per tick. Past this the log never turns a write or the commit away for GC
+	if(flashlog_free_blocks() < FLASHLOG_MIN_FREE_BLOCKS && flashlog_gc_step())
+		return;
+
+	while(s_commit_sector < DISK_SECTOR_COUNT)
+	{
+		const uint32_t i = s_commit_sector ++;
+
+		// A sector that fails to be logged stays cached for the next flush
+		if(s_cache[i])
+		{
+			flashfs_write_back(i);
+			return;
+		}
+	}
 
-	size_t remaining = sizeof(ram_flash_disk_t);
+	// Losing power before this point leaves the previous volume intact
+	flashlog_commit();
 
-	const uint8_t *ptr = (const uint8_t *)&ram_disk;
-	size_t offset = 0;
+	s_is_committing = false;
+	board_led_off();
+}
 
-	while(remaining >= FLASH_PAGE_SIZE)
+void flashfs_task()
+{
+	if(s_is_committing)
 	{
-		flash_range_program(FLASH_TARGET_OFFSET + offset, ptr, FLASH_PAGE_SIZE);
+		flashfs_commit_step();
+		return;
+	}
 
-		ptr += FLASH_PAGE_SIZE;
-		offset += FLASH_PAGE_SIZE;
+	// Hosts that never eject or sync still get their writes committed once they go quiet
+	if(flashfs_has_changes() && to_ms_since_boot(get_absolute_time()) - s_last_write_ms >= FLASHFS_IDLE_COMMIT_MS)
+	{
+		flashfs_sync();
+		return;
+	}
 
-		remaining -= FLASH_PAGE_SIZE;
+	// Keep the cache small by logging the sectors that were written longest ago, the next flush commits them.
+	// A single MSC callback adds up to CFG_TUD_MSC_EP_BUFSIZE / 512 sectors, so this has to catch up in one go
+	if(s_cached_count > FLASHFS_CACHE_SECTORS)
+	{
+		while(s_cached_count > FLASHFS_CACHE_SECTORS)
+		{
+			uint32_t oldest = DISK_SECTOR_COUNT;
+
+			for(uint32_t i = 0; i < DISK_SECTOR_COUNT; ++ i)
+			{
+				if(s_cache[i] && (oldest == DISK_SECTOR_COUNT || s_cache_stamp[i] < s_cache_stamp[oldest]))
+					oldest = i;
+			}
+
+			// Turned away while GC makes room, the next tick carries on
+			if(!flashfs_write_back(oldest))
+				break;
+		}
+
+		return;
 	}
 
-	if(remaining)
+	// Collect garbage while idle so a commit rarely has to wait for it
+	if(flashlog_free_blocks() < FLASHLOG_RESERVE_BLOCKS)
+		flashlog_gc_step();
+}
+
+bool flashfs_map_file(const char *path, flashfs_mapping_t *mapping)
+{
+	FIL file;
+	if(f_open(&file, path, FA_OPEN_EXISTING | FA_READ) != FR_OK)
+		return false;
+
+	const size_t size = f_size(&file);
+
+	// Link map layout is: table size, (cluster count, start cluster) per fragment, 0 terminator.
+	// Room for a single fragment means CREATE_LINKMAP only succeeds for contiguous files
+	DWORD link_map[4];
+	link_map[0] = std::size(link_map);
+	file.cltbl = link_map;
+
+	if(size > 0 && f_lseek(&file, CREATE_LINKMAP) == FR_OK)
 	{
-		uint8_t data[FLASH_PAGE_SIZE];
-		memcpy(data, ptr, remaining);
+		const LBA_t sector = fs.database + (link_map[2] - 2) * fs.csize;
+		const uint32_t count = (size + DISK_SECTOR_SIZE - 1) / DISK_SECTOR_SIZE;
+
+		// Written sectors get logged one at a time and compressed, lay the file out for XIP the first time it's mapped
+		const uint8_t *data = flashfs_get_flash_range(sector, count);
+		if(!data)
+			data = flashfs_relocate_range(sector, count);
 
-		flash_range_program(FLASH_TARGET_OFFSET + offset, ptr, FLASH_PAGE_SIZE);
+		if(data)
+		{
+			f_close(&file);
+			flashlog_pin(data);
+
+			mapping->data = (const char *)data;
+			mapping->size = size;
+			mapping->is_copy = false;
+
+			return true;
+		}
 	}
 
-	restore_interrupts_from_disabled(ints);
-	board_led_off();
+	file.cltbl = nullptr;
+
+	char *data = new char[size];
+
+	UINT read;
+	if(f_lseek(&file, 0) != FR_OK || f_read(&file, data, size, &read) != FR_OK || read != size)
+	{
+		delete[] data;
+		f_close(&file);
+
+		return false;
+	}
+
+	f_close(&file);
+
+	mapping->data = data;
+	mapping->size = size;
+	mapping->is_copy = true;
+
+	return true;
+}
+void flashfs_unmap_file(flashfs_mapping_t *mapping)
+{
+	if(mapping->is_copy)
+		delete[] mapping->data;
+	else if(mapping->data)
+		flashlog_unpin((const uint8_t *)mapping->data);
+
+	mapping->data = nullptr;
+	mapping->size = 0;
+	mapping->is_copy = false;
+}
+
+bool flashfs_write_file(const char *path, const flashfs_part_t *parts, size_t count)
+{
+	// Mappings stay valid, they either own a copy or point at pinned log records that newer writes never touch
+	FIL file;
+	if(f_open(&file, path, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK)
+		return false;
+
+	bool result = true;
+
+	for(size_t i = 0; i < count && result; ++ i)
+	{
+		UINT written;
+		result = (f_write(&file, parts[i].data, parts[i].size, &written) == FR_OK && written == parts[i].size);
+	}
+
+	if(f_close(&file) != FR_OK)
+		result = false;
+
+	flashfs_sync();
+	return result;
 }
 
 
@@ -275,8 +531,7 @@ DRESULT disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count)
 	if(sector + count > DISK_SECTOR_COUNT)
 		return RES_PARERR;
 
-	for(UINT i = 0; i < count; i++)
-		memcpy(buff + i * DISK_SECTOR_SIZE, ram_disk.data[sector + i], DISK_SECTOR_SIZE);
+	flashfs_read(buff, sector, 0, count * DISK_SECTOR_SIZE);
 
 	return RES_OK;
 }
@@ -287,8 +542,7 @@ DRESULT disk_write(BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count)
 	if(sector + count > DISK_SECTOR_COUNT)
 		return RES_PARERR;
 
-	for(UINT i = 0; i < count; i++)
-		memcpy(ram_disk.data[sector + i], buff + i * DISK_SECTOR_SIZE, DISK_SECTOR_SIZE);
+	flashfs_write(buff, sector, 0, count * DISK_SECTOR_SIZE);
 
 	return RES_OK;
 }
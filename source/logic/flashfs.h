@@ -5,14 +5,58 @@
 #ifndef MACROPAD_FLASHFS_H
 #define MACROPAD_FLASHFS_H
 
-#define DISK_SECTOR_COUNT 128  // 128 sectors @ 512 bytes each = 64KB
+#include <cstdint>
+#include <cstddef>
+
+// Sectors are compressed in flash and never written ones take no space at all, so the volume can be a lot larger
+// than the flash set aside for it. Override it from the build to change the size
+#ifndef DISK_SECTOR_COUNT
+#define DISK_SECTOR_COUNT 512  // 512 sectors @ 512 bytes each = 256KB
+#endif
+
 #define DISK_SECTOR_SIZE  512
 
+#define FLASHFS_CACHE_SECTORS 16 // Written sectors held in RAM before they get logged in the background
+#define FLASHFS_IDLE_COMMIT_MS 2000 // Uncommitted writes get committed after the host stopped writing for this long
+
 void flashfs_init();
 
 void flashfs_read(void *buffer, uint32_t lba, uint32_t offset, uint32_t length);
-void flashfs_write(void *buffer, uint32_t lba, uint32_t offset, uint32_t length);
+void flashfs_write(const void *buffer, uint32_t lba, uint32_t offset, uint32_t length);
 
+// True if anything was written since the last commit
+bool flashfs_has_changes();
+
+// Starts committing the volume to flash if anything changed, the work itself is spread over flashfs_task() calls
+void flashfs_sync();
+// Same as flashfs_sync(), but also drops FatFs state after the host modified the volume
 void flashfs_flush();
+void flashfs_task();
+
+bool flashfs_is_committing();
+uint8_t flashfs_get_commit_progress(); // 0 - 100
+
+struct flashfs_mapping_t
+{
+	const char *data = nullptr;
+	size_t size = 0;
+	bool is_copy = false;
+};
+
+// Maps a file into memory. Files in a single fragment point straight into XIP flash and stay valid until unmapped,
+// their sectors get logged once more as one uncompressed run if they aren't already. Files that don't fit a single
+// log block that way (3.5 KB) or are split into fragments fall back to a heap copy
+bool flashfs_map_file(const char *path, flashfs_mapping_t *mapping);
+void flashfs_unmap_file(flashfs_mapping_t *mapping);
+
+struct flashfs_part_t
+{
+	const void *data;
+	size_t size;
+};
+
+// Replaces the file with the given parts back to back and starts a commit. Parts may point into a mapping of the
+// very same file. Must not be used while the host has the volume
+bool flashfs_write_file(const char *path, const flashfs_part_t *parts, size_t count);
 
 #endif //MACROPAD_FLASHFS_H
\ No newline at end of file
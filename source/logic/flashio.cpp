@@ -0,0 +1,58 @@
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <hardware/flash.h>
+#include <pico/flash.h>
+#include "flashio.h"
+
+struct flash_operation_t
+{
+	uint32_t offset;
+	const uint8_t *data; // nullptr for erases
+	size_t length;
+};
+
+static void execute_flash_operation(void *param)
+{
+	const flash_operation_t *operation = (const flash_operation_t *)param;
+
+	if(operation->data)
+		flash_range_program(operation->offset, operation->data, operation->length);
+	else
+		flash_range_erase(operation->offset, operation->length);
+}
+
+static void run_flash_operation(uint32_t offset, const uint8_t *data, size_t length)
+{
+	flash_operation_t operation = { offset, data, length };
+
+	int res = flash_safe_execute(&execute_flash_operation, &operation, UINT32_MAX);
+	assert(res == PICO_OK);
+}
+
+void flashio_erase(uint32_t offset, size_t length)
+{
+	for(uint32_t end = offset + length; offset < end; offset += FLASH_SECTOR_SIZE)
+		run_flash_operation(offset, nullptr, FLASH_SECTOR_SIZE);
+}
+void flashio_program(uint32_t offset, const void *data, size_t length)
+{
+	const uint8_t *source = (const uint8_t *)data;
+
+	while(length > 0)
+	{
+		const uint32_t page = offset & ~(FLASH_PAGE_SIZE - 1);
+		const size_t start = offset - page;
+		const size_t count = std::min<size_t>(length, FLASH_PAGE_SIZE - start);
+
+		uint8_t buffer[FLASH_PAGE_SIZE];
+		memset(buffer, 0xff, sizeof(buffer));
+		memcpy(buffer + start, source, count);
+
+		run_flash_operation(page, buffer, FLASH_PAGE_SIZE);
+
+		offset += count;
+		source += count;
+		length -= count;
+	}
+}
@@ -0,0 +1,16 @@
+#ifndef MACROPAD_FLASHIO_H
+#define MACROPAD_FLASHIO_H
+
+#include <cstdint>
+#include <cstddef>
+
+// Offsets are relative to the start of flash. The other core gets locked out and interrupts disabled for a single
+// erase or page program at a time only
+
+void flashio_erase(uint32_t offset, size_t length);
+
+// Programs an arbitrary byte range. The rest of each page is padded with 0xff, which leaves anything that was
+// programmed there before untouched. The source may live in XIP flash, it is copied before each program
+void flashio_program(uint32_t offset, const void *data, size_t length);
+
+#endif //MACROPAD_FLASHIO_H
@@ -0,0 +1,708 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <hardware/dma.h>
+#include <hardware/flash.h>
+#include "flashfs.h"
+#include "flashio.h"
+#include "flashlog.h"
+#include "lz.h"
+
+#define FLASHLOG_MAGIC 0x33474f4c // "LOG3"
+
+#define FLASHLOG_TARGET_OFFSET (PICO_FLASH_SIZE_BYTES - (FLASH_SECTOR_SIZE * FLASHLOG_BLOCK_COUNT))
+
+static_assert(PICO_FLASH_SIZE_BYTES >= FLASH_SECTOR_SIZE * FLASHLOG_BLOCK_COUNT);
+
+struct flashlog_block_header_t
+{
+	uint32_t magic;
+	uint32_t erase_count;
+	uint32_t reserved[2];
+};
+
+enum class record_type_t : uint8_t
+{
+	sector,
+	compressed_sector,
+	commit, // Everything up to and including this sequence number is committed
+};
+
+struct flashlog_record_t
+{
+	uint32_t sequence;
+	uint16_t lba;
+	uint16_t offset; // Of the stored data, relative to the start of the block
+	uint16_t length;
+	record_type_t type;
+	uint8_t flags;   // Not covered by the CRC, bits get cleared after the record was written
+	uint32_t crc;    // Covers everything up to the flags, followed by the data
+};
+
+static_assert(sizeof(flashlog_block_header_t) == 16);
+static_assert(sizeof(flashlog_record_t) == 16);
+
+constexpr uint8_t record_flag_aborted = 0x01; // Cleared on records that were never committed
+
+// Each block starts with its header, the record table grows up from there and the data grows down from the end
+constexpr size_t max_records = (FLASH_SECTOR_SIZE - sizeof(flashlog_block_header_t)) / sizeof(flashlog_record_t);
+
+constexpr size_t no_block = FLASHLOG_BLOCK_COUNT;
+constexpr uint16_t no_mapping = 0xffff;
+
+static_assert(FLASHLOG_BLOCK_COUNT < 255 && max_records < 256);
+static_assert(DISK_SECTOR_COUNT < 0xffff);
+
+enum class block_state_t : uint8_t
+{
+	dirty, // Needs to be erased before it can be used
+	free,
+	open,  // Partially written, records get appended here
+	full,
+};
+
+struct block_info_t
+{
+	uint32_t erase_count;
+	uint16_t data_start;
+	uint8_t records;
+	uint8_t live;      // Records referenced from either mapping table
+	uint16_t live_bytes;
+	block_state_t state;
+};
+
+static block_info_t s_blocks[FLASHLOG_BLOCK_COUNT];
+
+// Block << 8 | record. The committed table lags behind until the next commit, so a power loss can fall back to it
+static uint16_t s_map[DISK_SECTOR_COUNT];
+static uint16_t s_committed_map[DISK_SECTOR_COUNT];
+static uint16_t s_commit_record = no_mapping;
+
+static uint32_t s_sequence = 0;
+static uint32_t s_committed_sequence = 0;
+static size_t s_head = no_block;
+
+static size_t s_gc_victim = no_block;
+static size_t s_gc_record = 0;
+
+static uint8_t s_pins[FLASHLOG_BLOCK_COUNT]; // Blocks with data handed out by address, never erased
+
+static int s_crc_channel = -1;
+
+static uint8_t s_compress_buffer[DISK_SECTOR_SIZE];
+
+static uint32_t block_offset(size_t block)
+{
+	return FLASHLOG_TARGET_OFFSET + block * FLASH_SECTOR_SIZE;
+}
+static const uint8_t *block_data(size_t block)
+{
+	return (const uint8_t *)(XIP_BASE + block_offset(block));
+}
+static const flashlog_record_t *get_record(size_t block, size_t record)
+{
+	return (const flashlog_record_t *)(block_data(block) + sizeof(flashlog_block_header_t)) + record;
+}
+static const flashlog_record_t *get_mapped_record(uint16_t mapping)
+{
+	return get_record(mapping >> 8, mapping & 0xff);
+}
+
+// CRC32 through the DMA sniffer, the data itself goes nowhere
+static uint32_t calculate_crc(const void *data, size_t length, uint32_t seed)
+{
+	if(s_crc_channel < 0)
+		s_crc_channel = dma_claim_unused_channel(true);
+
+	if(length == 0)
+		return seed;
+
+	static uint8_t sink;
+
+	dma_channel_config config = dma_channel_get_default_config(s_crc_channel);
+	channel_config_set_transfer_data_size(&config, DMA_SIZE_8);
+	channel_config_set_read_increment(&config, true);
+	channel_config_set_write_increment(&config, false);
+	channel_config_set_sniff_enable(&config, true);
+
+	dma_sniffer_enable(s_crc_channel, DMA_SNIFF_CTRL_CALC_VALUE_CRC32, true);
+	dma_sniffer_set_data_accumulator(seed);
+
+	dma_channel_configure(s_crc_channel, &config, &sink, data, length, true);
+	dma_channel_wait_for_finish_blocking(s_crc_channel);
+
+	return dma_sniffer_get_data_accumulator();
+}
+static uint32_t calculate_record_crc(const flashlog_record_t *record, const uint8_t *data)
+{
+	const uint32_t crc = calculate_crc(record, offsetof(flashlog_record_t, flags), 0xffffffff);
+	return calculate_crc(data, record->length, crc);
+}
+
+static bool is_record_erased(const flashlog_record_t *record)
+{
+	const uint8_t *bytes = (const uint8_t *)record;
+	return std::all_of(bytes, bytes + sizeof(flashlog_record_t), [](uint8_t value) { return value == 0xff; });
+}
+static bool is_sector_record(const flashlog_record_t *record)
+{
+	return (record->type == record_type_t::sector || record->type == record_type_t::compressed_sector) && record->lba < DISK_SECTOR_COUNT;
+}
+static size_t get_records_end(size_t records)
+{
+	return sizeof(flashlog_block_header_t) + records * sizeof(flashlog_record_t);
+}
+
+static bool is_record_valid(size_t block, size_t index, const flashlog_record_t *record)
+{
+	if(record->offset < get_records_end(index + 1) || record->offset + record->length > FLASH_SECTOR_SIZE)
+		return false;
+	if(record->type != record_type_t::commit && !is_sector_record(record))
+		return false;
+	if(record->type == record_type_t::sector && record->length != DISK_SECTOR_SIZE)
+		return false;
+
+	return calculate_record_crc(record, block_data(block) + record->offset) == record->crc;
+}
+
+static bool is_tail_erased(size_t block)
+{
+	const uint8_t *data = block_data(block);
+	const size_t records_end = get_records_end(s_blocks[block].records);
+
+	return std::all_of(data + records_end, data + s_blocks[block].data_start, [](uint8_t value) { return value == 0xff; });
+}
+
+static void erase_block(size_t block)
+{
+	block_info_t &info = s_blocks[block];
+
+	flashio_erase(block_offset(block), FLASH_SECTOR_SIZE);
+
+	info.erase_count ++;
+
+	flashlog_block_header_t header;
+	memset(&header, 0xff, sizeof(header));
+	header.magic = FLASHLOG_MAGIC;
+	header.erase_count = info.erase_count;
+
+	flashio_program(block_offset(block), &header, sizeof(header));
+
+	info.data_start = FLASH_SECTOR_SIZE;
+	info.records = 0;
+	info.live = 0;
+	info.live_bytes = 0;
+	info.state = block_state_t::free;
+}
+
+static size_t count_free_blocks()
+{
+	size_t count = 0;
+
+	for(const block_info_t &info : s_blocks)
+	{
+		if(info.state == block_state_t::free || info.state == block_state_t::dirty)
+			count ++;
+	}
+
+	return count;
+}
+
+// Least worn block first, dirty blocks get erased on demand
+static size_t allocate_block()
+{
+	size_t result = no_block;
+
+	for(size_t i = 0; i < FLASHLOG_BLOCK_COUNT; ++ i)
+	{
+		const block_info_t &info = s_blocks[i];
+		if(info.state != block_state_t::free && info.state != block_state_t::dirty)
+			continue;
+
+		if(result == no_block || info.erase_count < s_blocks[result].erase_count)
+			result = i;
+	}
+
+	if(result != no_block && s_blocks[result].state == block_state_t::dirty)
+		erase_block(result);
+
+	return result;
+}
+
+static bool is_referenced(uint32_t lba, uint16_t mapping)
+{
+	return mapping != no_mapping && (s_map[lba] == mapping || s_committed_map[lba] == mapping);
+}
+static void set_mapping(uint16_t *map, uint32_t lba, uint16_t mapping)
+{
+	const uint16_t previous = map[lba];
+	if(previous == mapping)
+		return;
+
+	// Both tables usually point at the same record, which should only count once
+	if(mapping != no_mapping && !is_referenced(lba, mapping))
+	{
+		block_info_t &info = s_blocks[mapping >> 8];
+		info.live ++;
+		info.live_bytes += get_mapped_record(mapping)->length;
+	}
+
+	map[lba] = mapping;
+
+	if(previous != no_mapping && !is_referenced(lba, previous))
+	{
+		block_info_t &info = s_blocks[previous >> 8];
+		info.live --;
+		info.live_bytes -= get_mapped_record(previous)->length;
+	}
+}
+
+// Makes sure the head block has room for count more records along with length bytes of data
+static bool reserve_head(size_t count, size_t length)
+{
+	if(s_head != no_block)
+	{
+		const block_info_t &head = s_blocks[s_head];
+
+		if(head.records + count > max_records || get_records_end(head.records + count) + length > head.data_start)
+		{
+			s_blocks[s_head].state = block_state_t::full;
+			s_head = no_block;
+		}
+	}
+
+	if(s_head == no_block)
+	{
+		s_head = allocate_block();
+		if(s_head == no_block)
+			return false;
+
+		s_blocks[s_head].state = block_state_t::open;
+	}
+
+	return true;
+}
+
+// Adds a table entry to the head block for data that was already programmed at the given offset
+static uint16_t program_record(record_type_t type, uint32_t lba, uint32_t sequence, const uint8_t *data, size_t length, uint16_t offset)
+{
+	block_info_t &info = s_blocks[s_head];
+
+	flashlog_record_t record;
+	record.sequence = sequence;
+	record.lba = (uint16_t)lba;
+	record.offset = offset;
+	record.length = (uint16_t)length;
+	record.type = type;
+	record.flags = 0xff;
+	record.crc = calculate_record_crc(&record, data);
+
+	flashio_program(block_offset(s_head) + sizeof(flashlog_block_header_t) + info.records * sizeof(flashlog_record_t), &record, sizeof(record));
+
+	const uint16_t mapping = (uint16_t)((s_head << 8) | info.records);
+
+	info.records ++;
+	info.data_start = std::min(info.data_start, offset);
+
+	return mapping;
+}
+
+// Returns the location of the new record, no_mapping if the log ran out of space
+static uint16_t append_record(record_type_t type, uint32_t lba, uint32_t sequence, const uint8_t *data, size_t length)
+{
+	if(!reserve_head(1, length))
+		return no_mapping;
+
+	const uint16_t offset = s_blocks[s_head].data_start - length;
+
+	// Data goes first, the record only becomes visible once its table entry is programmed
+	flashio_program(block_offset(s_head) + offset, data, length);
+
+	return program_record(type, lba, sequence, data, length, offset);
+}
+
+static size_t select_victim()
+{
+	uint32_t max_erase_count = 0;
+
+	for(const block_info_t &info : s_blocks)
+		max_erase_count = std::max(max_erase_count, info.erase_count);
+
+	size_t result = no_block;
+
+	for(size_t i = 0; i < FLASHLOG_BLOCK_COUNT; ++ i)
+	{
+		const block_info_t &info = s_blocks[i];
+		if(info.state != block_state_t::full || i == s_head || s_pins[i] > 0)
+			continue;
+
+		// Blocks holding cold data never become garbage on their own. Once one lags far enough behind, move its
+		// data out so the block gets back into rotation
+		if(max_erase_count - info.erase_count >= FLASHLOG_WEAR_THRESHOLD)
+			return i;
+
+		if(info.live >= info.records)
+			continue;
+
+		// Cheapest block to move out of the way first
+		const size_t cost = info.live_bytes + info.live * sizeof(flashlog_record_t);
+		const size_t result_cost = (result != no_block) ? s_blocks[result].live_bytes + s_blocks[result].live * sizeof(flashlog_record_t) : 0;
+
+		if(result == no_block || cost < result_cost || (cost == result_cost && info.erase_count < s_blocks[result].erase_count))
+			result = i;
+	}
+
+	return result;
+}
+
+bool flashlog_gc_step()
+{
+	if(s_gc_victim == no_block)
+	{
+		s_gc_victim = select_victim();
+		s_gc_record = 0;
+
+		if(s_gc_victim == no_block)
+			return false;
+	}
+
+	const block_info_t &victim = s_blocks[s_gc_victim];
+
+	// Move one live record per step, records that were superseded in the meantime are simply skipped. Moved records
+	// keep their sequence number, so a copy left behind by a power loss is indistinguishable from the original
+	for(; s_gc_record < victim.records; ++ s_gc_record)
+	{
+		const uint16_t location = (uint16_t)((s_gc_victim << 8) | s_gc_record);
+		const flashlog_record_t *record = get_mapped_record(location);
+
+		if(location == s_commit_record)
+		{
+			const uint16_t mapping = append_record(record_type_t::commit, 0, record->sequence, nullptr, 0);
+			if(mapping == no_mapping)
+				return false;
+
+			s_commit_record = mapping;
+			s_gc_record ++;
+
+			return true;
+		}
+
+		// Also skips whatever got torn by a power loss
+		if(!is_sector_record(record))
+			continue;
+
+		const bool is_current = s_map[record->lba] == location;
+		const bool is_committed = s_committed_map[record->lba] == location;
+
+		if(!is_current && !is_committed)
+			continue;
+
+		const uint16_t mapping = append_record(record->type, record->lba, record->sequence, block_data(s_gc_victim) + record->offset, record->length);
+		if(mapping == no_mapping)
+			return false;
+
+		if(is_current)
+			set_mapping(s_map, record->lba, mapping);
+		if(is_committed)
+			set_mapping(s_committed_map, record->lba, mapping);
+
+		s_gc_record ++;
+		return true;
+	}
+
+	// Got pinned while its records were being moved. It only holds stale copies now, so leave it for later
+	if(s_pins[s_gc_victim] == 0)
+		erase_block(s_gc_victim);
+
+	s_gc_victim = no_block;
+
+	return true;
+}
+
+size_t flashlog_free_blocks()
+{
+	return count_free_blocks();
+}
+
+static void reset_tables()
+{
+	std::fill(std::begin(s_map), std::end(s_map), no_mapping);
+	std::fill(std::begin(s_committed_map), std::end(s_committed_map), no_mapping);
+
+	s_commit_record = no_mapping;
+	s_sequence = 0;
+	s_committed_sequence = 0;
+	s_head = no_block;
+	s_gc_victim = no_block;
+}
+
+bool flashlog_mount()
+{
+	reset_tables();
+
+	bool has_log = false;
+	uint32_t max_erase_count = 0;
+
+	// Find out how far the log got committed first, any sector record past that point is discarded below
+	for(size_t i = 0; i < FLASHLOG_BLOCK_COUNT; ++ i)
+	{
+		const flashlog_block_header_t *header = (const flashlog_block_header_t *)block_data(i);
+		if(header->magic != FLASHLOG_MAGIC)
+			continue;
+
+		size_t data_start = FLASH_SECTOR_SIZE;
+
+		for(size_t j = 0; j < max_records && get_records_end(j + 1) <= data_start; ++ j)
+		{
+			const flashlog_record_t *record = get_record(i, j);
+			if(is_record_erased(record))
+				break;
+
+			data_start = std::min<size_t>(data_start, record->offset);
+
+			if(record->type != record_type_t::commit || record->sequence < s_committed_sequence || !is_record_valid(i, j, record))
+				continue;
+
+			s_committed_sequence = record->sequence;
+			s_commit_record = (uint16_t)((i << 8) | j);
+		}
+	}
+
+	for(size_t i = 0; i < FLASHLOG_BLOCK_COUNT; ++ i)
+	{
+		block_info_t &info = s_blocks[i];
+		info = {};
+		info.data_start = FLASH_SECTOR_SIZE;
+
+		const flashlog_block_header_t *header = (const flashlog_block_header_t *)block_data(i);
+
+		if(header->magic != FLASHLOG_MAGIC)
+		{
+			info.state = block_state_t::dirty;
+			continue;
+		}
+
+		has_log = true;
+
+		info.erase_count = header->erase_count;
+		info.state = block_state_t::free;
+
+		max_erase_count = std::max(max_erase_count, info.erase_count);
+
+		for(size_t j = 0; j < max_records && get_records_end(j + 1) <= info.data_start; ++ j)
+		{
+			const flashlog_record_t *record = get_record(i, j);
+			if(is_record_erased(record))
+				break;
+
+			info.records = j + 1;
+
+			// Power was lost while writing this record. Don't append anything else here, GC will clean it up
+			if(!is_record_valid(i, j, record))
+			{
+				info.state = block_state_t::full;
+				break;
+			}
+
+			info.data_start = record->offset;
+			info.state = (info.records >= max_records) ? block_state_t::full : block_state_t::open;
+
+			s_sequence = std::max(s_sequence, record->sequence);
+
+			if(!is_sector_record(record) || !(record->flags & record_flag_aborted))
+				continue;
+
+			// Written by a flush that never finished. Mark it so a later commit doesn't bring it back to life
+			if(record->sequence > s_committed_sequence)
+			{
+				const uint8_t flags = record->flags & ~record_flag_aborted;
+				flashio_program(block_offset(i) + ((const uint8_t *)&record->flags - block_data(i)), &flags, sizeof(flags));
+
+				continue;
+			}
+
+			const uint16_t mapping = s_map[record->lba];
+			if(mapping == no_mapping || get_mapped_record(mapping)->sequence < record->sequence)
+			{
+				set_mapping(s_map, record->lba, (uint16_t)((i << 8) | j));
+				set_mapping(s_committed_map, record->lba, (uint16_t)((i << 8) | j));
+			}
+		}
+	}
+
+	// Keep appending to one partially written block, anything else gets closed off
+	for(size_t i = 0; i < FLASHLOG_BLOCK_COUNT; ++ i)
+	{
+		block_info_t &info = s_blocks[i];
+
+		// Blocks without a valid header lost their erase count, assume the worst
+		if(info.state == block_state_t::dirty)
+			info.erase_count = max_erase_count;
+
+		// Data written right before losing power has no record pointing at it, but can't be programmed over either
+		if((info.state == block_state_t::free || info.state == block_state_t::open) && !is_tail_erased(i))
+			info.state = (info.records > 0) ? block_state_t::full : block_state_t::dirty;
+
+		if(info.state != block_state_t::open)
+			continue;
+
+		if(s_head == no_block)
+			s_head = i;
+		else
+			info.state = block_state_t::full;
+	}
+
+	return has_log;
+}
+
+void flashlog_format()
+{
+	for(size_t i = 0; i < FLASHLOG_BLOCK_COUNT; ++ i)
+	{
+		// Carry erase counts over from an existing log
+		const flashlog_block_header_t *header = (const flashlog_block_header_t *)block_data(i);
+		s_blocks[i].erase_count = (header->magic == FLASHLOG_MAGIC) ? header->erase_count : 0;
+
+		erase_block(i);
+	}
+
+	reset_tables();
+}
+
+bool flashlog_read_sector(uint32_t lba, uint8_t *buffer)
+{
+	if(lba >= DISK_SECTOR_COUNT || s_map[lba] == no_mapping)
+	{
+		memset(buffer, 0, DISK_SECTOR_SIZE);
+		return false;
+	}
+
+	const uint16_t mapping = s_map[lba];
+	const flashlog_record_t *record = get_mapped_record(mapping);
+	const uint8_t *data = block_data(mapping >> 8) + record->offset;
+
+	if(record->type == record_type_t::sector)
+	{
+		memcpy(buffer, data, DISK_SECTOR_SIZE);
+		return true;
+	}
+
+	// The CRC was checked when mounting, this can only fail if the flash got corrupted since
+	if(!lz_decompress(data, record->length, buffer, DISK_SECTOR_SIZE))
+		memset(buffer, 0, DISK_SECTOR_SIZE);
+
+	return true;
+}
+const uint8_t *flashlog_get_sector_address(uint32_t lba)
+{
+	if(lba >= DISK_SECTOR_COUNT || s_map[lba] == no_mapping)
+		return nullptr;
+
+	const uint16_t mapping = s_map[lba];
+	const flashlog_record_t *record = get_mapped_record(mapping);
+
+	if(record->type != record_type_t::sector)
+		return nullptr;
+
+	return block_data(mapping >> 8) + record->offset;
+}
+
+void flashlog_pin(const uint8_t *address)
+{
+	s_pins[(address - block_data(0)) / FLASH_SECTOR_SIZE] ++;
+}
+void flashlog_unpin(const uint8_t *address)
+{
+	s_pins[(address - block_data(0)) / FLASH_SECTOR_SIZE] --;
+}
+
+// Runs at most one step of collection, so a single call never erases more than one block on its own. Returns false
+// while the log is still short of free blocks after that, once there's nothing left to collect whatever room is
+// left gets used
+static bool make_room()
+{
+	if(count_free_blocks() >= FLASHLOG_MIN_FREE_BLOCKS)
+		return true;
+
+	return !flashlog_gc_step() || count_free_blocks() >= FLASHLOG_MIN_FREE_BLOCKS;
+}
+
+bool flashlog_write(uint32_t lba, const uint8_t *data)
+{
+	if(lba >= DISK_SECTOR_COUNT)
+		return false;
+
+	if(!make_room())
+		return false;
+
+	// Stored as is if compression doesn't gain anything
+	const size_t length = lz_compress(data, DISK_SECTOR_SIZE, s_compress_buffer, DISK_SECTOR_SIZE - 1);
+
+	uint16_t mapping;
+	if(length > 0)
+		mapping = append_record(record_type_t::compressed_sector, lba, ++ s_sequence, s_compress_buffer, length);
+	else
+		mapping = append_record(record_type_t::sector, lba, ++ s_sequence, data, DISK_SECTOR_SIZE);
+
+	if(mapping == no_mapping)
+		return false;
+
+	set_mapping(s_map, lba, mapping);
+	return true;
+}
+
+const uint8_t *flashlog_write_range(uint32_t lba, uint32_t count, const uint8_t *data)
+{
+	const size_t length = count * DISK_SECTOR_SIZE;
+
+	if(count == 0 || lba + count > DISK_SECTOR_COUNT || count > max_records || get_records_end(count) + length > FLASH_SECTOR_SIZE)
+		return nullptr;
+
+	if(!make_room() || !reserve_head(count, length))
+		return nullptr;
+
+	const uint16_t offset = s_blocks[s_head].data_start - length;
+
+	flashio_program(block_offset(s_head) + offset, data, length);
+
+	// Last sector first, so the offsets in the record table still only ever go down like everywhere else
+	for(uint32_t i = count; i-- > 0;)
+	{
+		const uint16_t sector_offset = offset + i * DISK_SECTOR_SIZE;
+		const uint16_t mapping = program_record(record_type_t::sector, lba + i, ++ s_sequence, data + i * DISK_SECTOR_SIZE, DISK_SECTOR_SIZE, sector_offset);
+
+		set_mapping(s_map, lba + i, mapping);
+	}
+
+	return block_data(s_head) + offset;
+}
+
+bool flashlog_commit()
+{
+	if(s_committed_sequence == s_sequence)
+		return true;
+
+	if(!make_room())
+		return false;
+
+	const uint16_t mapping = append_record(record_type_t::commit, 0, s_sequence, nullptr, 0);
+	if(mapping == no_mapping)
+		return false;
+
+	s_commit_record = mapping;
+	s_committed_sequence = s_sequence;
+
+	for(uint32_t i = 0; i < DISK_SECTOR_COUNT; ++ i)
+	{
+		if(s_committed_map[i] != s_map[i])
+			set_mapping(s_committed_map, i, s_map[i]);
+	}
+
+	return true;
+}
+bool flashlog_has_uncommitted()
+{
+	// Compares the mappings rather than sequence numbers, records left behind by an aborted flush don't count
+	return !std::equal(std::begin(s_map), std::end(s_map), std::begin(s_committed_map));
+}
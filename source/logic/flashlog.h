@@ -0,0 +1,46 @@
+#ifndef MACROPAD_FLASHLOG_H
+#define MACROPAD_FLASHLOG_H
+
+#include <cstdint>
+#include <cstddef>
+
+// Log structured sector store. Disk sectors are appended to a rotating set of flash erase blocks and located
+// through a mapping table that gets rebuilt from the on-flash records at mount time. Blocks that only hold
+// stale copies are garbage collected and handed out again least worn first. Sectors are compressed individually
+// where that saves space, so each one can still be read on its own.
+// Every record carries a CRC32, and written sectors only become visible after a power cycle once a commit
+// record follows them. Until then the previously committed copies are kept around.
+#define FLASHLOG_BLOCK_COUNT    40 // 4 KB erase blocks, 160 KB of flash
+#define FLASHLOG_RESERVE_BLOCKS 4  // Background GC kicks in below this many free blocks
+#define FLASHLOG_MIN_FREE_BLOCKS 2 // Writes wait for GC below this, so it always has a block to move live records to
+#define FLASHLOG_WEAR_THRESHOLD 64 // Erase count lag that forces cold data to be moved
+
+// Returns false if the flash holds no log, flashlog_format() needs to be called in that case
+bool flashlog_mount();
+void flashlog_format();
+
+// Reads the newest copy of the sector, returns false and zero fills the buffer if it was never written
+bool flashlog_read_sector(uint32_t lba, uint8_t *buffer);
+
+// Returns an XIP pointer to the newest copy of the sector, nullptr if it was never written or is stored compressed
+const uint8_t *flashlog_get_sector_address(uint32_t lba);
+// Returns false while GC is still making room, one flashlog_gc_step() per call, or if the log is full
+bool flashlog_write(uint32_t lba, const uint8_t *data);
+// Logs a run of sectors uncompressed and back to back within one block, so they can be read through XIP as a
+// whole. Returns the address of the first one, nullptr if turned away like flashlog_write() or if the run doesn't
+// fit a single block (7 sectors)
+const uint8_t *flashlog_write_range(uint32_t lba, uint32_t count, const uint8_t *data);
+
+// Keeps the block holding the address from being garbage collected, so the data stays readable through XIP
+void flashlog_pin(const uint8_t *address);
+void flashlog_unpin(const uint8_t *address);
+
+// Atomically commits everything written since the last commit. Can be turned away like flashlog_write()
+bool flashlog_commit();
+bool flashlog_has_uncommitted();
+
+// Performs a bounded unit of garbage collection work, returns false if there was nothing to collect
+bool flashlog_gc_step();
+size_t flashlog_free_blocks();
+
+#endif //MACROPAD_FLASHLOG_H
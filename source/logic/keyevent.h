@@ -0,0 +1,61 @@
+#ifndef MACROPAD_KEYEVENT_H
+#define MACROPAD_KEYEVENT_H
+
+#include <cstdint>
+#include <cstddef>
+
+#define KEYEVENT_QUEUE_SIZE 32
+
+enum class keyrole_t : uint8_t
+{
+	normal,
+	tap,
+	hold
+};
+
+// Keys are numbered like the matrix, followed by the combos of the active layer
+struct keyevent_t
+{
+	uint64_t time_us;
+	uint8_t key;
+	bool is_press;
+	keyrole_t role = keyrole_t::normal; // Of tap-hold keys, once decided
+};
+
+// Events handed from one stage of key processing to the next
+class keyeventqueue_t
+{
+public:
+	// Dropped when full, which takes the app stalling for a very long time
+	void push(const keyevent_t &event)
+	{
+		if(m_count >= KEYEVENT_QUEUE_SIZE)
+			return;
+
+		m_events[(m_head + m_count) % KEYEVENT_QUEUE_SIZE] = event;
+		m_count ++;
+	}
+
+	bool pop(keyevent_t *event)
+	{
+		if(m_count == 0)
+			return false;
+
+		*event = m_events[m_head];
+
+		m_head = (m_head + 1) % KEYEVENT_QUEUE_SIZE;
+		m_count --;
+
+		return true;
+	}
+
+	bool is_empty() const { return m_count == 0; }
+	void clear() { m_count = 0; }
+
+private:
+	keyevent_t m_events[KEYEVENT_QUEUE_SIZE] = {};
+	size_t m_head = 0;
+	size_t m_count = 0;
+};
+
+#endif //MACROPAD_KEYEVENT_H
@@ -2,65 +2,297 @@
 // Created by Sidney on 04/07/2025.
 //
 
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <iterator>
 #include <tusb.h>
 #include "keylayer.h"
 
-keymacro_t build_none_macro()
+constexpr size_t max_inheritance_depth = 16;
+
+const char *keymap_t::get_label(uint16_t macro) const
 {
-	keymacro_t macro;
-	macro.type = keymacro_t::type_t::none;
+	const auto iterator = std::lower_bound(labels.begin(), labels.end(), macro, [](const keylabel_t &label, uint16_t value) {
+		return label.macro < value;
+	});
 
-	return macro;
+	if(iterator == labels.end() || iterator->macro != macro)
+		return nullptr;
+
+	return get_string(iterator->string);
 }
 
-keymacro_t build_hid_macro(uint8_t keycode, uint8_t modifier = 0)
+static uint16_t resolve_macros(const keymap_t *map, uint16_t mask, uint16_t macro, resolved_keylayer_t::entry_t *entries)
 {
-	keymacro_t macro;
-	macro.type = keymacro_t::type_t::hid_key;
-	macro.hid_key.modifier = modifier;
-	macro.hid_key.keycode = keycode;
+	for(size_t i = 0; i < num_keys; ++ i)
+	{
+		if(!(mask & (1 << i)))
+			continue;
+
+		resolved_keylayer_t::entry_t &entry = entries[i];
+		entry.macro = map->macros[macro];
+		entry.modifier = map->modifiers[entry.macro.get_modifier_index()];
+		entry.label = map->get_label(macro);
+		entry.sequence = nullptr;
+
+		if(entry.macro.get_type() == keymacro_t::type_t::sequence)
+			entry.sequence = map->get_sequence(entry.macro.get_payload());
+
+		if(entry.macro.get_type() == keymacro_t::type_t::tap_hold && entry.macro.get_payload() < map->tap_holds.size())
+		{
+			const taphold_t &tap_hold = map->tap_holds[entry.macro.get_payload()];
+
+			entry.tap_hold = &tap_hold;
+			entry.modifier = tap_hold.modifier;
+		}
+
+		macro ++;
+	}
 
 	return macro;
 }
 
-keymacro_t build_action_macro(action_t action)
+static void resolve_combos(const keymap_t *map, const keylayer_t &layer, resolved_keylayer_t *result)
 {
-	keymacro_t macro;
-	macro.type = keymacro_t::type_t::action;
-	macro.action.action = action;
+	for(size_t i = 0; i < layer.combo_count; ++ i)
+	{
+		const keycombo_t &combo = map->combos[layer.combos + i];
 
-	return macro;
+		resolved_keylayer_t::combo_t *target = std::find_if(result->combos, result->combos + result->combo_count, [&](const resolved_keylayer_t::combo_t &existing) {
+			return existing.mask == combo.mask;
+		});
+
+		if(target == result->combos + result->combo_count)
+		{
+			if(result->combo_count >= max_layer_combos)
+				continue;
+
+			result->combo_count ++;
+		}
+
+		resolved_keylayer_t::entry_t entry;
+		resolve_macros(map, 1, combo.macro, &entry);
+
+		target->mask = combo.mask;
+		target->entry = entry;
+	}
+}
+
+void keymap_t::resolve_layer(size_t layer, resolved_keylayer_t *result) const
+{
+	*result = {};
+
+	struct link_t
+	{
+		const keymap_t *map;
+		const keylayer_t *layer;
+	};
+
+	// Collect the chain leaf first, then apply it root first so overrides further down win
+	link_t chain[max_inheritance_depth];
+	size_t depth = 0;
+
+	const keymap_t *map = this;
+	uint16_t index = layer;
+
+	while(index != no_index && depth < max_inheritance_depth)
+	{
+		if(index & keylayer_t::parent_in_base)
+		{
+			map = map->base;
+			index &= ~keylayer_t::parent_in_base;
+		}
+
+		if(!map || index >= map->layers.size())
+			break;
+
+		const keylayer_t &entry = map->layers[index];
+		chain[depth ++] = { map, &entry };
+
+		index = entry.parent;
+	}
+
+	result->name = get_string(layers[layer].name);
+	result->has_mod = layers[layer].has_mod;
+
+	while(depth > 0)
+	{
+		const link_t &link = chain[-- depth];
+
+		uint16_t macro = link.layer->macros;
+		macro = resolve_macros(link.map, link.layer->base_mask, macro, result->macros);
+		resolve_macros(link.map, link.layer->mod_mask, macro, result->mod_macros);
+
+		resolve_combos(link.map, *link.layer, result);
+	}
+
+	// Mod keys keep working as mod keys while the mod block is active, so do tap-hold keys that hold the mod key
+	if(result->has_mod)
+	{
+		for(size_t i = 0; i < num_keys; ++ i)
+		{
+			const resolved_keylayer_t::entry_t &entry = result->macros[i];
+
+			if(entry.macro.get_type() == keymacro_t::type_t::mod || (entry.get_tap_hold() && (entry.get_tap_hold()->flags & taphold_t::hold_mod)))
+				result->mod_macros[i] = entry;
+		}
+	}
+}
+
+// Transparent keys show the key of the layer below, those that are still transparent at the bottom do nothing
+void keymap_t::resolve_stack(const uint8_t *stack, size_t count, resolved_keylayer_t *result, resolved_keylayer_t *scratch) const
+{
+	const resolved_keylayer_t &layer = *scratch;
+
+	resolve_layer(stack[0], result);
+
+	const auto overlay = [](const resolved_keylayer_t::entry_t *source, resolved_keylayer_t::entry_t *target) {
+		for(size_t i = 0; i < num_keys; ++ i)
+		{
+			if(source[i].macro.get_type() != keymacro_t::type_t::transparent)
+				target[i] = source[i];
+		}
+	};
+
+	for(size_t i = 1; i < count; ++ i)
+	{
+		resolve_layer(stack[i], scratch);
+
+		if(layer.name)
+			result->name = layer.name;
+
+		overlay(layer.macros, result->macros);
+
+		// Layers without a mod block leave the mod keys below them alone
+		if(layer.has_mod)
+		{
+			overlay(layer.mod_macros, result->mod_macros);
+			result->has_mod = true;
+		}
+
+		for(size_t j = 0; j < layer.combo_count; ++ j)
+		{
+			const resolved_keylayer_t::combo_t &combo = layer.combos[j];
+			if(combo.entry.macro.get_type() == keymacro_t::type_t::transparent)
+				continue;
+
+			resolved_keylayer_t::combo_t *target = std::find_if(result->combos, result->combos + result->combo_count, [&](const resolved_keylayer_t::combo_t &existing) {
+				return existing.mask == combo.mask;
+			});
+
+			if(target == result->combos + result->combo_count)
+			{
+				if(result->combo_count >= max_layer_combos)
+					continue;
+
+				result->combo_count ++;
+			}
+
+			*target = combo;
+		}
+	}
+
+	for(size_t i = 0; i < num_keys; ++ i)
+	{
+		if(result->macros[i].macro.get_type() == keymacro_t::type_t::transparent)
+			result->macros[i] = {};
+		if(result->mod_macros[i].macro.get_type() == keymacro_t::type_t::transparent)
+			result->mod_macros[i] = {};
+	}
+
+	for(size_t i = 0; i < result->combo_count; ++ i)
+	{
+		if(result->combos[i].entry.macro.get_type() == keymacro_t::type_t::transparent)
+			result->combos[i].entry = {};
+	}
+}
+
+uint16_t keymap_t::add_string(const char *string)
+{
+	const size_t length = strlen(string) + 1;
+	const size_t offset = strings.size();
+
+	if(offset + length >= no_index)
+		return no_index;
+
+	strings.insert(strings.end(), string, string + length);
+	return (uint16_t)offset;
+}
+
+uint8_t keymap_t::add_modifier(uint8_t modifier)
+{
+	for(uint8_t i = 0; i < modifier_count; ++ i)
+	{
+		if(modifiers[i] == modifier)
+			return i;
+	}
+
+	// Running out of slots is unlikely, when it happens the key is sent without modifiers
+	if(modifier_count >= max_keymap_modifiers)
+		return 0;
+
+	modifiers[modifier_count] = modifier;
+	return modifier_count ++;
+}
+
+keymacro_t build_none_macro()
+{
+	return keymacro_t::make(keymacro_t::type_t::none, 0);
+}
+
+keymacro_t build_hid_macro(keymap_t *map, uint8_t keycode, uint8_t modifier = 0)
+{
+	return keymacro_t::make(keymacro_t::type_t::hid_key, keycode, map->add_modifier(modifier));
+}
+
+keymacro_t build_action_macro(action_t action)
+{
+	return keymacro_t::make(keymacro_t::type_t::action, (uint8_t)action);
 }
 
 keymacro_t build_mod_macro(bool toggle)
 {
-	keymacro_t macro;
-	macro.type = keymacro_t::type_t::mod;
-	macro.mod.persist = toggle;
+	return keymacro_t::make(keymacro_t::type_t::mod, toggle ? 1 : 0);
+}
 
-	return macro;
+keymacro_t build_layer_macro(uint8_t layer, layermode_t mode)
+{
+	return keymacro_t::make(keymacro_t::type_t::layer, (uint8_t)(((uint8_t)mode << 6) | (layer & 0x3f)));
 }
 
 keymap_t *build_system_keymap()
 {
-	size_t index = 0;
+	keymap_t *map = new keymap_t;
+	map->name = map->add_string("System");
 
 	keylayer_t layer;
-	layer.macros[index ++] = build_action_macro(action_t::configure);
-	layer.macros[index ++] = build_action_macro(action_t::brightness_up);
-	layer.macros[index ++] = build_action_macro(action_t::brightness_down);
+	layer.name = keymap_t::no_index;
+	layer.parent = keymap_t::no_index;
+	layer.base_mask = (1 << num_keys) - 1;
+	layer.mod_mask = 0;
+	layer.macros = 0;
+	layer.combos = 0;
+	layer.combo_count = 0;
+	layer.has_mod = false;
 
-	layer.macros[index ++] = build_hid_macro(HID_KEY_Z, KEYBOARD_MODIFIER_LEFTCTRL);
-	layer.macros[index ++] = build_hid_macro(HID_KEY_C, KEYBOARD_MODIFIER_LEFTCTRL);
-	layer.macros[index ++] = build_hid_macro(HID_KEY_V, KEYBOARD_MODIFIER_LEFTCTRL);
+	map->macros.resize(num_keys);
 
-	layer.macros[index ++] = build_hid_macro(HID_KEY_ESCAPE);
-	layer.macros[index ++] = build_hid_macro(HID_KEY_ENTER);
-	layer.macros[index ++] = build_action_macro(action_t::flash);
+	keymacro_t *macros = map->macros.data();
+	size_t index = 0;
+
+	macros[index ++] = build_action_macro(action_t::configure);
+	macros[index ++] = build_action_macro(action_t::brightness_up);
+	macros[index ++] = build_action_macro(action_t::brightness_down);
+
+	macros[index ++] = build_hid_macro(map, HID_KEY_Z, KEYBOARD_MODIFIER_LEFTCTRL);
+	macros[index ++] = build_hid_macro(map, HID_KEY_C, KEYBOARD_MODIFIER_LEFTCTRL);
+	macros[index ++] = build_hid_macro(map, HID_KEY_V, KEYBOARD_MODIFIER_LEFTCTRL);
+
+	macros[index ++] = build_hid_macro(map, HID_KEY_ESCAPE);
+	macros[index ++] = build_hid_macro(map, HID_KEY_ENTER);
+	macros[index ++] = build_action_macro(action_t::flash);
 
-	keymap_t *map = new keymap_t;
-	map->name = "System";
-	map->active_page = 0;
 	map->layers.push_back(layer);
 
 	return map;
@@ -214,81 +446,548 @@ uint8_t string_to_hid_key(const char *str)
 	return HID_KEY_NONE;
 }
 
-void parse_macros(keymacro_t *macros, keymacro_t *reference, const json_t *json)
+uint8_t parse_modifiers(const char *modifier)
 {
-	if(json_getType(json) != JSON_ARRAY)
+	uint8_t modifiers = 0;
+
+	if(modifier)
+	{
+		if(strstr(modifier, "lctrl"))
+			modifiers |= KEYBOARD_MODIFIER_LEFTCTRL;
+		if(strstr(modifier, "rctrl"))
+			modifiers |= KEYBOARD_MODIFIER_RIGHTCTRL;
+
+		if(strstr(modifier, "lshft"))
+			modifiers |= KEYBOARD_MODIFIER_LEFTSHIFT;
+		if(strstr(modifier, "rshft"))
+			modifiers |= KEYBOARD_MODIFIER_RIGHTSHIFT;
+
+		if(strstr(modifier, "lalt"))
+			modifiers |= KEYBOARD_MODIFIER_LEFTALT;
+		if(strstr(modifier, "ralt"))
+			modifiers |= KEYBOARD_MODIFIER_RIGHTALT;
+	}
+
+	return modifiers;
+}
+
+bool parse_action(const char *value, action_t *action)
+{
+	static const struct
+	{
+		const char *name;
+		action_t action;
+	} actions[] = {
+		{ "flash", action_t::flash },
+		{ "configure", action_t::configure },
+		{ "brightness_up", action_t::brightness_up },
+		{ "brightness_down", action_t::brightness_down },
+		{ "calibrate", action_t::calibrate_stick },
+		{ "previous_layer", action_t::previous_layer },
+		{ "next_layer", action_t::next_layer },
+		{ "previous_keymap", action_t::previous_keymap },
+		{ "next_keymap", action_t::next_keymap },
+	};
+
+	if(!value)
+		return false;
+
+	for(const auto &entry : actions)
+	{
+		if(strcmp(value, entry.name) == 0)
+		{
+			*action = entry.action;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Maps gesture names to either just the action, or an object with the action in "v" and "r" to repeat it while
+// the stick is held. Anything that isn't an action unbinds the gesture
+void parse_gestures(const json_t *json, keymap_t *map)
+{
+	static const char *const names[] = { "left", "right", "up", "down", "up_left", "up_right", "down_left", "down_right", "centre" };
+	static_assert(std::size(names) == (size_t)gesture_t::count);
+
+	if(json_getType(json) != JSON_OBJ)
 		return;
 
+	for(size_t i = 0; i < std::size(names); ++ i)
+	{
+		const json_t *entry = json_getProperty(json, names[i]);
+		if(!entry)
+			continue;
+
+		gesturebinding_t &binding = map->gestures[i];
+
+		if(json_getType(entry) == JSON_OBJ)
+		{
+			const json_t *repeat = json_getProperty(entry, "r");
+
+			binding.is_bound = parse_action(json_getPropertyValue(entry, "v"), &binding.action);
+			binding.repeat = repeat && json_getBoolean(repeat);
+		}
+		else
+		{
+			binding.is_bound = (json_getType(entry) == JSON_TEXT) && parse_action(json_getValue(entry), &binding.action);
+			binding.repeat = false;
+		}
+	}
+}
+
+// Either just the mode, or an object with "mode", "buttons", "m" and "speed"
+void parse_stick(const json_t *json, stickconfig_t *stick)
+{
+	const char *mode = (json_getType(json) == JSON_TEXT) ? json_getValue(json) : json_getPropertyValue(json, "mode");
+
+	if(mode && strcmp(mode, "mouse") == 0)
+		stick->mode = stickconfig_t::mode_t::mouse;
+	else if(mode && strcmp(mode, "scroll") == 0)
+		stick->mode = stickconfig_t::mode_t::scroll;
+	else
+		stick->mode = stickconfig_t::mode_t::layers;
+
+	if(json_getType(json) != JSON_OBJ)
+		return;
+
+	stick->buttons = 0;
+
+	if(const char *buttons = json_getPropertyValue(json, "buttons"))
+	{
+		if(strstr(buttons, "left"))
+			stick->buttons |= MOUSE_BUTTON_LEFT;
+		if(strstr(buttons, "right"))
+			stick->buttons |= MOUSE_BUTTON_RIGHT;
+		if(strstr(buttons, "middle"))
+			stick->buttons |= MOUSE_BUTTON_MIDDLE;
+	}
+
+	stick->modifier = parse_modifiers(json_getPropertyValue(json, "m"));
+
+	const json_t *speed = json_getProperty(json, "speed");
+	if(speed && json_getType(speed) == JSON_INTEGER)
+		stick->speed = (uint16_t)std::clamp<int64_t>(json_getInteger(speed), 1, 1000);
+}
+
+// Decodes the next UTF-8 character, malformed bytes come out as they are
+static uint32_t next_code_point(const char *&text)
+{
+	const uint8_t lead = (uint8_t)*text ++;
+
+	// Continuation bytes that follow the lead byte
+	size_t length = 0;
+
+	if((lead & 0xe0) == 0xc0)
+		length = 1;
+	else if((lead & 0xf0) == 0xe0)
+		length = 2;
+	else if((lead & 0xf8) == 0xf0)
+		length = 3;
+
+	uint32_t code_point = length ? (lead & (0x3f >> length)) : lead;
+
+	for(; length > 0 && ((uint8_t)*text & 0xc0) == 0x80; -- length)
+		code_point = (code_point << 6) | ((uint8_t)*text ++ & 0x3f);
+
+	return code_point;
+}
+
+// Typographic characters that commonly sneak in from copy and paste, typed as their plain ASCII counterpart
+static uint32_t fold_code_point(uint32_t code_point)
+{
+	switch(code_point)
+	{
+		case 0x00a0: // No-break space
+			return ' ';
+		case 0x2010: // Hyphens and dashes
+		case 0x2011:
+		case 0x2013:
+		case 0x2014:
+		case 0x2212:
+			return '-';
+		case 0x2018: // Single quotes
+		case 0x2019:
+			return '\'';
+		case 0x201c: // Double quotes
+		case 0x201d:
+			return '"';
+		default:
+			return code_point;
+	}
+}
+
+// One report per character, keys simply replace each other. The same key twice in a row needs a release in
+// between to register again, and the stream always ends with everything released
+static void append_text(std::vector<uint8_t> &code, const char *text)
+{
+	static const uint8_t ascii_to_keycode[128][2] = { HID_ASCII_TO_KEYCODE };
+
+	std::vector<uint8_t> reports;
+	uint8_t previous = HID_KEY_NONE;
+
+	while(*text != '\0')
+	{
+		const uint32_t code_point = fold_code_point(next_code_point(text));
+
+		// Nothing outside of ASCII can be typed without knowing the host's layout and input method
+		if(code_point >= 128 || ascii_to_keycode[code_point][1] == HID_KEY_NONE)
+			continue;
+
+		const uint8_t keycode = ascii_to_keycode[code_point][1];
+		const uint8_t modifier = ascii_to_keycode[code_point][0] ? KEYBOARD_MODIFIER_LEFTSHIFT : 0;
+
+		if(keycode == previous)
+			reports.insert(reports.end(), { 0, HID_KEY_NONE });
+
+		reports.insert(reports.end(), { modifier, keycode });
+		previous = keycode;
+	}
+
+	if(reports.empty())
+		return;
+
+	reports.insert(reports.end(), { 0, HID_KEY_NONE });
+
+	// Split up anything too long for the count
+	for(size_t offset = 0; offset < reports.size();)
+	{
+		const size_t count = std::min<size_t>((reports.size() - offset) / 2, 0xffff);
+
+		code.push_back((uint8_t)sequenceop_t::type);
+		code.push_back(count & 0xff);
+		code.push_back(count >> 8);
+		code.insert(code.end(), reports.begin() + offset, reports.begin() + offset + count * 2);
+
+		offset += count * 2;
+	}
+}
+
+static void append_key_op(std::vector<uint8_t> &code, sequenceop_t op, const json_t *step, const char *key)
+{
+	code.push_back((uint8_t)op);
+	code.push_back(key ? string_to_hid_key(key) : HID_KEY_NONE);
+	code.push_back(step ? parse_modifiers(json_getPropertyValue(step, "m")) : 0);
+}
+
+// A step is either the name of a key to tap, or an object with one of "tap", "press" or "release" naming the key
+// (modifiers in "m"), "delay" in milliseconds or "type" with a string
+static void append_step(std::vector<uint8_t> &code, const json_t *step)
+{
+	if(json_getType(step) == JSON_TEXT)
+	{
+		append_key_op(code, sequenceop_t::tap, nullptr, json_getValue(step));
+		return;
+	}
+
+	if(json_getType(step) != JSON_OBJ)
+		return;
+
+	if(json_getProperty(step, "tap"))
+		append_key_op(code, sequenceop_t::tap, step, json_getPropertyValue(step, "tap"));
+	else if(json_getProperty(step, "press"))
+		append_key_op(code, sequenceop_t::press, step, json_getPropertyValue(step, "press"));
+	else if(json_getProperty(step, "release"))
+		append_key_op(code, sequenceop_t::release, step, json_getPropertyValue(step, "release"));
+
+	const json_t *delay = json_getProperty(step, "delay");
+	if(delay && json_getType(delay) == JSON_INTEGER)
+	{
+		const uint16_t milliseconds = (uint16_t)std::clamp<int64_t>(json_getInteger(delay), 0, 0xffff);
+
+		code.push_back((uint8_t)sequenceop_t::delay);
+		code.push_back(milliseconds & 0xff);
+		code.push_back(milliseconds >> 8);
+	}
+
+	if(const char *text = json_getPropertyValue(step, "type"))
+		append_text(code, text);
+}
+
+keymacro_t build_sequence_macro(keymap_t *map, std::vector<uint8_t> &code)
+{
+	code.push_back((uint8_t)sequenceop_t::end);
+
+	if(map->sequences.size() > 0xff || map->bytecode.size() + code.size() > 0xffff)
+		return build_none_macro();
+
+	map->sequences.push_back((uint16_t)map->bytecode.size());
+	map->bytecode.insert(map->bytecode.end(), code.begin(), code.end());
+
+	return keymacro_t::make(keymacro_t::type_t::sequence, (uint8_t)(map->sequences.size() - 1));
+}
+
+// The tap sends "v" with the modifiers in "m". "hold" is either "mod" or the modifiers to hold, "term" the
+// tapping term in milliseconds, "permissive" and "hold_on_press" enable the respective flags
+keymacro_t build_tap_hold_macro(keymap_t *map, const json_t *entry)
+{
+	if(map->tap_holds.size() > 0xff)
+		return build_none_macro();
+
+	const char *value = json_getPropertyValue(entry, "v");
+	const char *hold = json_getPropertyValue(entry, "hold");
+
+	taphold_t tap_hold = {};
+	tap_hold.keycode = value ? string_to_hid_key(value) : HID_KEY_NONE;
+	tap_hold.modifier = parse_modifiers(json_getPropertyValue(entry, "m"));
+	tap_hold.term_ms = TAPHOLD_DEFAULT_TERM_MS;
+
+	if(hold && strcmp(hold, "mod") == 0)
+		tap_hold.flags |= taphold_t::hold_mod;
+	else
+		tap_hold.hold_modifier = parse_modifiers(hold);
+
+	const json_t *term = json_getProperty(entry, "term");
+	if(term && json_getType(term) == JSON_INTEGER)
+		tap_hold.term_ms = (uint16_t)std::clamp<int64_t>(json_getInteger(term), 10, 5000);
+
+	const json_t *permissive = json_getProperty(entry, "permissive");
+	if(permissive && json_getBoolean(permissive))
+		tap_hold.flags |= taphold_t::permissive_hold;
+
+	const json_t *hold_on_press = json_getProperty(entry, "hold_on_press");
+	if(hold_on_press && json_getBoolean(hold_on_press))
+		tap_hold.flags |= taphold_t::hold_on_other_key;
+
+	map->tap_holds.push_back(tap_hold);
+	return keymacro_t::make(keymacro_t::type_t::tap_hold, (uint8_t)(map->tap_holds.size() - 1));
+}
+
+keymacro_t parse_macro(keymap_t *map, const json_t *entry, const char **label)
+{
+	const char *type = json_getPropertyValue(entry, "t");
+	if(!type)
+		type = "hid";
+
+	if(strcmp(type, "action") == 0)
+	{
+		// Older configs have no value, flashing used to be the only action
+		action_t action = action_t::flash;
+		parse_action(json_getPropertyValue(entry, "v"), &action);
+
+		return build_action_macro(action);
+	}
+
+	if(strcmp(type, "macro") == 0)
+	{
+		const json_t *steps = json_getProperty(entry, "v");
+		if(!steps || json_getType(steps) != JSON_ARRAY)
+			return build_none_macro();
+
+		std::vector<uint8_t> code;
+
+		for(const json_t *step = json_getChild(steps); step; step = json_getSibling(step))
+			append_step(code, step);
+
+		*label = json_getPropertyValue(entry, "l");
+		return build_sequence_macro(map, code);
+	}
+
+	if(strcmp(type, "taphold") == 0)
+	{
+		*label = json_getPropertyValue(entry, "l");
+		return build_tap_hold_macro(map, entry);
+	}
+
+	if(strcmp(type, "type") == 0)
+	{
+		const char *text = json_getPropertyValue(entry, "v");
+		if(!text)
+			return build_none_macro();
+
+		std::vector<uint8_t> code;
+		append_text(code, text);
+
+		*label = json_getPropertyValue(entry, "l");
+		return build_sequence_macro(map, code);
+	}
+
+	if(strcmp(type, "layer") == 0)
+	{
+		// "v" is the index of a layer in the keymap, "mode" one of "momentary" (the default), "toggle" or "oneshot"
+		const json_t *layer = json_getProperty(entry, "v");
+		if(!layer || json_getType(layer) != JSON_INTEGER || json_getInteger(layer) < 0 || json_getInteger(layer) > 0x3f)
+			return build_none_macro();
+
+		const char *mode = json_getPropertyValue(entry, "mode");
+		layermode_t layer_mode = layermode_t::momentary;
+
+		if(mode && strcmp(mode, "toggle") == 0)
+			layer_mode = layermode_t::toggle;
+		else if(mode && strcmp(mode, "oneshot") == 0)
+			layer_mode = layermode_t::one_shot;
+
+		*label = json_getPropertyValue(entry, "l");
+		return build_layer_macro((uint8_t)json_getInteger(layer), layer_mode);
+	}
+
+	if(strcmp(type, "transparent") == 0)
+		return keymacro_t::make(keymacro_t::type_t::transparent, 0);
+
+	if(strcmp(type, "mod") == 0)
+	{
+		const json_t *persist = json_getProperty(entry, "p");
+		return build_mod_macro(persist && json_getBoolean(persist));
+	}
+
+	if(strcmp(type, "hid") == 0)
+	{
+		const char *value = json_getPropertyValue(entry, "v");
+		const char *modifier = json_getPropertyValue(entry, "m");
+
+		*label = json_getPropertyValue(entry, "l");
+
+		return build_hid_macro(map, value ? string_to_hid_key(value) : HID_KEY_NONE, parse_modifiers(modifier));
+	}
+
+	return build_none_macro();
+}
+
+// Names in the sparse form have to be a plain decimal key index, anything else is ignored
+static bool parse_key_index(const char *name, size_t *index)
+{
+	if(!name || *name == '\0')
+		return false;
+
+	size_t value = 0;
+
+	for(; *name != '\0'; ++ name)
+	{
+		if(*name < '0' || *name > '9')
+			return false;
+
+		value = value * 10 + (*name - '0');
+
+		if(value >= num_keys)
+			return false;
+	}
+
+	*index = value;
+	return true;
+}
+
+// Accepts either an array with one entry per key, where null entries are inherited from the parent layer,
+// or an object with sparse "index": key overrides. Returns the mask of keys that were set
+uint16_t parse_macros(keymap_t *map, const json_t *json, keymacro_t *macros, const char **labels)
+{
+	const jsonType_t type = json_getType(json);
+	if(type != JSON_ARRAY && type != JSON_OBJ)
+		return 0;
+
+	uint16_t mask = 0;
 	size_t index = 0;
 
 	for(const json_t *entry = json_getChild(json); entry; entry = json_getSibling(entry))
 	{
-		if(reference && reference[index].type == keymacro_t::type_t::mod)
+		// Object members come in any order, one bad name mustn't drop the overrides after it
+		if(type == JSON_OBJ && !parse_key_index(json_getName(entry), &index))
+			continue;
+
+		if(index >= num_keys)
+			break;
+
+		if(json_getType(entry) == JSON_OBJ)
 		{
-			macros[index] = reference[index];
+			macros[index] = parse_macro(map, entry, &labels[index]);
+			mask |= (1 << index);
+		}
+
+		index ++;
+	}
 
-			if((++ index) >= num_key_cols * num_key_rows)
-				return;
+	return mask;
+}
 
+void append_macros(keymap_t *map, uint16_t mask, const keymacro_t *macros, const char *const *labels)
+{
+	for(size_t i = 0; i < num_keys; ++ i)
+	{
+		if(!(mask & (1 << i)))
 			continue;
+
+		// Macros are appended in order, so this keeps the label table sorted
+		if(labels[i] && labels[i][0] != '\0')
+		{
+			const uint16_t string = map->add_string(labels[i]);
+			if(string != keymap_t::no_index)
+				map->labels.push_back({ (uint16_t)map->macros.size(), string });
 		}
 
-		const char *type = json_getPropertyValue(entry, "t");
-		if(!type)
-			type = "hid";
+		map->macros.push_back(macros[i]);
+	}
+}
+
+// Each combo is a key object with the indices of its keys in "keys", at least two of them
+void parse_combos(keymap_t *map, const json_t *json, keylayer_t *layer)
+{
+	layer->combos = (uint16_t)map->combos.size();
+	layer->combo_count = 0;
+
+	if(!json || json_getType(json) != JSON_ARRAY)
+		return;
+
+	for(const json_t *entry = json_getChild(json); entry && layer->combo_count < max_layer_combos; entry = json_getSibling(entry))
+	{
+		const json_t *keys = json_getProperty(entry, "keys");
+		if(!keys || json_getType(keys) != JSON_ARRAY)
+			continue;
 
-		keymacro_t macro = {};
-		macro.type = keymacro_t::type_t::none;
+		uint16_t mask = 0;
 
-		if(strcmp(type, "action") == 0)
-			macro.type = keymacro_t::type_t::action;
-		else if(strcmp(type, "mod") == 0)
+		for(const json_t *key = json_getChild(keys); key; key = json_getSibling(key))
 		{
-			const json_t *persist = json_getProperty(entry, "p");
+			if(json_getType(key) != JSON_INTEGER)
+				continue;
 
-			macro.type = keymacro_t::type_t::mod;
-			macro.mod.persist = (persist && json_getBoolean(persist));
+			const int64_t index = json_getInteger(key);
+			if(index >= 0 && index < (int64_t)num_keys)
+				mask |= 1 << index;
 		}
-		else if(strcmp(type, "hid") == 0)
-		{
-			macro.type = keymacro_t::type_t::hid_key;
 
-			const char *value = json_getPropertyValue(entry, "v");
-			const char *modifier = json_getPropertyValue(entry, "m");
-			const char *label = json_getPropertyValue(entry, "l");
+		if(std::popcount(mask) < 2)
+			continue;
 
-			if(modifier)
-			{
-				if(strstr(modifier, "lctrl"))
-					macro.hid_key.modifier |= KEYBOARD_MODIFIER_LEFTCTRL;
-				if(strstr(modifier, "rctrl"))
-					macro.hid_key.modifier |= KEYBOARD_MODIFIER_RIGHTCTRL;
-
-				if(strstr(modifier, "lshft"))
-					macro.hid_key.modifier |= KEYBOARD_MODIFIER_LEFTSHIFT;
-				if(strstr(modifier, "rshft"))
-					macro.hid_key.modifier |= KEYBOARD_MODIFIER_RIGHTSHIFT;
-
-				if(strstr(modifier, "lalt"))
-					macro.hid_key.modifier |= KEYBOARD_MODIFIER_LEFTALT;
-				if(strstr(modifier, "ralt"))
-					macro.hid_key.modifier |= KEYBOARD_MODIFIER_RIGHTALT;
-			}
+		const char *label = nullptr;
+		const keymacro_t macro = parse_macro(map, entry, &label);
 
-			if(value)
-				macro.hid_key.keycode = string_to_hid_key(value);
+		map->combos.push_back({ mask, (uint16_t)map->macros.size() });
+		append_macros(map, 1, &macro, &label);
 
-			macro.hid_key.label = label;
-		}
+		layer->combo_count ++;
+	}
+}
+
+uint16_t parse_parent(const keymap_t *map, const json_t *layer)
+{
+	const json_t *inherit = json_getProperty(layer, "inherit");
 
-		macros[index ++] = macro;
+	if(inherit && json_getType(inherit) == JSON_INTEGER)
+	{
+		const int64_t index = json_getInteger(inherit);
+		if(index >= 0 && (size_t)index < map->layers.size())
+			return (uint16_t)index;
+	}
+	else if(inherit && json_getType(inherit) == JSON_TEXT)
+	{
+		const char *name = json_getValue(inherit);
 
-		if(index >= num_key_cols * num_key_rows)
-			return;
+		for(size_t i = 0; i < map->layers.size(); ++ i)
+		{
+			const char *layer_name = map->get_string(map->layers[i].name);
+			if(layer_name && strcmp(layer_name, name) == 0)
+				return (uint16_t)i;
+		}
 	}
+
+	// Layers without an explicit parent build on the first layer of the keymap's base
+	if(map->base)
+		return keylayer_t::parent_in_base | 0;
+
+	return keymap_t::no_index;
 }
 
-keymap_t *parse_keymap(const json_t *keymap)
+keymap_t *parse_keymap(const json_t *keymap, const keymap_t *base)
 {
 	if(json_getType(keymap) != JSON_OBJ)
 		return nullptr;
@@ -297,38 +996,86 @@ keymap_t *parse_keymap(const json_t *keymap)
 	if(!layers || json_getType(layers) != JSON_ARRAY)
 		return nullptr;
 
+	const char *name = json_getPropertyValue(keymap, "name");
+
 	keymap_t *result = new keymap_t;
-	result->name = json_getPropertyValue(keymap, "name");
-	result->active_page = 0;
+	result->name = result->add_string(name ? name : "No name");
+	result->base = base;
+
+	if(base)
+	{
+		result->stick = base->stick;
+		result->combo_window_ms = base->combo_window_ms;
+		std::copy(std::begin(base->gestures), std::end(base->gestures), result->gestures);
+	}
+
+	const json_t *combo_window = json_getProperty(keymap, "combo_window");
+	if(combo_window && json_getType(combo_window) == JSON_INTEGER)
+		result->combo_window_ms = (uint16_t)std::clamp<int64_t>(json_getInteger(combo_window), 5, 500);
 
-	if(!result->name)
-		result->name = "No name";
+	if(const json_t *stick = json_getProperty(keymap, "stick"))
+		parse_stick(stick, &result->stick);
+	if(const json_t *gestures = json_getProperty(keymap, "gestures"))
+		parse_gestures(gestures, result);
+
+	bool has_keys = false;
 
 	for(const json_t *layer = json_getChild(layers); layer; layer = json_getSibling(layer))
 	{
 		const json_t *base = json_getProperty(layer, "base");
-		if(!base)
-			continue;
+		const json_t *mod = json_getProperty(layer, "mod");
 
 		keylayer_t parsed;
-		parse_macros(parsed.macros, nullptr, base);
+		parsed.name = keymap_t::no_index;
+		parsed.parent = parse_parent(result, layer);
 
-		const json_t *mod = json_getProperty(layer, "mod");
-		if(mod)
-			parse_macros(parsed.mod_macros, parsed.macros, mod);
+		// Layers without keys still take up their slot, layer keys and "inherit" refer to the ones after it by index
+		if(base || parsed.parent != keymap_t::no_index)
+			has_keys = true;
+
+		keymacro_t base_macros[num_keys] = {};
+		keymacro_t mod_macros[num_keys] = {};
 
-		const json_t *name = json_getProperty(layer, "name");
-		if(name && json_getType(name) == JSON_TEXT)
-			parsed.name = json_getValue(name);
+		const char *base_labels[num_keys] = {};
+		const char *mod_labels[num_keys] = {};
+
+		parsed.base_mask = base ? parse_macros(result, base, base_macros, base_labels) : 0;
+		parsed.mod_mask = mod ? parse_macros(result, mod, mod_macros, mod_labels) : 0;
+		parsed.macros = (uint16_t)result->macros.size();
+
+		append_macros(result, parsed.base_mask, base_macros, base_labels);
+		append_macros(result, parsed.mod_mask, mod_macros, mod_labels);
+
+		parse_combos(result, json_getProperty(layer, "combos"), &parsed);
+
+		parsed.has_mod = mod && (json_getType(mod) == JSON_ARRAY || json_getType(mod) == JSON_OBJ);
+
+		if(parsed.parent != keymap_t::no_index)
+		{
+			const bool in_base = (parsed.parent & keylayer_t::parent_in_base);
+			const uint16_t index = parsed.parent & ~keylayer_t::parent_in_base;
+
+			parsed.has_mod |= in_base ? result->base->layers[index].has_mod : result->layers[index].has_mod;
+		}
+
+		const json_t *layer_name = json_getProperty(layer, "name");
+		if(layer_name && json_getType(layer_name) == JSON_TEXT)
+			parsed.name = result->add_string(json_getValue(layer_name));
 
 		result->layers.push_back(parsed);
 	}
 
-	if(result->layers.empty())
+	if(!has_keys)
 	{
 		delete result;
 		return nullptr;
 	}
 
+	result->layers.shrink_to_fit();
+	result->macros.shrink_to_fit();
+	result->labels.shrink_to_fit();
+	result->strings.shrink_to_fit();
+	result->combos.shrink_to_fit();
+
 	return result;
 }
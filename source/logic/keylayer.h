@@ -16,57 +16,267 @@ enum class action_t
 	configure,
 	brightness_up,
 	brightness_down,
+	calibrate_stick,
+	previous_layer,
+	next_layer,
+	previous_keymap,
+	next_keymap,
 };
 
+// How a layer key puts its layer on the layer stack
+enum class layermode_t : uint8_t
+{
+	momentary, // While the key is held
+	toggle,    // Until the key is pressed again
+	one_shot,  // For the next key press, until that key is released
+};
+
+// Packed macro record: 3 bit type, 5 bit index into the keymap's modifier table and 8 bit payload.
+// The payload is the keycode for hid keys, the action_t for actions, the persist flag for mod keys, the index
+// into keymap_t::sequences or keymap_t::tap_holds for sequences and tap-hold keys and the layermode_t in the top
+// two bits above the layer index for layer keys
 struct keymacro_t
 {
-	enum class type_t
+	enum class type_t : uint8_t
 	{
 		none,
 		hid_key,
 		action,
 		mod,
+		sequence,
+		tap_hold,
+		layer,
+		transparent, // Shows the key of the layer below on the layer stack
 	};
 
-	type_t type = type_t::none;
+	uint16_t value = 0;
 
-	union
+	static keymacro_t make(type_t type, uint8_t payload, uint8_t modifier_index = 0)
 	{
-		struct
-		{
-			uint8_t modifier;
-			uint8_t keycode;
-			const char *label;
-		} hid_key;
+		keymacro_t macro;
+		macro.value = (uint16_t)(((uint16_t)type << 13) | ((modifier_index & 0x1f) << 8) | payload);
 
-		struct
-		{
-			action_t action;
-		} action;
+		return macro;
+	}
 
-		struct
-		{
-			bool persist;
-		} mod;
+	type_t get_type() const { return (type_t)(value >> 13); }
+	uint8_t get_modifier_index() const { return (value >> 8) & 0x1f; }
+	uint8_t get_payload() const { return value & 0xff; }
+
+	uint8_t get_keycode() const { return get_payload(); }
+	action_t get_action() const { return (action_t)get_payload(); }
+	bool get_persist() const { return get_payload() != 0; }
+	uint8_t get_layer() const { return get_payload() & 0x3f; }
+	layermode_t get_layer_mode() const { return (layermode_t)(get_payload() >> 6); }
+};
+
+static_assert(sizeof(keymacro_t) == 2);
+
+// Sequence bytecode, played back by sequenceplayer_t. Key operations are followed by the keycode and modifier,
+// delays by the milliseconds as 16 bit little endian. Typed text is turned into keyboard reports up front, type is
+// followed by their count as 16 bit little endian and a modifier and keycode pair per report
+enum class sequenceop_t : uint8_t
+{
+	end,
+	press,
+	release,
+	tap,
+	delay,
+	type,
+};
+
+constexpr size_t num_keys = num_key_rows * num_key_cols;
+constexpr size_t max_keymap_modifiers = 32;
+constexpr size_t max_layer_combos = 16;
+constexpr size_t num_key_slots = num_keys + max_layer_combos; // Keys followed by the combos of the active layer
+
+#define COMBO_DEFAULT_WINDOW_MS 40
+
+#define LAYER_STACK_DEPTH 8
+
+#define TAPHOLD_DEFAULT_TERM_MS 200
+
+// Dual role key, sends a key when tapped and acts as modifiers or the mod key while held. See tapholdresolver_t
+struct taphold_t
+{
+	enum : uint8_t
+	{
+		hold_mod = 1 << 0,          // Held it's the mod key rather than modifiers
+		permissive_hold = 1 << 1,   // Another key tapped while this one is down makes it a hold, even within the term
+		hold_on_other_key = 1 << 2, // Any other key pressed while this one is down makes it a hold right away
 	};
+
+	uint8_t keycode;
+	uint8_t modifier;      // Sent along with the keycode on a tap
+	uint8_t hold_modifier; // Held down while it's held, unless it's the mod key
+	uint8_t flags;
+	uint16_t term_ms;      // Held longer than this it's a hold
+};
+
+// Chord of two or more keys that acts as a key of its own
+struct keycombo_t
+{
+	uint16_t mask;  // One bit per key
+	uint16_t macro; // Index into keymap_t::macros
+};
+
+struct keylabel_t
+{
+	uint16_t macro;  // Index into keymap_t::macros
+	uint16_t string; // Offset into keymap_t::strings
 };
 
+// Layers only store the keys they override on top of their parent. The override records live in keymap_t::macros
+// starting at `macros`, base keys first, then mod keys, each in key order
 struct keylayer_t
 {
+	static constexpr uint16_t parent_in_base = 0x8000; // Parent is a layer of keymap_t::base
+
+	uint16_t name;      // Offset into keymap_t::strings
+	uint16_t parent;    // Index into keymap_t::layers, or keymap_t::no_index
+	uint16_t base_mask; // One bit per overridden key
+	uint16_t mod_mask;
+	uint16_t macros;
+	uint16_t combos;    // Index into keymap_t::combos
+	uint8_t combo_count;
+	bool has_mod;       // Set if this layer or any of its parents has a mod block
+};
+
+// Flattened view of a layer with its whole inheritance chain applied
+struct resolved_keylayer_t
+{
+	struct entry_t
+	{
+		keymacro_t macro;
+		uint8_t modifier;
+		const char *label;
+
+		// Side table record, which one depends on the macro type. Use the getters
+		union
+		{
+			const uint8_t *sequence; // Bytecode of sequence macros
+			const taphold_t *tap_hold;
+		};
+
+		const uint8_t *get_sequence() const { return (macro.get_type() == keymacro_t::type_t::sequence) ? sequence : nullptr; }
+		const taphold_t *get_tap_hold() const { return (macro.get_type() == keymacro_t::type_t::tap_hold) ? tap_hold : nullptr; }
+	};
+
 	const char *name = nullptr;
-	keymacro_t macros[num_key_rows * num_key_cols] = {};
-	keymacro_t mod_macros[num_key_rows * num_key_cols] = {};
+	bool has_mod = false;
+
+	struct combo_t
+	{
+		uint16_t mask;
+		entry_t entry;
+	};
+
+	entry_t macros[num_keys] = {};
+	entry_t mod_macros[num_keys] = {};
+
+	// Including those of the parents, unless overridden with the same keys. The same with and without mod
+	combo_t combos[max_layer_combos] = {};
+	uint8_t combo_count = 0;
+
+	const entry_t *get_macros(bool mod) const { return mod ? mod_macros : macros; }
+
+	// Any key slot, nullptr for combos that don't exist
+	const entry_t *get_entry(size_t key, bool mod) const
+	{
+		if(key < num_keys)
+			return &get_macros(mod)[key];
+
+		return (key - num_keys < combo_count) ? &combos[key - num_keys].entry : nullptr;
+	}
+};
+
+// How the thumbstick is used while a keymap is active
+struct stickconfig_t
+{
+	enum class mode_t : uint8_t
+	{
+		layers, // Flicks cycle layers and keymaps
+		mouse,  // Pointer motion
+		scroll, // Vertical wheel and horizontal pan
+	};
+
+	mode_t mode = mode_t::layers;
+	uint8_t buttons = 0;  // Mouse buttons held while the stick is deflected, eg. middle to orbit in CAD
+	uint8_t modifier = 0; // Keyboard modifiers held along with them
+	uint16_t speed = 100; // Percent of the default speed
+};
+
+// Thumbstick gestures, recognised by stickgesture_t
+enum class gesture_t : uint8_t
+{
+	left,
+	right,
+	up,
+	down,
+	up_left,
+	up_right,
+	down_left,
+	down_right,
+	centre, // Back at rest after any of the above
+	count
+};
+
+struct gesturebinding_t
+{
+	bool is_bound = false;
+	bool repeat = false; // Fire again while the stick is held
+	action_t action = action_t::flash;
 };
 
 struct keymap_t
 {
-	const char *name;
+	static constexpr uint16_t no_index = 0xffff;
+
+	uint16_t name = no_index;
+	uint8_t modifier_count = 1; // Index 0 is always "no modifier"
+
+	uint8_t modifiers[max_keymap_modifiers] = {};
+
+	const keymap_t *base = nullptr; // Keymap this one inherits from, must outlive it
+
+	stickconfig_t stick; // Inherited from the base unless set
+
+	// Also inherited, entries in the config only override single gestures
+	gesturebinding_t gestures[(size_t)gesture_t::count] = {
+		{ true, true, action_t::previous_layer },
+		{ true, true, action_t::next_layer },
+		{ true, true, action_t::previous_keymap },
+		{ true, true, action_t::next_keymap },
+	};
+
 	std::vector<keylayer_t> layers;
-	uint8_t active_page;
+	std::vector<keymacro_t> macros;
+	std::vector<keylabel_t> labels; // Sorted by macro index
+	std::vector<char> strings;
+	std::vector<uint16_t> sequences; // Offsets into bytecode
+	std::vector<uint8_t> bytecode;
+	std::vector<taphold_t> tap_holds;
+	std::vector<keycombo_t> combos;
+
+	uint16_t combo_window_ms = COMBO_DEFAULT_WINDOW_MS; // Inherited from the base unless set
+
+	const char *get_name() const { return get_string(name); }
+	const char *get_string(uint16_t offset) const { return (offset == no_index) ? nullptr : strings.data() + offset; }
+	const char *get_label(uint16_t macro) const;
+	const uint8_t *get_sequence(uint8_t index) const { return (index < sequences.size()) ? bytecode.data() + sequences[index] : nullptr; }
+
+	void resolve_layer(size_t layer, resolved_keylayer_t *result) const;
+	// Layers further up the stack win, bottom first. Every layer above the bottom one is resolved into scratch
+	// before it gets merged into result
+	void resolve_stack(const uint8_t *stack, size_t count, resolved_keylayer_t *result, resolved_keylayer_t *scratch) const;
+
+	uint16_t add_string(const char *string);
+	uint8_t add_modifier(uint8_t modifier);
 };
 
 extern keymap_t *build_system_keymap();
 
-extern keymap_t *parse_keymap(const json_t *keymap);
+// `base` is the keymap named by the "inherit" property, if any
+extern keymap_t *parse_keymap(const json_t *keymap, const keymap_t *base);
 
 #endif //KEYLAYER_H
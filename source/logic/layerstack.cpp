@@ -0,0 +1,87 @@
+#include <algorithm>
+#include "layerstack.h"
+
+bool layerstack_t::update(uint8_t key, bool is_press, const resolved_keylayer_t::entry_t *entry, size_t layer_count)
+{
+	stackedlayer_t *const begin = m_layers;
+	stackedlayer_t *end = m_layers + m_depth;
+
+	if(!is_press)
+	{
+		// Momentary layers and used up one-shot layers go away with the key holding them
+		end = std::remove_if(begin, end, [&](const stackedlayer_t &layer) { return layer.key == key; });
+	}
+	else
+	{
+		if(!entry)
+			return false;
+
+		const keymacro_t macro = entry->macro;
+
+		if(macro.get_type() == keymacro_t::type_t::layer)
+		{
+			if(macro.get_layer() >= layer_count)
+				return false;
+
+			stackedlayer_t layer;
+			layer.layer = macro.get_layer();
+			layer.mode = macro.get_layer_mode();
+
+			if(layer.mode == layermode_t::momentary)
+				layer.key = key;
+
+			// Toggles, and one-shot layers that are still waiting for their key, come off again when pressed twice
+			stackedlayer_t *existing = std::find_if(begin, end, [&](const stackedlayer_t &other) {
+				return other.layer == layer.layer && other.mode == layer.mode && other.key == stackedlayer_t::no_key;
+			});
+
+			if(layer.mode != layermode_t::momentary && existing != end)
+				end = std::copy(existing + 1, end, existing);
+			else if(end != begin + LAYER_STACK_DEPTH)
+				*end ++ = layer;
+		}
+		else if(macro.get_type() != keymacro_t::type_t::mod)
+		{
+			// The next key press uses up waiting one-shot layers, they stay until that key is released
+			for(stackedlayer_t *layer = begin; layer != end; ++ layer)
+			{
+				if(layer->mode == layermode_t::one_shot && layer->key == stackedlayer_t::no_key)
+					layer->key = key;
+			}
+
+			return false;
+		}
+	}
+
+	// Every change pushes or removes layers
+	if(end - begin == m_depth)
+		return false;
+
+	m_depth = (uint8_t)(end - begin);
+	return true;
+}
+
+bool layerstack_t::release_keys()
+{
+	stackedlayer_t *end = std::remove_if(m_layers, m_layers + m_depth, [](const stackedlayer_t &layer) {
+		return layer.key != stackedlayer_t::no_key;
+	});
+
+	if(end - m_layers == m_depth)
+		return false;
+
+	m_depth = (uint8_t)(end - m_layers);
+	return true;
+}
+
+size_t layerstack_t::get_stack(uint8_t page, uint8_t *stack) const
+{
+	size_t count = 0;
+
+	stack[count ++] = page;
+
+	for(size_t i = 0; i < m_depth; ++ i)
+		stack[count ++] = m_layers[i].layer;
+
+	return count;
+}
@@ -0,0 +1,43 @@
+#ifndef MACROPAD_LAYERSTACK_H
+#define MACROPAD_LAYERSTACK_H
+
+#include <cstdint>
+#include <cstddef>
+#include "keylayer.h"
+
+// Layer put on top of the active page by a layer key
+struct stackedlayer_t
+{
+	static constexpr uint8_t no_key = 0xff;
+
+	uint8_t layer = 0;
+	layermode_t mode = layermode_t::momentary;
+	uint8_t key = no_key; // Key slot whose release takes it off again
+};
+
+// Layers that layer keys put on top of the active page, bottom first. Momentary layers stay while their key is
+// held, toggles until pressed again and one-shot layers until the key pressed next is released
+class layerstack_t
+{
+public:
+	layerstack_t() = default;
+
+	// Presses come with what the key does on the current layer, nullptr for releases and keys that don't exist.
+	// layer_count is that of the active keymap. Returns true if layers were pushed or removed
+	bool update(uint8_t key, bool is_press, const resolved_keylayer_t::entry_t *entry, size_t layer_count);
+	// Drops the layers held by keys, toggles and one-shot layers that are still waiting stay. Returns true if any went
+	bool release_keys();
+	void clear() { m_depth = 0; }
+
+	// The page followed by the stacked layers, as keymap_t::resolve_stack() takes them. Returns the count
+	size_t get_stack(uint8_t page, uint8_t *stack) const;
+
+	size_t get_depth() const { return m_depth; }
+	const stackedlayer_t &get_layer(size_t index) const { return m_layers[index]; }
+
+private:
+	stackedlayer_t m_layers[LAYER_STACK_DEPTH] = {};
+	uint8_t m_depth = 0;
+};
+
+#endif //MACROPAD_LAYERSTACK_H
@@ -0,0 +1,168 @@
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include "lz.h"
+
+constexpr size_t min_match = 4;
+constexpr size_t hash_bits = 8;
+
+constexpr uint16_t no_position = 0xffff;
+
+static uint32_t read_u32(const uint8_t *data)
+{
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+
+	return value;
+}
+
+static bool write_length(uint8_t *target, size_t capacity, size_t &out, size_t length)
+{
+	for(; length >= 255; length -= 255)
+	{
+		if(out >= capacity)
+			return false;
+
+		target[out ++] = 255;
+	}
+
+	if(out >= capacity)
+		return false;
+
+	target[out ++] = (uint8_t)length;
+	return true;
+}
+static bool read_length(const uint8_t *source, size_t length, size_t &in, size_t &value)
+{
+	uint8_t byte;
+
+	do
+	{
+		if(in >= length)
+			return false;
+
+		byte = source[in ++];
+		value += byte;
+	}
+	while(byte == 255);
+
+	return true;
+}
+
+// A match length of 0 ends the block with literals only
+static bool write_sequence(uint8_t *target, size_t capacity, size_t &out, const uint8_t *literals, size_t literal_length, size_t offset, size_t match_length)
+{
+	if(out >= capacity)
+		return false;
+
+	const size_t match_code = match_length ? match_length - min_match : 0;
+	target[out ++] = (uint8_t)((std::min<size_t>(literal_length, 15) << 4) | std::min<size_t>(match_code, 15));
+
+	if(literal_length >= 15 && !write_length(target, capacity, out, literal_length - 15))
+		return false;
+
+	if(out + literal_length > capacity)
+		return false;
+
+	memcpy(target + out, literals, literal_length);
+	out += literal_length;
+
+	if(match_length == 0)
+		return true;
+
+	if(out + 2 > capacity)
+		return false;
+
+	target[out ++] = offset & 0xff;
+	target[out ++] = (offset >> 8) & 0xff;
+
+	return match_code < 15 || write_length(target, capacity, out, match_code - 15);
+}
+
+size_t lz_compress(const uint8_t *source, size_t length, uint8_t *target, size_t capacity)
+{
+	uint16_t table[1 << hash_bits];
+	std::fill(std::begin(table), std::end(table), no_position);
+
+	size_t out = 0;
+	size_t anchor = 0;
+	size_t position = 0;
+
+	while(position + min_match <= length && position < no_position)
+	{
+		const uint32_t sequence = read_u32(source + position);
+		const uint32_t hash = (sequence * 2654435761u) >> (32 - hash_bits);
+
+		const size_t candidate = table[hash];
+		table[hash] = (uint16_t)position;
+
+		if(candidate == no_position || read_u32(source + candidate) != sequence)
+		{
+			position ++;
+			continue;
+		}
+
+		size_t match_length = min_match;
+		while(position + match_length < length && source[candidate + match_length] == source[position + match_length])
+			match_length ++;
+
+		if(!write_sequence(target, capacity, out, source + anchor, position - anchor, position - candidate, match_length))
+			return 0;
+
+		position += match_length;
+		anchor = position;
+	}
+
+	if(!write_sequence(target, capacity, out, source + anchor, length - anchor, 0, 0))
+		return 0;
+
+	return out;
+}
+
+bool lz_decompress(const uint8_t *source, size_t length, uint8_t *target, size_t target_length)
+{
+	size_t in = 0;
+	size_t out = 0;
+
+	while(in < length)
+	{
+		const uint8_t token = source[in ++];
+
+		size_t literal_length = token >> 4;
+		if(literal_length == 15 && !read_length(source, length, in, literal_length))
+			return false;
+
+		if(in + literal_length > length || out + literal_length > target_length)
+			return false;
+
+		memcpy(target + out, source + in, literal_length);
+
+		in += literal_length;
+		out += literal_length;
+
+		// The last sequence has no match
+		if(in == length)
+			break;
+
+		if(in + 2 > length)
+			return false;
+
+		const size_t offset = source[in] | (source[in + 1] << 8);
+		in += 2;
+
+		size_t match_length = token & 0xf;
+		if(match_length == 15 && !read_length(source, length, in, match_length))
+			return false;
+
+		match_length += min_match;
+
+		if(offset == 0 || offset > out || out + match_length > target_length)
+			return false;
+
+		// Matches may overlap the bytes they produce, so this has to go byte by byte
+		for(size_t i = 0; i < match_length; ++ i, ++ out)
+			target[out] = target[out - offset];
+	}
+
+	return out == target_length;
+}
@@ -0,0 +1,16 @@
+#ifndef MACROPAD_LZ_H
+#define MACROPAD_LZ_H
+
+#include <cstdint>
+#include <cstddef>
+
+// LZ4 style block compression: sequences of a token, literals, a 16 bit match offset and the match length.
+// Meant for small independent blocks like disk sectors, each one decompresses on its own
+
+// Returns the compressed size, 0 if the result doesn't fit into the target
+size_t lz_compress(const uint8_t *source, size_t length, uint8_t *target, size_t capacity);
+
+// Returns false if the data is malformed or doesn't decompress to exactly target_length bytes
+bool lz_decompress(const uint8_t *source, size_t length, uint8_t *target, size_t target_length);
+
+#endif //MACROPAD_LZ_H
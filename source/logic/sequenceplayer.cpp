@@ -0,0 +1,154 @@
+#include <algorithm>
+#include <iterator>
+#include "sequenceplayer.h"
+
+static size_t get_op_length(const uint8_t *op)
+{
+	switch((sequenceop_t)op[0])
+	{
+		case sequenceop_t::press:
+		case sequenceop_t::release:
+		case sequenceop_t::tap:
+		case sequenceop_t::delay:
+			return 3;
+		case sequenceop_t::type:
+			return 3 + (op[1] | (op[2] << 8)) * 2;
+		default:
+			return 1;
+	}
+}
+
+void sequenceplayer_t::start(const uint8_t *sequence)
+{
+	stop();
+
+	size_t length = 0;
+	while((sequenceop_t)sequence[length] != sequenceop_t::end)
+		length += get_op_length(sequence + length);
+
+	m_sequence.assign(sequence, sequence + length + 1);
+	m_position = 0;
+	m_is_playing = true;
+}
+
+void sequenceplayer_t::stop()
+{
+	if(m_report.modifier || m_report.keycode[0])
+	{
+		m_report = {};
+		m_is_sent = false;
+	}
+
+	m_is_playing = false;
+	m_has_release = false;
+	m_typed_count = 0;
+	m_typed_keycode = 0;
+	m_typed_modifier = 0;
+	m_resume_us = 0;
+}
+
+void sequenceplayer_t::press(uint8_t keycode, uint8_t modifier)
+{
+	m_report.modifier |= modifier;
+
+	if(keycode == HID_KEY_NONE || std::find(std::begin(m_report.keycode), std::end(m_report.keycode), keycode) != std::end(m_report.keycode))
+		return;
+
+	// Keys beyond the sixth are dropped, same as on the matrix
+	uint8_t *slot = std::find(std::begin(m_report.keycode), std::end(m_report.keycode), HID_KEY_NONE);
+	if(slot != std::end(m_report.keycode))
+		*slot = keycode;
+}
+
+void sequenceplayer_t::release(uint8_t keycode, uint8_t modifier)
+{
+	m_report.modifier &= ~modifier;
+
+	if(keycode == HID_KEY_NONE)
+		return;
+
+	// Keep the remaining keys packed at the front
+	uint8_t *end = std::remove(std::begin(m_report.keycode), std::end(m_report.keycode), keycode);
+	std::fill(end, std::end(m_report.keycode), HID_KEY_NONE);
+}
+
+bool sequenceplayer_t::advance(uint64_t now_us)
+{
+	if(!m_is_sent)
+		return false;
+
+	if(m_has_release)
+	{
+		release(m_release_keycode, m_release_modifier);
+
+		m_has_release = false;
+		m_is_sent = false;
+
+		return true;
+	}
+
+	while(m_is_playing)
+	{
+		if(m_typed_count > 0)
+		{
+			// Each report replaces the previous character, the stream takes care of releases
+			release(m_typed_keycode, m_typed_modifier);
+
+			m_typed_modifier = m_typed_reports[0];
+			m_typed_keycode = m_typed_reports[1];
+
+			press(m_typed_keycode, m_typed_modifier);
+
+			m_typed_reports += 2;
+			m_typed_count --;
+
+			m_is_sent = false;
+			return true;
+		}
+
+		if(now_us < m_resume_us)
+			return false;
+
+		const uint8_t *op = m_sequence.data() + m_position;
+		m_position += get_op_length(op);
+
+		switch((sequenceop_t)op[0])
+		{
+			case sequenceop_t::press:
+				press(op[1], op[2]);
+				break;
+
+			case sequenceop_t::release:
+				release(op[1], op[2]);
+				break;
+
+			case sequenceop_t::tap:
+				press(op[1], op[2]);
+
+				m_has_release = true;
+				m_release_keycode = op[1];
+				m_release_modifier = op[2];
+				break;
+
+			case sequenceop_t::delay:
+				// Counts from when the previous report went out
+				m_resume_us = now_us + (op[1] | (op[2] << 8)) * 1000ull;
+				continue;
+
+			case sequenceop_t::type:
+				m_typed_reports = op + 3;
+				m_typed_count = op[1] | (op[2] << 8);
+				continue;
+
+			default:
+				// Whatever is still held gets released at the end
+				stop();
+				return !m_is_sent;
+		}
+
+		m_is_sent = false;
+		return true;
+	}
+
+	return false;
+}
@@ -0,0 +1,55 @@
+#ifndef MACROPAD_SEQUENCEPLAYER_H
+#define MACROPAD_SEQUENCEPLAYER_H
+
+#include <cstdint>
+#include <vector>
+#include <tusb.h>
+#include "keylayer.h"
+
+// Plays sequence bytecode one keyboard report at a time without ever blocking. Every change to the report has to
+// go out before the next one is made, so the pace is set by the host polling the endpoint
+class sequenceplayer_t
+{
+public:
+	sequenceplayer_t() = default;
+
+	// Takes a copy, the keymap the sequence came from may be unloaded while it plays. Restarts if already playing
+	void start(const uint8_t *sequence);
+	// Releases everything the sequence is holding
+	void stop();
+
+	bool is_playing() const { return m_is_playing; }
+
+	// Moves on to the next report once the current one has been sent. Returns false while waiting for a delay
+	// or for the current report to go out
+	bool advance(uint64_t now_us);
+	void mark_sent() { m_is_sent = true; }
+
+	const hid_keyboard_report_t &get_report() const { return m_report; }
+
+private:
+	void press(uint8_t keycode, uint8_t modifier);
+	void release(uint8_t keycode, uint8_t modifier);
+
+	std::vector<uint8_t> m_sequence;
+	size_t m_position = 0;
+	bool m_is_playing = false;
+
+	hid_keyboard_report_t m_report = {};
+	bool m_is_sent = true;
+
+	// Taps are sent as two reports, the release follows once the press went out
+	bool m_has_release = false;
+	uint8_t m_release_keycode = 0;
+	uint8_t m_release_modifier = 0;
+
+	// Typed text, the reports were worked out when the keymap was parsed
+	const uint8_t *m_typed_reports = nullptr; // Into m_sequence
+	size_t m_typed_count = 0;
+	uint8_t m_typed_keycode = 0;
+	uint8_t m_typed_modifier = 0;
+
+	uint64_t m_resume_us = 0;
+};
+
+#endif //MACROPAD_SEQUENCEPLAYER_H
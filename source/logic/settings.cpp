@@ -0,0 +1,246 @@
+#include <algorithm>
+#include <cstring>
+#include <hardware/flash.h>
+#include <pico/time.h>
+#include "flashio.h"
+#include "flashlog.h"
+#include "settings.h"
+
+#define SETTINGS_MAGIC 0x31564b53 // "SKV1"
+
+#define SETTINGS_TARGET_OFFSET (PICO_FLASH_SIZE_BYTES - (FLASH_SECTOR_SIZE * (FLASHLOG_BLOCK_COUNT + SETTINGS_SECTOR_COUNT)))
+
+static_assert(PICO_FLASH_SIZE_BYTES >= FLASH_SECTOR_SIZE * (FLASHLOG_BLOCK_COUNT + SETTINGS_SECTOR_COUNT));
+
+struct settings_header_t
+{
+	uint32_t magic;
+	uint32_t generation; // The valid sector with the highest generation is the current one
+	uint32_t generation_check; // Inverted generation, catches a header torn by a power loss
+	uint32_t reserved;
+};
+
+struct settings_entry_t
+{
+	uint32_t key;
+	uint32_t value;
+	uint32_t check;
+	uint32_t evictable; // Programmed to 0 for evictable values, left erased otherwise
+};
+
+static_assert(sizeof(settings_header_t) == 16);
+static_assert(sizeof(settings_entry_t) == 16);
+static_assert(FLASH_PAGE_SIZE % sizeof(settings_entry_t) == 0);
+
+constexpr size_t max_entries = (FLASH_SECTOR_SIZE - sizeof(settings_header_t)) / sizeof(settings_entry_t);
+constexpr uint32_t no_key = 0xffffffff;
+constexpr size_t no_sector = SETTINGS_SECTOR_COUNT;
+
+static_assert(SETTINGS_MAX_ENTRIES <= max_entries);
+
+struct settings_value_t
+{
+	uint32_t key;
+	uint32_t value;
+	bool is_evictable;
+	bool is_dirty; // Not written to flash yet
+};
+
+static settings_value_t s_values[SETTINGS_MAX_ENTRIES];
+static size_t s_value_count = 0;
+static bool s_is_dirty = false;
+static uint32_t s_last_set_ms = 0;
+
+static size_t s_sector = no_sector;
+static uint32_t s_generation = 0;
+static size_t s_next_entry = 0;
+
+static uint32_t sector_offset(size_t sector)
+{
+	return SETTINGS_TARGET_OFFSET + sector * FLASH_SECTOR_SIZE;
+}
+static const settings_header_t *get_header(size_t sector)
+{
+	return (const settings_header_t *)(XIP_BASE + sector_offset(sector));
+}
+static const settings_entry_t *get_entry(size_t sector, size_t entry)
+{
+	return (const settings_entry_t *)(get_header(sector) + 1) + entry;
+}
+
+static uint32_t calculate_check(uint32_t key, uint32_t value)
+{
+	return ~((key * 2654435761u) ^ value);
+}
+
+static bool is_entry_erased(const settings_entry_t *entry)
+{
+	const uint8_t *data = (const uint8_t *)entry;
+	return std::all_of(data, data + sizeof(settings_entry_t), [](uint8_t value) { return value == 0xff; });
+}
+
+static settings_value_t *find_value(uint32_t key)
+{
+	for(size_t i = 0; i < s_value_count; ++ i)
+	{
+		if(s_values[i].key == key)
+			return &s_values[i];
+	}
+
+	return nullptr;
+}
+// Values are kept least recently written first, a rewritten one moves to the end. Compaction keeps that order and
+// replaying the journal restores it, so the first evictable value is the one to go
+static bool store_value(uint32_t key, uint32_t value, bool is_evictable, bool is_dirty)
+{
+	settings_value_t *existing = find_value(key);
+	if(existing)
+	{
+		std::rotate(existing, existing + 1, s_values + s_value_count);
+		s_values[s_value_count - 1] = { key, value, is_evictable, is_dirty };
+		return true;
+	}
+
+	if(s_value_count == SETTINGS_MAX_ENTRIES)
+	{
+		settings_value_t *evicted = std::find_if(s_values, s_values + s_value_count, [](const settings_value_t &value) { return value.is_evictable; });
+		if(evicted == s_values + s_value_count)
+			return false;
+
+		std::move(evicted + 1, s_values + s_value_count, evicted);
+		s_value_count --;
+	}
+
+	s_values[s_value_count ++] = { key, value, is_evictable, is_dirty };
+	return true;
+}
+
+static void write_entry(size_t sector, size_t index, const settings_value_t &value)
+{
+	settings_entry_t entry;
+	memset(&entry, 0xff, sizeof(entry));
+	entry.key = value.key;
+	entry.value = value.value;
+	entry.check = calculate_check(value.key, value.value);
+
+	if(value.is_evictable)
+		entry.evictable = 0;
+
+	flashio_program(sector_offset(sector) + sizeof(settings_header_t) + index * sizeof(settings_entry_t), &entry, sizeof(entry));
+}
+
+// Rewrites the current values into the other sector. The header goes in last, so losing power halfway through
+// leaves the previous sector in charge
+static void compact()
+{
+	const size_t target = (s_sector == no_sector) ? 0 : (s_sector + 1) % SETTINGS_SECTOR_COUNT;
+
+	flashio_erase(sector_offset(target), FLASH_SECTOR_SIZE);
+
+	for(size_t i = 0; i < s_value_count; ++ i)
+	{
+		write_entry(target, i, s_values[i]);
+		s_values[i].is_dirty = false;
+	}
+
+	settings_header_t header;
+	memset(&header, 0xff, sizeof(header));
+	header.magic = SETTINGS_MAGIC;
+	header.generation = s_generation + 1;
+	header.generation_check = ~header.generation;
+
+	flashio_program(sector_offset(target), &header, sizeof(header));
+
+	s_sector = target;
+	s_generation = header.generation;
+	s_next_entry = s_value_count;
+}
+
+void settings_init()
+{
+	s_value_count = 0;
+	s_is_dirty = false;
+	s_sector = no_sector;
+	s_generation = 0;
+	s_next_entry = 0;
+
+	for(size_t i = 0; i < SETTINGS_SECTOR_COUNT; ++ i)
+	{
+		const settings_header_t *header = get_header(i);
+
+		if(header->magic != SETTINGS_MAGIC || header->generation_check != ~header->generation)
+			continue;
+
+		if(s_sector == no_sector || header->generation > s_generation)
+		{
+			s_sector = i;
+			s_generation = header->generation;
+		}
+	}
+
+	if(s_sector == no_sector)
+		return;
+
+	// Later entries win. One torn by a power loss fails its check and is skipped, appending continues after it
+	for(size_t i = 0; i < max_entries; ++ i)
+	{
+		const settings_entry_t *entry = get_entry(s_sector, i);
+		if(is_entry_erased(entry))
+			break;
+
+		s_next_entry = i + 1;
+
+		if(entry->key != no_key && entry->check == calculate_check(entry->key, entry->value))
+			store_value(entry->key, entry->value, entry->evictable == 0, false);
+	}
+}
+
+bool settings_get(uint32_t key, uint32_t *value)
+{
+	const settings_value_t *existing = find_value(key);
+	if(!existing)
+		return false;
+
+	*value = existing->value;
+	return true;
+}
+void settings_set(uint32_t key, uint32_t value, bool is_evictable)
+{
+	if(key == no_key)
+		return;
+
+	const settings_value_t *existing = find_value(key);
+	if(existing && existing->value == value)
+		return;
+
+	if(!store_value(key, value, is_evictable, true))
+		return;
+
+	s_is_dirty = true;
+	s_last_set_ms = to_ms_since_boot(get_absolute_time());
+}
+
+// Values that change back and forth, like brightness steps or flicking through pages, only get written once they
+// settled
+void settings_task()
+{
+	if(!s_is_dirty || to_ms_since_boot(get_absolute_time()) - s_last_set_ms < SETTINGS_IDLE_WRITE_MS)
+		return;
+
+	s_is_dirty = false;
+
+	for(size_t i = 0; i < s_value_count; ++ i)
+	{
+		if(!s_values[i].is_dirty)
+			continue;
+
+		if(s_sector == no_sector || s_next_entry == max_entries)
+		{
+			compact();
+			return;
+		}
+
+		write_entry(s_sector, s_next_entry ++, s_values[i]);
+		s_values[i].is_dirty = false;
+	}
+}
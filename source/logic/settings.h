@@ -0,0 +1,23 @@
+#ifndef MACROPAD_SETTINGS_H
+#define MACROPAD_SETTINGS_H
+
+#include <cstdint>
+
+// Small append only key-value journal for runtime settings, kept in two flash sectors of its own right below the
+// sector log. Changes are collected in RAM and written by settings_task() once they stop coming in, each value that
+// changed costs one page program. The journal only gets compacted into the other sector once the current one is
+// full. Keys are arbitrary except for 0xffffffff
+#define SETTINGS_SECTOR_COUNT 2
+#define SETTINGS_MAX_ENTRIES  64 // Values kept around, the least recently written evictable one gets dropped beyond that
+#define SETTINGS_IDLE_WRITE_MS 2000 // Changed values get written once nothing changed for this long
+
+void settings_init();
+
+// Returns false if the key was never set
+bool settings_get(uint32_t key, uint32_t *value);
+// Evictable values make room for newer ones, the others are never dropped. A new value is turned away if
+// SETTINGS_MAX_ENTRIES are in use and none of them can be evicted
+void settings_set(uint32_t key, uint32_t value, bool is_evictable = false);
+void settings_task();
+
+#endif //MACROPAD_SETTINGS_H
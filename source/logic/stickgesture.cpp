@@ -0,0 +1,80 @@
+#include <algorithm>
+#include <cstdlib>
+#include "stickgesture.h"
+
+// Diagonal once the smaller axis is at least 2/5 of the larger one, roughly 22 degrees off either axis
+static gesture_t classify(int16_t x, int16_t y)
+{
+	const int32_t ax = abs(x);
+	const int32_t ay = abs(y);
+
+	if(std::min(ax, ay) * 5 >= std::max(ax, ay) * 2)
+	{
+		if(y < 0)
+			return (x < 0) ? gesture_t::up_left : gesture_t::up_right;
+
+		return (x < 0) ? gesture_t::down_left : gesture_t::down_right;
+	}
+
+	if(ax > ay)
+		return (x < 0) ? gesture_t::left : gesture_t::right;
+
+	return (y < 0) ? gesture_t::up : gesture_t::down;
+}
+
+bool stickgesture_t::update(int16_t x, int16_t y, uint64_t now_us, stickgesture_event_t *event)
+{
+	const int32_t magnitude = std::max(abs(x), abs(y));
+
+	switch(m_state)
+	{
+		case state_t::idle:
+		{
+			if(magnitude < STICKGESTURE_ENTER_THRESHOLD)
+				return false;
+
+			m_state = state_t::held;
+			m_gesture = classify(x, y);
+
+			m_next_repeat_us = now_us + STICKGESTURE_REPEAT_DELAY_MS * 1000;
+			m_interval_us = STICKGESTURE_REPEAT_INTERVAL_MS * 1000;
+
+			*event = { m_gesture, false };
+			return true;
+		}
+
+		case state_t::held:
+		{
+			if(magnitude < STICKGESTURE_LEAVE_THRESHOLD)
+			{
+				m_state = state_t::idle;
+
+				*event = { gesture_t::centre, false };
+				return true;
+			}
+
+			if(now_us < m_next_repeat_us)
+				return false;
+
+			// After a stall, eg. a flash commit, carry on from now instead of firing all the missed repeats
+			m_next_repeat_us += m_interval_us;
+			if(m_next_repeat_us <= now_us)
+				m_next_repeat_us = now_us + m_interval_us;
+
+			m_interval_us = std::max<uint32_t>(m_interval_us - m_interval_us / 8, STICKGESTURE_REPEAT_MINIMUM_MS * 1000);
+
+			*event = { m_gesture, true };
+			return true;
+		}
+
+		case state_t::suppressed:
+		{
+			if(magnitude < STICKGESTURE_LEAVE_THRESHOLD)
+				m_state = state_t::idle;
+
+			return false;
+		}
+	}
+
+	return false;
+}
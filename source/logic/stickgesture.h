@@ -0,0 +1,50 @@
+#ifndef MACROPAD_STICKGESTURE_H
+#define MACROPAD_STICKGESTURE_H
+
+#include <cstdint>
+#include "keylayer.h"
+
+// Deflections in analogstick_t positions, -2048 to 2047
+#define STICKGESTURE_ENTER_THRESHOLD    1300 // Deflection that fires a gesture
+#define STICKGESTURE_LEAVE_THRESHOLD    900  // Deflection the stick has to drop below before the next one
+#define STICKGESTURE_REPEAT_DELAY_MS    400 // Hold this long before the gesture starts repeating
+#define STICKGESTURE_REPEAT_INTERVAL_MS 150 // First repeat interval, every repeat shortens it by an eighth
+#define STICKGESTURE_REPEAT_MINIMUM_MS  30
+
+struct stickgesture_event_t
+{
+	gesture_t gesture;
+	bool is_repeat;
+};
+
+// Recognises gestures from the filtered stick position. Pushing the stick out fires the gesture right away, its
+// direction taken from where the stick crossed the threshold, so diagonals don't need both axes to line up.
+// Holding it there repeats the gesture faster and faster until the stick returns to the centre
+class stickgesture_t
+{
+public:
+	stickgesture_t() = default;
+
+	// Returns true if a gesture fired. Repeats are scheduled on absolute deadlines, so their rate doesn't depend
+	// on how often this gets called
+	bool update(int16_t x, int16_t y, uint64_t now_us, stickgesture_event_t *event);
+
+	// Ignores the stick until it's back at rest, eg. while it drives the mouse
+	void suppress() { m_state = state_t::suppressed; }
+
+private:
+	enum class state_t : uint8_t
+	{
+		idle,
+		held,
+		suppressed
+	};
+
+	state_t m_state = state_t::idle;
+	gesture_t m_gesture = gesture_t::centre;
+
+	uint64_t m_next_repeat_us = 0;
+	uint32_t m_interval_us = 0;
+};
+
+#endif //MACROPAD_STICKGESTURE_H
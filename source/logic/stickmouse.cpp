@@ -0,0 +1,87 @@
+#include <algorithm>
+#include <cstdlib>
+#include "../devices/analogstick.h"
+#include "stickmouse.h"
+
+constexpr int32_t full_scale = 2048;
+constexpr int32_t max_report = 127;
+
+// Deflection past the deadzone mapped onto 0 - 2048, then eased in quadratically: (d + d^2) / 2 on a 0 - 1 scale
+static int32_t apply_curve(int16_t position)
+{
+	const int32_t magnitude = std::clamp<int32_t>(abs(position) - ANALOGSTICK_DEADZONE, 0, full_scale - ANALOGSTICK_DEADZONE);
+	const int32_t deflection = (magnitude * full_scale) / (full_scale - ANALOGSTICK_DEADZONE);
+
+	const int32_t curve = (deflection + (deflection * deflection) / full_scale) / 2;
+	return (position < 0) ? -curve : curve;
+}
+
+static int8_t take_counts(int32_t &remainder)
+{
+	const int32_t counts = std::clamp<int32_t>(remainder / 65536, -max_report, max_report);
+	remainder -= counts * 65536;
+
+	// Whatever the host couldn't take in time is dropped rather than piling up
+	remainder = std::clamp<int32_t>(remainder, -65535, 65535);
+	return (int8_t)counts;
+}
+
+void stickmouse_t::advance(const stickconfig_t &config, int16_t x, int16_t y, uint64_t now_us)
+{
+	const uint64_t elapsed = m_last_update_us ? std::min<uint64_t>(now_us - m_last_update_us, STICKMOUSE_MAX_STEP_US) : 0;
+	m_last_update_us = now_us;
+
+	m_is_active = (config.mode != stickconfig_t::mode_t::layers) && (x != 0 || y != 0);
+
+	if(!m_is_active)
+	{
+		m_buttons = 0;
+		m_remainder[0] = m_remainder[1] = 0;
+
+		return;
+	}
+
+	m_is_scroll = (config.mode == stickconfig_t::mode_t::scroll);
+	m_buttons = config.buttons;
+
+	// Only picked up while no buttons are down, so a held drag never sees its modifier change under it
+	if(!m_reported_buttons)
+		m_modifier = config.modifier;
+
+	const int64_t max_speed = m_is_scroll ? STICKMOUSE_MAX_SCROLL : STICKMOUSE_MAX_SPEED;
+	const int16_t position[2] = { x, y };
+
+	for(size_t i = 0; i < 2; ++ i)
+	{
+		// Counts per second with 16 fractional bits, then scaled down to the time since the last update
+		const int64_t rate = (apply_curve(position[i]) * max_speed * config.speed * 65536) / (full_scale * 100);
+		m_remainder[i] += (int32_t)((rate * (int64_t)elapsed) / 1000000);
+	}
+}
+
+bool stickmouse_t::take_report(stickmouse_report_t *report)
+{
+	const int8_t x = take_counts(m_remainder[0]);
+	const int8_t y = take_counts(m_remainder[1]);
+
+	*report = {};
+	report->buttons = m_buttons;
+
+	if(m_is_scroll)
+	{
+		// Pushing the stick up scrolls up
+		report->wheel = (int8_t)-y;
+		report->pan = x;
+	}
+	else
+	{
+		report->x = x;
+		report->y = y;
+	}
+
+	if(x == 0 && y == 0 && m_buttons == m_reported_buttons)
+		return false;
+
+	m_reported_buttons = m_buttons;
+	return true;
+}
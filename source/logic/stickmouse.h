@@ -0,0 +1,51 @@
+#ifndef MACROPAD_STICKMOUSE_H
+#define MACROPAD_STICKMOUSE_H
+
+#include <cstdint>
+#include "keylayer.h"
+
+#define STICKMOUSE_MAX_SPEED   1500  // Pointer counts per second at full deflection and 100% speed
+#define STICKMOUSE_MAX_SCROLL  40    // Wheel detents per second at full deflection and 100% speed
+#define STICKMOUSE_MAX_STEP_US 50000 // Longer gaps between updates don't add up to a jump
+
+struct stickmouse_report_t
+{
+	uint8_t buttons;
+	int8_t x;
+	int8_t y;
+	int8_t wheel;
+	int8_t pan;
+};
+
+// Turns stick positions into relative mouse motion. Speed follows an integer acceleration curve, fine at the
+// edge of the deadzone and fast at full deflection. Fractions of a count are carried over to the next report, so
+// slow movements still get through
+class stickmouse_t
+{
+public:
+	stickmouse_t() = default;
+
+	// Positions as reported by the analog stick, 0 inside the deadzone
+	void advance(const stickconfig_t &config, int16_t x, int16_t y, uint64_t now_us);
+
+	// Returns false if there is neither motion nor a button change to report
+	bool take_report(stickmouse_report_t *report);
+
+	bool is_active() const { return m_is_active; }
+
+	// Held from the first motion until the buttons have been reported released
+	uint8_t get_modifier() const { return (m_is_active || m_reported_buttons) ? m_modifier : 0; }
+
+private:
+	bool m_is_active = false;
+	bool m_is_scroll = false;
+
+	uint8_t m_buttons = 0;
+	uint8_t m_reported_buttons = 0;
+	uint8_t m_modifier = 0;
+
+	int32_t m_remainder[2] = {}; // 16 fractional bits
+	uint64_t m_last_update_us = 0;
+};
+
+#endif //MACROPAD_STICKMOUSE_H
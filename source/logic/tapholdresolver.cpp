@@ -0,0 +1,126 @@
+#include <algorithm>
+#include <iterator>
+#include "tapholdresolver.h"
+
+void tapholdresolver_t::push(const keyevent_t &event, const taphold_t *tap_hold)
+{
+	// A full queue decides the undecided key as held, so there is always room
+	if(m_input_count >= TAPHOLD_QUEUE_SIZE)
+		return;
+
+	input_t &input = m_input[m_input_count ++];
+	input.event = event;
+	input.is_tap_hold = event.is_press && tap_hold;
+	input.tap_hold = tap_hold ? *tap_hold : taphold_t{};
+
+	process(event.time_us);
+}
+
+void tapholdresolver_t::update(uint64_t now_us)
+{
+	process(now_us);
+}
+
+void tapholdresolver_t::reset()
+{
+	m_input_count = 0;
+	m_output.clear();
+	m_is_undecided = false;
+
+	std::fill(std::begin(m_roles), std::end(m_roles), keyrole_t::normal);
+}
+
+bool tapholdresolver_t::decide(uint64_t now_us, keyrole_t *role) const
+{
+	const taphold_t &tap_hold = m_undecided.tap_hold;
+	const uint8_t key = m_undecided.event.key;
+	const uint64_t deadline = m_undecided.event.time_us + tap_hold.term_ms * 1000ull;
+
+	uint32_t pressed = 0; // Other keys that went down after it
+
+	for(size_t i = 0; i < m_input_count; ++ i)
+	{
+		const keyevent_t &event = m_input[i].event;
+
+		if(event.time_us >= deadline)
+		{
+			*role = keyrole_t::hold;
+			return true;
+		}
+
+		if(event.key == key)
+		{
+			// Released within the term
+			*role = keyrole_t::tap;
+			return true;
+		}
+
+		if(event.is_press)
+		{
+			if(tap_hold.flags & taphold_t::hold_on_other_key)
+			{
+				*role = keyrole_t::hold;
+				return true;
+			}
+
+			pressed |= 1u << event.key;
+		}
+		else if((pressed & (1u << event.key)) && (tap_hold.flags & taphold_t::permissive_hold))
+		{
+			*role = keyrole_t::hold;
+			return true;
+		}
+	}
+
+	if(now_us >= deadline || m_input_count >= TAPHOLD_QUEUE_SIZE)
+	{
+		*role = keyrole_t::hold;
+		return true;
+	}
+
+	return false;
+}
+
+void tapholdresolver_t::process(uint64_t now_us)
+{
+	while(true)
+	{
+		if(m_is_undecided)
+		{
+			keyrole_t role;
+			if(!decide(now_us, &role))
+				return;
+
+			m_is_undecided = false;
+			m_roles[m_undecided.event.key] = role;
+
+			keyevent_t event = m_undecided.event;
+			event.role = role;
+			m_output.push(event);
+		}
+
+		if(m_input_count == 0)
+			return;
+
+		const input_t input = m_input[0];
+
+		std::copy(m_input + 1, m_input + m_input_count, m_input);
+		m_input_count --;
+
+		if(input.is_tap_hold)
+		{
+			m_is_undecided = true;
+			m_undecided = input;
+
+			continue;
+		}
+
+		keyevent_t event = input.event;
+
+		if(event.is_press)
+			m_roles[event.key] = keyrole_t::normal;
+
+		event.role = m_roles[event.key];
+		m_output.push(event);
+	}
+}
@@ -0,0 +1,50 @@
+#ifndef MACROPAD_TAPHOLDRESOLVER_H
+#define MACROPAD_TAPHOLDRESOLVER_H
+
+#include <cstdint>
+#include "keylayer.h"
+#include "keyevent.h"
+
+#define TAPHOLD_QUEUE_SIZE 16 // Key events held back while a tap-hold key is undecided
+
+// Decides whether tap-hold keys are tapped or held, purely from the timestamps of key events. Once a tap-hold key
+// goes down, every event after it is held back until it's decided, so they come out in the right order relative
+// to it. That delay is bounded by the tapping term. Events come out in the order they went in
+class tapholdresolver_t
+{
+public:
+	tapholdresolver_t() = default;
+
+	// Presses of tap-hold keys come with their settings, which are copied. nullptr for everything else
+	void push(const keyevent_t &event, const taphold_t *tap_hold);
+	// Lets the tapping term run out on an undecided key
+	void update(uint64_t now_us);
+
+	bool pop(keyevent_t *event) { return m_output.pop(event); }
+	bool is_idle() const { return !m_is_undecided && m_input_count == 0 && m_output.is_empty(); }
+
+	void reset();
+
+private:
+	struct input_t
+	{
+		keyevent_t event;
+		taphold_t tap_hold;
+		bool is_tap_hold;
+	};
+
+	void process(uint64_t now_us);
+	bool decide(uint64_t now_us, keyrole_t *role) const;
+
+	input_t m_input[TAPHOLD_QUEUE_SIZE] = {};
+	size_t m_input_count = 0;
+
+	keyeventqueue_t m_output;
+
+	bool m_is_undecided = false;
+	input_t m_undecided = {};
+
+	keyrole_t m_roles[num_key_slots] = {};
+};
+
+#endif //MACROPAD_TAPHOLDRESOLVER_H
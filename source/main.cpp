@@ -7,6 +7,7 @@
 #include "usb/usb_descriptor.h"
 #include "logic/application.h"
 #include "logic/flashfs.h"
+#include "logic/settings.h"
 
 static application app;
 
@@ -15,6 +16,7 @@ static application app;
 	board_init();
 
 	flashfs_init();
+	settings_init();
 
 	tud_init(BOARD_DEVICE_RHPORT_NUM);
 	board_init_after_tusb();
@@ -24,7 +26,12 @@ static application app;
 	while(true)
 	{
 		app.update();
-		sleep_ms(5);
+		flashfs_task();
+		settings_task();
+
+		// Keep commit steps coming back to back, USB still gets serviced in between
+		if(!flashfs_is_committing())
+			sleep_ms(app.wants_fast_updates() ? 1 : 5);
 	}
 }
 
@@ -46,8 +53,34 @@ void tud_resume_cb()
 	app.usb_state_changed();
 }
 
+void tud_hid_report_complete_cb(uint8_t instance, uint8_t const *report, uint16_t len)
+{
+	if(instance == HID_INSTANCE_KEYBOARD)
+		app.hid_report_sent();
+}
+
 void usb_ejected()
 {
 	flashfs_flush();
 	app.usb_ejected();
 }
+rawhid_status_t usb_keymap_received(const char *data, size_t length, bool persist)
+{
+	return app.push_keymap(data, length, persist);
+}
+rawhid_status_t usb_keymap_select(uint16_t index)
+{
+	return app.select_keymap(index);
+}
+rawhid_status_t usb_keymap_select_name(uint32_t name_hash)
+{
+	return app.select_keymap_by_name(name_hash);
+}
+rawhid_status_t usb_layer_select(uint8_t layer)
+{
+	return app.select_layer(layer);
+}
+void usb_get_state(rawhid_state_t *state)
+{
+	app.get_state(state);
+}
@@ -45,16 +45,16 @@
 #endif
 
 //------------- CLASS -------------//
-#define CFG_TUD_HID               1
+#define CFG_TUD_HID               2 // Keyboard and the raw configuration channel
 #define CFG_TUD_CDC               0
 #define CFG_TUD_MSC               1
 #define CFG_TUD_MIDI              0
 #define CFG_TUD_VENDOR            0
 
 // MSC Buffer size of Device Mass storage
-#define CFG_TUD_MSC_EP_BUFSIZE    512
+#define CFG_TUD_MSC_EP_BUFSIZE    4096 // Eight sectors per read/write callback
 
 // HID buffer size Should be sufficient to hold ID (if any) + Data
-#define CFG_TUD_HID_EP_BUFSIZE    16
+#define CFG_TUD_HID_EP_BUFSIZE    64 // Raw HID reports, the keyboard endpoint stays at 16
 
 #endif /* _TUSB_CONFIG_H_ */
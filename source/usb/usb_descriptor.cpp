@@ -6,21 +6,7 @@
 #include <bsp/board_api.h>
 #include "usb_descriptor.h"
 
-extern size_t usb_get_hid_report_desc_len();
-
-static uint8_t s_usb_feature_flags = USB_FEATURE_HID;
-
-void usb_set_enabled_features(uint8_t flags)
-{
-	if(s_usb_feature_flags == flags)
-		return;
-
-	s_usb_feature_flags = flags;
-
-	tud_disconnect();
-	sleep_ms(100);
-	tud_connect();
-}
+extern size_t usb_get_hid_report_desc_len(uint8_t instance);
 
 //--------------------------------------------------------------------+
 // Device Descriptor
@@ -64,51 +50,34 @@ const uint8_t *tud_descriptor_device_cb()
 
 #define EPNUM_HID   0x82
 
+#define EPNUM_RAW_HID_OUT 0x03
+#define EPNUM_RAW_HID_IN  0x83
+
 #define EPNUM_MSC_OUT     0x01
 #define EPNUM_MSC_IN      0x81
 
-#define CONFIG_MAX_LEN (TUD_CONFIG_DESC_LEN + TUD_HID_DESC_LEN + TUD_MSC_DESC_LEN)
-uint8_t desc_configuration[CONFIG_MAX_LEN];
+#define CONFIG_TOTAL_LEN (TUD_CONFIG_DESC_LEN + TUD_HID_DESC_LEN + TUD_MSC_DESC_LEN + TUD_HID_INOUT_DESC_LEN)
+uint8_t desc_configuration[CONFIG_TOTAL_LEN];
 
 const uint8_t *tud_descriptor_configuration_cb(uint8_t index)
 {
-	size_t offset = TUD_CONFIG_DESC_LEN;
-	uint8_t interface = 0;
+	// The report descriptor length is only known at runtime
+	const uint8_t config[] = {
+		TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, CONFIG_TOTAL_LEN, TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP, 100),
 
-	if(s_usb_feature_flags & USB_FEATURE_HID)
-	{
-		uint8_t hid_config[] = {
-			// Interface number, string index, protocol, report descriptor len, EP In address, size & polling interval
-			TUD_HID_DESCRIPTOR(interface ++, 0, HID_ITF_PROTOCOL_NONE, usb_get_hid_report_desc_len(), EPNUM_HID, CFG_TUD_HID_EP_BUFSIZE, 5),
-		};
+		// Interface number, string index, protocol, report descriptor len, EP In address, size & polling interval
+		TUD_HID_DESCRIPTOR(ITF_NUM_HID, 0, HID_ITF_PROTOCOL_NONE, usb_get_hid_report_desc_len(HID_INSTANCE_KEYBOARD), EPNUM_HID, 16, 1),
 
-		static_assert(TUD_HID_DESC_LEN == sizeof(hid_config));
+		// Interface number, string index, EP Out & EP In address, EP size
+		TUD_MSC_DESCRIPTOR(ITF_NUM_MSC, 0, EPNUM_MSC_OUT, EPNUM_MSC_IN, 64),
 
-		memcpy(desc_configuration + offset, hid_config, sizeof(hid_config));
-		offset += sizeof(hid_config);
-	}
+		// Interface number, string index, protocol, report descriptor len, EP Out & In address, size & polling interval
+		TUD_HID_INOUT_DESCRIPTOR(ITF_NUM_RAW_HID, 0, HID_ITF_PROTOCOL_NONE, usb_get_hid_report_desc_len(HID_INSTANCE_RAW), EPNUM_RAW_HID_OUT, EPNUM_RAW_HID_IN, CFG_TUD_HID_EP_BUFSIZE, 1),
+	};
 
-	if(s_usb_feature_flags & USB_FEATURE_MSC)
-	{
-		uint8_t msc_config[] = {
-			// Interface number, string index, EP Out & EP In address, EP size
-			TUD_MSC_DESCRIPTOR(interface ++, 0, EPNUM_MSC_OUT, EPNUM_MSC_IN, 64),
-		};
-
-		static_assert(TUD_MSC_DESC_LEN == sizeof(msc_config));
-
-		memcpy(desc_configuration + offset, msc_config, sizeof(msc_config));
-		offset += sizeof(msc_config);
-	}
-
-	{
-		uint8_t config[] = {
-			TUD_CONFIG_DESCRIPTOR(1, interface, 0, offset, TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP, 100),
-		};
-
-		memcpy(desc_configuration, config, sizeof(config));
-	}
+	static_assert(CONFIG_TOTAL_LEN == sizeof(config));
 
+	memcpy(desc_configuration, config, sizeof(config));
 	return desc_configuration;
 }
 
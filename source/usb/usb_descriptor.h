@@ -10,6 +10,7 @@
 enum
 {
 	REPORT_ID_KEYBOARD = 1,
+	REPORT_ID_MOUSE,
 	REPORT_ID_COUNT
 };
 
@@ -21,9 +22,22 @@ enum
 	STR_ID_SERIAL,
 };
 
-#define USB_FEATURE_HID (1 << 0)
-#define USB_FEATURE_MSC (1 << 1)
+enum
+{
+	ITF_NUM_HID = 0,
+	ITF_NUM_MSC,
+	ITF_NUM_RAW_HID,
+	ITF_NUM_TOTAL
+};
+
+enum
+{
+	HID_INSTANCE_KEYBOARD = 0,
+	HID_INSTANCE_RAW
+};
 
-void usb_set_enabled_features(uint8_t flags);
+// HID and MSC are always exposed together. Without a medium the MSC LUN reports "medium not present", so the host
+// keeps the volume unmounted and the keyboard never has to re-enumerate
+void usb_set_medium_present(bool present);
 
 #endif
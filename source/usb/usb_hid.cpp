@@ -3,20 +3,27 @@
 //
 
 #include "usb_descriptor.h"
+#include "usb_rawhid.h"
 
 static uint8_t desc_hid_report[] =
 {
 	TUD_HID_REPORT_DESC_KEYBOARD(HID_REPORT_ID(REPORT_ID_KEYBOARD)),
+	TUD_HID_REPORT_DESC_MOUSE(HID_REPORT_ID(REPORT_ID_MOUSE)),
 };
 
-size_t usb_get_hid_report_desc_len()
+static uint8_t desc_raw_hid_report[] =
 {
-	return sizeof(desc_hid_report);
+	TUD_HID_REPORT_DESC_GENERIC_INOUT(RAWHID_REPORT_SIZE),
+};
+
+size_t usb_get_hid_report_desc_len(uint8_t instance)
+{
+	return (instance == HID_INSTANCE_RAW) ? sizeof(desc_raw_hid_report) : sizeof(desc_hid_report);
 }
 
 const uint8_t *tud_hid_descriptor_report_cb(uint8_t instance)
 {
-	return desc_hid_report;
+	return (instance == HID_INSTANCE_RAW) ? desc_raw_hid_report : desc_hid_report;
 }
 
 uint16_t tud_hid_get_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t *buffer, uint16_t reqlen)
@@ -25,4 +32,7 @@ uint16_t tud_hid_get_report_cb(uint8_t instance, uint8_t report_id, hid_report_t
 }
 
 void tud_hid_set_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t const *buffer, uint16_t bufsize)
-{}
+{
+	if(instance == HID_INSTANCE_RAW)
+		usb_rawhid_receive(buffer, bufsize);
+}
@@ -2,11 +2,28 @@
 // Created by Sidney on 22/08/2025.
 //
 
+#include <algorithm>
 #include "usb_descriptor.h"
 #include "../logic/flashfs.h"
 
+// Not part of TinyUSB's SCSI command list
+#define SCSI_CMD_SYNCHRONIZE_CACHE_10 0x35
+#define SCSI_CMD_MODE_SENSE_10        0x5A
+
 extern void usb_ejected();
 
+static bool s_is_medium_present = false;
+static bool s_is_medium_changed = false; // Reported once as a unit attention, so the host drops its cached view
+
+void usb_set_medium_present(bool present)
+{
+	if(s_is_medium_present == present)
+		return;
+
+	s_is_medium_present = present;
+	s_is_medium_changed = present;
+}
+
 void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16], uint8_t product_rev[4])
 {
 	const char vid[] = "TinyUSB";
@@ -20,27 +37,55 @@ void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16
 
 bool tud_msc_test_unit_ready_cb(uint8_t lun)
 {
+	if(!s_is_medium_present)
+	{
+		tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x3a, 0x00);
+		return false;
+	}
+
+	if(s_is_medium_changed)
+	{
+		s_is_medium_changed = false;
+
+		tud_msc_set_sense(lun, SCSI_SENSE_UNIT_ATTENTION, 0x28, 0x00);
+		return false;
+	}
+
 	return true;
 }
 
+// TinyUSB answers a capacity of zero with "medium not present"
 void tud_msc_capacity_cb(uint8_t lun, uint32_t *block_count, uint16_t *block_size)
 {
-	*block_count = DISK_SECTOR_COUNT;
+	*block_count = s_is_medium_present ? DISK_SECTOR_COUNT : 0;
 	*block_size = DISK_SECTOR_SIZE;
 }
 
 
 bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject)
 {
-	if(load_eject && !start)
+	if(load_eject && !start && s_is_medium_present)
 		usb_ejected();
 
 	return true;
 }
 
+// TinyUSB splits transfers into chunks of up to CFG_TUD_MSC_EP_BUFSIZE, the offset is relative to the start lba
+static bool msc_is_in_range(uint8_t lun, uint32_t lba, uint32_t offset, uint32_t bufsize)
+{
+	if(!s_is_medium_present)
+	{
+		tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x3a, 0x00);
+		return false;
+	}
+
+	const uint64_t start = (uint64_t)lba * DISK_SECTOR_SIZE + offset;
+	return start + bufsize <= (uint64_t)DISK_SECTOR_COUNT * DISK_SECTOR_SIZE;
+}
+
 int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void *buffer, uint32_t bufsize)
 {
-	if(lba >= DISK_SECTOR_COUNT || offset != 0 || bufsize != DISK_SECTOR_SIZE)
+	if(!msc_is_in_range(lun, lba, offset, bufsize))
 		return - 1;
 
 	flashfs_read(buffer, lba, offset, bufsize);
@@ -54,15 +99,51 @@ bool tud_msc_is_writable_cb(uint8_t lun)
 
 int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t *buffer, uint32_t bufsize)
 {
-	if(lba >= DISK_SECTOR_COUNT || offset != 0 || bufsize != DISK_SECTOR_SIZE)
+	if(!msc_is_in_range(lun, lba, offset, bufsize))
 		return - 1;
 
 	flashfs_write(buffer, lba, offset, bufsize);
 	return (int32_t) bufsize;
 }
 
+static int32_t msc_respond(void *buffer, uint16_t bufsize, uint16_t allocation_length, const uint8_t *data, uint16_t length)
+{
+	length = std::min({ length, bufsize, allocation_length });
+	memcpy(buffer, data, length);
+
+	return length;
+}
+
 int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void *buffer, uint16_t bufsize)
 {
-	tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00);
-	return -1;
+	switch(scsi_cmd[0])
+	{
+		// Hosts allow removal again once they're done with the volume, which is as good a point to commit as any
+		case SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL:
+			if((scsi_cmd[4] & 0x03) == 0)
+				flashfs_sync();
+
+			return 0;
+
+		// Completes right away, the commit runs from the main loop and never loses a sector the host handed over
+		case SCSI_CMD_SYNCHRONIZE_CACHE_10:
+			flashfs_sync();
+			return 0;
+
+		// Headers only, no block descriptors or mode pages. The device specific byte keeps write protect cleared
+		case SCSI_CMD_MODE_SENSE_6:
+		{
+			const uint8_t response[4] = { 3, 0, 0, 0 };
+			return msc_respond(buffer, bufsize, scsi_cmd[4], response, sizeof(response));
+		}
+		case SCSI_CMD_MODE_SENSE_10:
+		{
+			const uint8_t response[8] = { 0, 6, 0, 0, 0, 0, 0, 0 };
+			return msc_respond(buffer, bufsize, (uint16_t)((scsi_cmd[7] << 8) | scsi_cmd[8]), response, sizeof(response));
+		}
+
+		default:
+			tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00);
+			return -1;
+	}
 }
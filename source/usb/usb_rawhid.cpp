@@ -0,0 +1,167 @@
+#include <cstring>
+#include "usb_descriptor.h"
+#include "usb_rawhid.h"
+
+extern rawhid_status_t usb_keymap_received(const char *data, size_t length, bool persist);
+extern rawhid_status_t usb_keymap_select(uint16_t index);
+extern rawhid_status_t usb_keymap_select_name(uint32_t name_hash);
+extern rawhid_status_t usb_layer_select(uint8_t layer);
+extern void usb_get_state(rawhid_state_t *state);
+
+// Offset of the payload in requests and responses
+constexpr size_t request_header = 2;
+constexpr size_t response_header = 3;
+
+constexpr size_t data_header = request_header + 5;
+
+static char *s_keymap = nullptr;
+static uint32_t s_keymap_length = 0;
+static uint32_t s_keymap_crc = 0;
+static uint32_t s_received = 0;
+
+static uint32_t read_u32(const uint8_t *data)
+{
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+
+	return value;
+}
+static uint16_t read_u16(const uint8_t *data)
+{
+	uint16_t value;
+	memcpy(&value, data, sizeof(value));
+
+	return value;
+}
+
+// Field by field, the struct layout isn't part of the protocol
+static rawhid_status_t write_state(rawhid_status_t status, uint8_t *response)
+{
+	rawhid_state_t state;
+	usb_get_state(&state);
+
+	uint8_t *target = response + response_header;
+
+	memcpy(target, &state.keymap, 2);
+	memcpy(target + 2, &state.keymap_count, 2);
+	memcpy(target + 4, &state.name_hash, 4);
+	target[8] = state.layer;
+	target[9] = state.layer_count;
+	target[10] = state.persists_pending;
+	target[11] = state.persist_failures;
+	target[12] = (uint8_t)state.persist_status;
+
+	return status;
+}
+
+// Bitwise CRC32 as used by zlib, keymaps are small and this only runs once per upload
+static uint32_t calculate_crc32(const uint8_t *data, size_t length)
+{
+	uint32_t crc = 0xffffffff;
+
+	for(size_t i = 0; i < length; ++ i)
+	{
+		crc ^= data[i];
+
+		for(int j = 0; j < 8; ++ j)
+			crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+	}
+
+	return ~crc;
+}
+
+static void reset_upload()
+{
+	delete[] s_keymap;
+
+	s_keymap = nullptr;
+	s_keymap_length = 0;
+	s_received = 0;
+}
+
+static rawhid_status_t handle_request(rawhid_command_t command, const uint8_t *report, uint8_t *response)
+{
+	switch(command)
+	{
+		case rawhid_command_t::info:
+		{
+			const uint32_t max_size = RAWHID_MAX_KEYMAP_SIZE;
+
+			response[response_header] = RAWHID_PROTOCOL_VERSION;
+			memcpy(response + response_header + 1, &max_size, sizeof(max_size));
+
+			return rawhid_status_t::ok;
+		}
+
+		case rawhid_command_t::begin:
+		{
+			reset_upload();
+
+			const uint32_t length = read_u32(report + request_header);
+			if(length == 0 || length > RAWHID_MAX_KEYMAP_SIZE)
+				return rawhid_status_t::bad_length;
+
+			s_keymap = new char[length];
+			s_keymap_length = length;
+			s_keymap_crc = read_u32(report + request_header + 4);
+
+			return rawhid_status_t::ok;
+		}
+
+		case rawhid_command_t::data:
+		{
+			const uint32_t offset = read_u32(report + request_header);
+			const uint8_t length = report[request_header + 4];
+
+			if(!s_keymap || offset != s_received)
+				return rawhid_status_t::bad_state;
+
+			if(length > RAWHID_REPORT_SIZE - data_header || offset + length > s_keymap_length)
+				return rawhid_status_t::bad_length;
+
+			memcpy(s_keymap + offset, report + data_header, length);
+			s_received += length;
+
+			return rawhid_status_t::ok;
+		}
+
+		case rawhid_command_t::activate:
+		{
+			if(!s_keymap || s_received != s_keymap_length)
+				return rawhid_status_t::bad_state;
+
+			rawhid_status_t status = rawhid_status_t::bad_crc;
+
+			if(calculate_crc32((const uint8_t *)s_keymap, s_keymap_length) == s_keymap_crc)
+				status = usb_keymap_received(s_keymap, s_keymap_length, report[request_header] & RAWHID_FLAG_PERSIST);
+
+			reset_upload();
+			return status;
+		}
+
+		case rawhid_command_t::state:
+			return write_state(rawhid_status_t::ok, response);
+		case rawhid_command_t::select_keymap:
+			return write_state(usb_keymap_select(read_u16(report + request_header)), response);
+		case rawhid_command_t::select_name:
+			return write_state(usb_keymap_select_name(read_u32(report + request_header)), response);
+		case rawhid_command_t::select_layer:
+			return write_state(usb_layer_select(report[request_header]), response);
+	}
+
+	return rawhid_status_t::unknown_command;
+}
+
+void usb_rawhid_receive(const uint8_t *report, size_t length)
+{
+	if(length < RAWHID_REPORT_SIZE)
+		return;
+
+	uint8_t response[RAWHID_REPORT_SIZE] = {};
+	response[0] = report[0];
+	response[1] = report[1];
+	response[2] = (uint8_t)handle_request((rawhid_command_t)report[0], report, response);
+
+	// The host waits for every response before sending the next request, so the endpoint is free
+	tud_hid_n_report(HID_INSTANCE_RAW, 0, response, sizeof(response));
+}
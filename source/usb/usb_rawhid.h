@@ -0,0 +1,69 @@
+#ifndef MACROPAD_USB_RAWHID_H
+#define MACROPAD_USB_RAWHID_H
+
+#include <cstdint>
+#include <cstddef>
+
+// Configuration channel on a vendor defined HID interface. Every request is a single 64 byte output report of
+// command, tag and payload, answered by an input report of command, tag, status and payload. Multi byte values are
+// little endian. A keymap is the JSON text of a single keymap object, the same as an entry of config.json:
+//   begin:    u32 length, u32 CRC32 (zlib) of the whole keymap
+//   data:     u32 offset, u8 length, data. Chunks have to arrive in order
+//   activate: u8 flags. Parses the keymap, replaces the one with the same name (or adds it) and switches to it.
+//             With rawhid_flag_persist it also gets written into config.json
+//   info:     answers with u8 protocol version, u32 max keymap length
+// Switching is a single request each, all of them answer with the resulting state:
+//   state:         u16 keymap index, u16 keymap count, u32 keymap name hash, u8 layer, u8 layer count,
+//                  u8 persists pending, u8 persist failures, u8 status of the last failed persist
+//   select keymap: u16 index
+//   select name:   u32 name hash, FNV-1a of the raw name string as in config.json, never 0
+//   select layer:  u8 layer of the active keymap
+#define RAWHID_REPORT_SIZE      64
+#define RAWHID_PROTOCOL_VERSION 3
+#define RAWHID_MAX_KEYMAP_SIZE  (16 * 1024)
+
+enum class rawhid_command_t : uint8_t
+{
+	info,
+	begin,
+	data,
+	activate,
+	state,
+	select_keymap,
+	select_name,
+	select_layer,
+};
+
+enum class rawhid_status_t : uint8_t
+{
+	ok,
+	unknown_command,
+	bad_state,      // Data or activate without a begin, or chunks out of order
+	bad_length,
+	bad_crc,
+	invalid_keymap,
+	busy,           // Persisting while the volume belongs to the host
+	io_error,
+	not_found,      // No keymap or layer by that index or name, or it failed to parse
+};
+
+#define RAWHID_FLAG_PERSIST (1 << 0)
+
+struct rawhid_state_t
+{
+	uint16_t keymap;
+	uint16_t keymap_count;
+	uint32_t name_hash; // 0 for the system keymap and keymaps without a name
+	uint8_t layer;
+	uint8_t layer_count;
+
+	// Keymaps pushed with persist get written into config.json one at a time after the activate was answered.
+	// Failures are counted, wrapping around, so a host can tell whether any of its own went wrong
+	uint8_t persists_pending;
+	uint8_t persist_failures;
+	rawhid_status_t persist_status; // io_error, or invalid_keymap if config.json doesn't parse and was left alone
+};
+
+void usb_rawhid_receive(const uint8_t *report, size_t length);
+
+#endif //MACROPAD_USB_RAWHID_H
@@ -0,0 +1,124 @@
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <vector>
+#include <tusb.h>
+#include "test.h"
+#include "logic/flashfs.h"
+#include "usb/usb_descriptor.h"
+
+// Runs usb_msc.cpp against a RAM block device in place of flashfs, feeding it the same chunks TinyUSB would for a
+// given CFG_TUD_MSC_EP_BUFSIZE. TinyUSB only queues the next chunk once tud_task() ran the callback for the last
+// one, and the firmware calls tud_task() once per main loop tick, so a transfer takes at least one tick per chunk
+
+constexpr uint32_t tick_us = 5000; // Main loop period, see main.cpp
+constexpr uint32_t bytes_per_frame = 19 * 64; // Bulk packets a full speed frame fits in practice
+constexpr uint32_t transfer_sectors = 128; // 64 KiB, a small file copy
+
+static std::vector<uint8_t> s_disk(DISK_SECTOR_COUNT * DISK_SECTOR_SIZE);
+static uint32_t s_calls = 0;
+
+void flashfs_read(void *buffer, uint32_t lba, uint32_t offset, uint32_t length)
+{
+	memcpy(buffer, s_disk.data() + lba * DISK_SECTOR_SIZE + offset, length);
+	s_calls ++;
+}
+
+void flashfs_write(const void *buffer, uint32_t lba, uint32_t offset, uint32_t length)
+{
+	memcpy(s_disk.data() + lba * DISK_SECTOR_SIZE + offset, buffer, length);
+	s_calls ++;
+}
+
+void flashfs_sync() {}
+void usb_ejected() {}
+
+bool tud_msc_set_sense(uint8_t lun, uint8_t sense_key, uint8_t add_sense_code, uint8_t add_sense_qualifier)
+{
+	return true;
+}
+
+struct transfer_t
+{
+	uint32_t calls;
+	uint32_t time_us;
+};
+
+// The bus moves a chunk within its share of frames, the callback then waits for the tick after that
+static uint32_t get_chunk_time_us(uint32_t size)
+{
+	const uint32_t wire_us = (size * 1000 + bytes_per_frame - 1) / bytes_per_frame;
+	return (wire_us + tick_us - 1) / tick_us * tick_us;
+}
+
+static transfer_t transfer(bool is_write, uint32_t lba, uint8_t *data, uint32_t bufsize)
+{
+	const uint32_t size = transfer_sectors * DISK_SECTOR_SIZE;
+	transfer_t result = {};
+
+	s_calls = 0;
+
+	for(uint32_t offset = 0; offset < size; offset += bufsize)
+	{
+		const uint32_t chunk = std::min(bufsize, size - offset);
+		const int32_t length = is_write ? tud_msc_write10_cb(0, lba, offset, data + offset, chunk) : tud_msc_read10_cb(0, lba, offset, data + offset, chunk);
+
+		CHECK_EQUAL(length, chunk);
+		result.time_us += get_chunk_time_us(chunk);
+	}
+
+	result.calls = s_calls;
+	return result;
+}
+
+static void bench_buffer_sizes()
+{
+	std::mt19937 random(1234);
+	std::vector<uint8_t> file(transfer_sectors * DISK_SECTOR_SIZE);
+	std::vector<uint8_t> read_back(file.size());
+
+	usb_set_medium_present(true);
+
+	printf("%8s %8s %10s %10s\n", "bufsize", "calls", "write KB/s", "read KB/s");
+
+	for(const uint32_t bufsize : { 512u, 1024u, 2048u, 4096u })
+	{
+		std::generate(file.begin(), file.end(), [&random] { return (uint8_t)random(); });
+
+		// Unaligned to the chunk size on purpose, TinyUSB's offsets are relative to the start lba
+		const uint32_t lba = 37;
+		const transfer_t write = transfer(true, lba, file.data(), bufsize);
+		const transfer_t read = transfer(false, lba, read_back.data(), bufsize);
+
+		CHECK(memcmp(s_disk.data() + lba * DISK_SECTOR_SIZE, file.data(), file.size()) == 0);
+		CHECK(read_back == file);
+		CHECK_EQUAL(write.calls, file.size() / bufsize);
+		CHECK_EQUAL(read.calls, file.size() / bufsize);
+
+		printf("%8u %8u %10u %10u%s\n", bufsize, write.calls, (uint32_t)(file.size() * 1000 / write.time_us),
+			(uint32_t)(file.size() * 1000 / read.time_us), bufsize == CFG_TUD_MSC_EP_BUFSIZE ? " (configured)" : "");
+	}
+}
+
+static void test_out_of_range()
+{
+	uint8_t buffer[DISK_SECTOR_SIZE];
+
+	usb_set_medium_present(true);
+
+	CHECK_EQUAL(tud_msc_read10_cb(0, DISK_SECTOR_COUNT - 1, 0, buffer, sizeof(buffer)), sizeof(buffer));
+	CHECK_EQUAL(tud_msc_read10_cb(0, DISK_SECTOR_COUNT - 1, DISK_SECTOR_SIZE, buffer, sizeof(buffer)), -1);
+	CHECK_EQUAL(tud_msc_write10_cb(0, DISK_SECTOR_COUNT, 0, buffer, sizeof(buffer)), -1);
+
+	usb_set_medium_present(false);
+
+	CHECK_EQUAL(tud_msc_read10_cb(0, 0, 0, buffer, sizeof(buffer)), -1);
+}
+
+int main()
+{
+	RUN_TEST(bench_buffer_sizes);
+	RUN_TEST(test_out_of_range);
+
+	return test_result();
+}
@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <iterator>
+#include <hardware/dma.h>
+#include <hardware/flash.h>
+#include "flashsim.h"
+#include "logic/flashio.h"
+
+uint8_t flashsim_memory[PICO_FLASH_SIZE_BYTES];
+
+constexpr size_t no_power_cut = SIZE_MAX;
+
+static uint32_t s_erase_counts[PICO_FLASH_SIZE_BYTES / FLASH_SECTOR_SIZE];
+static size_t s_program_budget = no_power_cut;
+static bool s_is_powered = true;
+static size_t s_programmed_bytes = 0;
+
+static uint32_t s_crc = 0;
+static size_t s_crc_bytes = 0;
+
+void flashsim_reset()
+{
+	memset(flashsim_memory, 0xff, sizeof(flashsim_memory));
+	std::fill(std::begin(s_erase_counts), std::end(s_erase_counts), 0);
+
+	flashsim_power_on();
+	s_programmed_bytes = 0;
+	s_crc_bytes = 0;
+}
+
+uint32_t flashsim_get_erase_count(uint32_t offset)
+{
+	return s_erase_counts[offset / FLASH_SECTOR_SIZE];
+}
+
+void flashsim_cut_power_after(size_t bytes)
+{
+	s_program_budget = bytes;
+}
+void flashsim_power_on()
+{
+	s_program_budget = no_power_cut;
+	s_is_powered = true;
+}
+
+size_t flashsim_get_programmed_bytes()
+{
+	return s_programmed_bytes;
+}
+
+size_t flashsim_get_crc_bytes()
+{
+	return s_crc_bytes;
+}
+void flashsim_clear_crc_bytes()
+{
+	s_crc_bytes = 0;
+}
+
+void flashio_erase(uint32_t offset, size_t length)
+{
+	assert(offset % FLASH_SECTOR_SIZE == 0 && length % FLASH_SECTOR_SIZE == 0);
+	assert(offset + length <= PICO_FLASH_SIZE_BYTES);
+
+	if(!s_is_powered)
+		return;
+
+	memset(flashsim_memory + offset, 0xff, length);
+
+	for(uint32_t sector = offset / FLASH_SECTOR_SIZE; sector < (offset + length) / FLASH_SECTOR_SIZE; ++ sector)
+		s_erase_counts[sector] ++;
+}
+void flashio_program(uint32_t offset, const void *data, size_t length)
+{
+	assert(offset + length <= PICO_FLASH_SIZE_BYTES);
+
+	const uint8_t *source = (const uint8_t *)data;
+
+	for(size_t i = 0; i < length && s_is_powered; ++ i)
+	{
+		if(s_program_budget != no_power_cut && s_program_budget-- == 0)
+		{
+			s_is_powered = false;
+			break;
+		}
+
+		flashsim_memory[offset + i] &= source[i];
+		s_programmed_bytes ++;
+	}
+}
+
+// CRC-32 as computed by the sniffer: polynomial 0x04c11db7, most significant bit first, no final inversion
+void dma_sniffer_set_data_accumulator(uint32_t seed)
+{
+	s_crc = seed;
+}
+uint32_t dma_sniffer_get_data_accumulator()
+{
+	return s_crc;
+}
+
+void dma_channel_configure(unsigned channel, const dma_channel_config *config, volatile void *write_address, const volatile void *read_address, unsigned count, bool trigger)
+{
+	const volatile uint8_t *source = (const volatile uint8_t *)read_address;
+
+	for(unsigned i = 0; i < count; ++ i)
+	{
+		const uint8_t value = config->read_increment ? source[i] : source[0];
+
+		if(config->sniff_enable)
+		{
+			s_crc ^= (uint32_t)value << 24;
+
+			for(int bit = 0; bit < 8; ++ bit)
+				s_crc = (s_crc & 0x80000000) ? (s_crc << 1) ^ 0x04c11db7 : (s_crc << 1);
+		}
+	}
+
+	s_crc_bytes += count;
+}
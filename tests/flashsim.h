@@ -0,0 +1,27 @@
+#ifndef MACROPAD_FLASHSIM_H
+#define MACROPAD_FLASHSIM_H
+
+#include <cstdint>
+#include <cstddef>
+
+// RAM model of the flash behind flashio.h. Like NOR flash, erases set a whole sector to 0xff and programs can only
+// clear bits. It also stands in for the DMA sniffer the log computes its CRCs with
+
+// Everything erased, counters cleared and powered on
+void flashsim_reset();
+
+uint32_t flashsim_get_erase_count(uint32_t offset); // Of the sector holding the offset
+
+// Power gets cut after this many more programmed bytes, the rest of that program and anything after it is lost
+// until flashsim_power_on()
+void flashsim_cut_power_after(size_t bytes);
+void flashsim_power_on();
+
+// Bytes programmed since the reset
+size_t flashsim_get_programmed_bytes();
+
+// Bytes fed through the CRC since the last clear, a measure of how much flash got read
+size_t flashsim_get_crc_bytes();
+void flashsim_clear_crc_bytes();
+
+#endif //MACROPAD_FLASHSIM_H
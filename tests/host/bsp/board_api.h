@@ -0,0 +1,9 @@
+#ifndef MACROPAD_TESTS_BSP_BOARD_API_H
+#define MACROPAD_TESTS_BSP_BOARD_API_H
+
+// Host stand-in for the TinyUSB board support header, there's no LED to light up
+
+inline void board_led_on() {}
+inline void board_led_off() {}
+
+#endif //MACROPAD_TESTS_BSP_BOARD_API_H
@@ -0,0 +1,39 @@
+#ifndef MACROPAD_TESTS_HARDWARE_DMA_H
+#define MACROPAD_TESTS_HARDWARE_DMA_H
+
+#include <cstdint>
+
+// Host stand-in for the Pico SDK header. Only the sniffer is modelled, transfers just feed it, see flashsim.cpp
+
+enum dma_channel_transfer_size
+{
+	DMA_SIZE_8 = 0,
+	DMA_SIZE_16 = 1,
+	DMA_SIZE_32 = 2
+};
+
+#define DMA_SNIFF_CTRL_CALC_VALUE_CRC32 0x0
+
+struct dma_channel_config
+{
+	bool read_increment;
+	bool sniff_enable;
+};
+
+inline int dma_claim_unused_channel(bool required) { return 0; }
+
+inline dma_channel_config dma_channel_get_default_config(unsigned channel) { return { true, false }; }
+inline void channel_config_set_transfer_data_size(dma_channel_config *config, dma_channel_transfer_size size) {}
+inline void channel_config_set_read_increment(dma_channel_config *config, bool increment) { config->read_increment = increment; }
+inline void channel_config_set_write_increment(dma_channel_config *config, bool increment) {}
+inline void channel_config_set_sniff_enable(dma_channel_config *config, bool enable) { config->sniff_enable = enable; }
+
+inline void dma_sniffer_enable(unsigned channel, unsigned mode, bool force_channel_enable) {}
+void dma_sniffer_set_data_accumulator(uint32_t seed);
+uint32_t dma_sniffer_get_data_accumulator();
+
+// Byte transfers only, which is all the log uses
+void dma_channel_configure(unsigned channel, const dma_channel_config *config, volatile void *write_address, const volatile void *read_address, unsigned count, bool trigger);
+inline void dma_channel_wait_for_finish_blocking(unsigned channel) {}
+
+#endif //MACROPAD_TESTS_HARDWARE_DMA_H
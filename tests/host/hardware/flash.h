@@ -0,0 +1,18 @@
+#ifndef MACROPAD_TESTS_HARDWARE_FLASH_H
+#define MACROPAD_TESTS_HARDWARE_FLASH_H
+
+#include <cstdint>
+
+// Host stand-in for the Pico SDK header, backed by the RAM model in flashsim.cpp
+
+#define FLASH_PAGE_SIZE   (1u << 8)
+#define FLASH_SECTOR_SIZE (1u << 12)
+
+// Only the end of flash is used by the log, so the model leaves out most of the rest
+#define PICO_FLASH_SIZE_BYTES (256 * 1024)
+
+extern uint8_t flashsim_memory[PICO_FLASH_SIZE_BYTES];
+
+#define XIP_BASE ((uintptr_t)flashsim_memory)
+
+#endif //MACROPAD_TESTS_HARDWARE_FLASH_H
@@ -0,0 +1,22 @@
+#ifndef MACROPAD_TESTS_PICO_TIME_H
+#define MACROPAD_TESTS_PICO_TIME_H
+
+#include <cassert>
+#include <cstdint>
+
+// Host stand-in for the Pico SDK header, which brings assert() along as well. Time only moves when a test moves it
+
+typedef uint64_t absolute_time_t;
+
+inline uint64_t host_time_us = 0;
+
+inline absolute_time_t get_absolute_time()
+{
+	return host_time_us;
+}
+inline uint32_t to_ms_since_boot(absolute_time_t time)
+{
+	return (uint32_t)(time / 1000);
+}
+
+#endif //MACROPAD_TESTS_PICO_TIME_H
@@ -0,0 +1,19 @@
+#ifndef MACROPAD_TESTS_TUSB_H
+#define MACROPAD_TESTS_TUSB_H
+
+// Host stand-in for TinyUSB's umbrella header. Only the class definitions are pulled in, the device stack itself
+// never runs on the host and tests provide whatever tud_* functions the tested code calls
+
+#include "tusb_config.h"
+#include <class/hid/hid.h>
+#include <class/msc/msc.h>
+
+// Declared by the device stack in the firmware
+extern "C"
+{
+	bool tud_msc_set_sense(uint8_t lun, uint8_t sense_key, uint8_t add_sense_code, uint8_t add_sense_qualifier);
+	int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void *buffer, uint32_t bufsize);
+	int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t *buffer, uint32_t bufsize);
+}
+
+#endif //MACROPAD_TESTS_TUSB_H
@@ -0,0 +1,10 @@
+#ifndef MACROPAD_TESTS_TUSB_CONFIG_H
+#define MACROPAD_TESTS_TUSB_CONFIG_H
+
+// The firmware's configuration with the MCU and OS the Pico SDK would otherwise pass in from the build
+#define CFG_TUSB_MCU OPT_MCU_NONE
+#define CFG_TUSB_OS OPT_OS_NONE
+
+#include "usb/tusb_config.h"
+
+#endif //MACROPAD_TESTS_TUSB_CONFIG_H
@@ -0,0 +1,49 @@
+#ifndef MACROPAD_TEST_H
+#define MACROPAD_TEST_H
+
+#include <cstdio>
+
+// Failed checks are reported and counted, the test keeps going so one run shows everything that broke
+inline int test_failures = 0;
+
+#define CHECK(condition) \
+	do \
+	{ \
+		if(!(condition)) \
+		{ \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			test_failures ++; \
+		} \
+	} \
+	while(0)
+
+#define CHECK_EQUAL(actual, expected) \
+	do \
+	{ \
+		const long long actual_value = (long long)(actual); \
+		const long long expected_value = (long long)(expected); \
+		if(actual_value != expected_value) \
+		{ \
+			fprintf(stderr, "%s:%d: check failed: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, actual_value, expected_value); \
+			test_failures ++; \
+		} \
+	} \
+	while(0)
+
+#define RUN_TEST(test) \
+	do \
+	{ \
+		printf("%s\n", #test); \
+		test(); \
+	} \
+	while(0)
+
+inline int test_result()
+{
+	if(test_failures > 0)
+		fprintf(stderr, "%d check(s) failed\n", test_failures);
+
+	return test_failures > 0 ? 1 : 0;
+}
+
+#endif //MACROPAD_TEST_H
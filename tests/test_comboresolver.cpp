@@ -0,0 +1,308 @@
+#include <initializer_list>
+#include <tusb.h>
+#include "test.h"
+#include "logic/comboresolver.h"
+#include "logic/tapholdresolver.h"
+
+constexpr uint8_t key_a = 0;
+constexpr uint8_t key_b = 1;
+constexpr uint8_t key_c = 2;
+constexpr uint8_t key_d = 3; // In no combo
+constexpr uint8_t combo_ab = num_keys; // Combos come out after the keys, in table order
+constexpr uint8_t combo_abc = num_keys + 1;
+constexpr uint16_t window_ms = 40;
+
+struct expected_t
+{
+	uint8_t key;
+	bool is_press;
+	uint32_t time_ms;
+	keyrole_t role = keyrole_t::normal;
+};
+
+static comboresolver_t make_resolver(std::initializer_list<uint16_t> masks)
+{
+	resolved_keylayer_t layer;
+
+	for(const uint16_t mask : masks)
+		layer.combos[layer.combo_count ++].mask = mask;
+
+	comboresolver_t resolver;
+	resolver.set_combos(layer, window_ms);
+
+	return resolver;
+}
+
+static keyevent_t make_event(uint32_t time_ms, uint8_t key, bool is_press)
+{
+	keyevent_t event = {};
+	event.time_us = time_ms * 1000ull;
+	event.key = key;
+	event.is_press = is_press;
+
+	return event;
+}
+
+static void push(comboresolver_t &resolver, uint32_t time_ms, uint8_t key, bool is_press)
+{
+	resolver.push(make_event(time_ms, key, is_press));
+}
+
+// Everything that came out since the last call, in order
+template<typename resolver_t>
+static void check_output(resolver_t &resolver, std::initializer_list<expected_t> expected)
+{
+	keyevent_t event;
+
+	for(const expected_t &next : expected)
+	{
+		if(!resolver.pop(&event))
+		{
+			CHECK(!"fewer events than expected");
+			return;
+		}
+
+		CHECK_EQUAL(event.key, next.key);
+		CHECK_EQUAL(event.is_press, next.is_press);
+		CHECK_EQUAL(event.time_us, next.time_ms * 1000ull);
+		CHECK_EQUAL(event.role, next.role);
+	}
+
+	CHECK(!resolver.pop(&event));
+}
+
+static void test_combo()
+{
+	comboresolver_t resolver = make_resolver({ 0b011 });
+
+	push(resolver, 0, key_a, true);
+	check_output(resolver, {});
+
+	push(resolver, 20, key_b, true);
+	check_output(resolver, { { combo_ab, true, 20 } });
+
+	// Goes up with the first of its keys, the other release is swallowed
+	push(resolver, 100, key_b, false);
+	check_output(resolver, { { combo_ab, false, 100 } });
+
+	push(resolver, 120, key_a, false);
+	check_output(resolver, {});
+	CHECK(resolver.is_idle());
+}
+
+static void test_window()
+{
+	comboresolver_t resolver = make_resolver({ 0b011 });
+
+	push(resolver, 0, key_a, true);
+	resolver.update((window_ms - 1) * 1000);
+	check_output(resolver, {});
+
+	// Comes out as it was pressed, keeping its time
+	resolver.update(window_ms * 1000);
+	check_output(resolver, { { key_a, true, 0 } });
+
+	// Too late to join, it waits for a combo of its own
+	push(resolver, 60, key_b, true);
+	check_output(resolver, {});
+
+	resolver.update((60 + window_ms) * 1000);
+	check_output(resolver, { { key_b, true, 60 } });
+
+	push(resolver, 150, key_a, false);
+	push(resolver, 160, key_b, false);
+	check_output(resolver, {
+		{ key_a, false, 150 },
+		{ key_b, false, 160 } });
+	CHECK(resolver.is_idle());
+}
+
+static void test_partial_chord_release()
+{
+	// Down to two keys of a three key combo without a shorter one, then one of them goes up
+	comboresolver_t resolver = make_resolver({ 0b111 });
+
+	push(resolver, 0, key_a, true);
+	push(resolver, 10, key_b, true);
+	check_output(resolver, {});
+
+	push(resolver, 20, key_b, false);
+	check_output(resolver, {
+		{ key_a, true, 0 },
+		{ key_b, true, 10 },
+		{ key_b, false, 20 } });
+
+	push(resolver, 30, key_a, false);
+	check_output(resolver, { { key_a, false, 30 } });
+	CHECK(resolver.is_idle());
+
+	// With the shorter combo around, what's down by then fires it instead
+	resolver = make_resolver({ 0b011, 0b111 });
+
+	push(resolver, 0, key_a, true);
+	push(resolver, 10, key_b, true);
+	check_output(resolver, {});
+
+	push(resolver, 20, key_a, false);
+	check_output(resolver, {
+		{ combo_ab, true, 10 },
+		{ combo_ab, false, 20 } });
+
+	push(resolver, 30, key_b, false);
+	check_output(resolver, {});
+
+	// And the longer one once all of it is down
+	push(resolver, 100, key_c, true);
+	push(resolver, 110, key_b, true);
+	push(resolver, 120, key_a, true);
+	check_output(resolver, { { combo_abc, true, 120 } });
+}
+
+static void test_unrelated_key()
+{
+	comboresolver_t resolver = make_resolver({ 0b011 });
+
+	// Keys in no combo pass straight through, but only after what was pressed before them
+	push(resolver, 0, key_a, true);
+	push(resolver, 10, key_d, true);
+	check_output(resolver, {
+		{ key_a, true, 0 },
+		{ key_d, true, 10 } });
+
+	push(resolver, 20, key_d, false);
+	push(resolver, 30, key_a, false);
+	check_output(resolver, {
+		{ key_d, false, 20 },
+		{ key_a, false, 30 } });
+}
+
+// Combo and tap-hold resolver chained like application::process_keys() does, with key a and the combo as tap-hold
+// keys
+struct chain_t
+{
+	comboresolver_t combos = make_resolver({ 0b011 });
+	tapholdresolver_t tap_holds;
+	taphold_t tap_hold = {};
+
+	chain_t()
+	{
+		tap_hold.keycode = HID_KEY_A;
+		tap_hold.hold_modifier = KEYBOARD_MODIFIER_LEFTCTRL;
+		tap_hold.term_ms = 200;
+	}
+
+	void push(uint32_t time_ms, uint8_t key, bool is_press)
+	{
+		combos.push(make_event(time_ms, key, is_press));
+		forward();
+	}
+	void update(uint32_t time_ms)
+	{
+		combos.update(time_ms * 1000);
+		forward();
+		tap_holds.update(time_ms * 1000);
+	}
+	void forward()
+	{
+		keyevent_t event;
+
+		while(combos.pop(&event))
+			tap_holds.push(event, (event.is_press && (event.key == key_a || event.key == combo_ab)) ? &tap_hold : nullptr);
+	}
+
+	bool pop(keyevent_t *event) { return tap_holds.pop(event); }
+};
+
+static void test_tap_hold_overlap()
+{
+	// The combo wins, the tap-hold key never goes down on its own
+	{
+		chain_t chain;
+
+		chain.push(0, key_a, true);
+		chain.push(20, key_b, true);
+		chain.push(80, key_a, false);
+		chain.push(90, key_b, false);
+		chain.update(400);
+
+		check_output(chain, {
+			{ combo_ab, true, 20, keyrole_t::tap },
+			{ combo_ab, false, 80, keyrole_t::tap } });
+	}
+
+	// Held on its own, the window doesn't add to the tapping term since the press keeps its time
+	{
+		chain_t chain;
+
+		chain.push(0, key_a, true);
+		chain.update(window_ms);
+		check_output(chain, {});
+
+		chain.update(199);
+		check_output(chain, {});
+
+		chain.update(200);
+		check_output(chain, { { key_a, true, 0, keyrole_t::hold } });
+
+		chain.push(300, key_a, false);
+		check_output(chain, { { key_a, false, 300, keyrole_t::hold } });
+	}
+
+	// The combo is a tap-hold key as well
+	{
+		chain_t chain;
+
+		chain.push(0, key_a, true);
+		chain.push(10, key_b, true);
+		chain.update(209);
+		check_output(chain, {});
+
+		chain.update(210);
+		check_output(chain, { { combo_ab, true, 10, keyrole_t::hold } });
+
+		chain.push(300, key_b, false);
+		chain.push(310, key_a, false);
+		check_output(chain, { { combo_ab, false, 300, keyrole_t::hold } });
+	}
+}
+
+static void test_queue_full()
+{
+	comboresolver_t resolver = make_resolver({ 0b011 });
+
+	// Nothing popped in between, whatever doesn't fit any more is dropped and the rest stays in order
+	for(uint32_t i = 0; i < KEYEVENT_QUEUE_SIZE + 8; ++ i)
+		push(resolver, i, key_d, i % 2 == 0);
+
+	keyevent_t event;
+	uint32_t count = 0;
+
+	while(resolver.pop(&event))
+	{
+		CHECK_EQUAL(event.key, key_d);
+		CHECK_EQUAL(event.time_us, count * 1000ull);
+		CHECK_EQUAL(event.is_press, count % 2 == 0);
+
+		count ++;
+	}
+
+	CHECK_EQUAL(count, KEYEVENT_QUEUE_SIZE);
+	CHECK(resolver.is_idle());
+
+	// Still works once drained, and held back presses don't count against the queue
+	push(resolver, 100, key_a, true);
+	push(resolver, 110, key_b, true);
+	check_output(resolver, { { combo_ab, true, 110 } });
+}
+
+int main()
+{
+	RUN_TEST(test_combo);
+	RUN_TEST(test_window);
+	RUN_TEST(test_partial_chord_release);
+	RUN_TEST(test_unrelated_key);
+	RUN_TEST(test_tap_hold_overlap);
+	RUN_TEST(test_queue_full);
+
+	return test_result();
+}
@@ -0,0 +1,98 @@
+#include <cstring>
+#include <string>
+#include "flashsim.h"
+#include "test.h"
+#include "logic/flashfs.h"
+
+// Text that compresses well, so every sector of it gets logged compressed at first
+static std::string make_config(size_t size)
+{
+	std::string text = "[\n";
+
+	while(text.size() < size)
+		text += "\t{ \"name\": \"layer\", \"keys\": [ \"a\", \"b\", \"c\", \"d\" ] },\n";
+
+	return text + "]\n";
+}
+
+static void finish_commit()
+{
+	while(flashfs_is_committing())
+		flashfs_task();
+}
+
+static bool map_matches(const flashfs_mapping_t &mapping, const std::string &expected)
+{
+	return mapping.size == expected.size() && memcmp(mapping.data, expected.data(), expected.size()) == 0;
+}
+
+static void test_map_file()
+{
+	flashsim_reset();
+	flashfs_init();
+
+	// A bit larger than the example configuration, four sectors
+	const std::string config = make_config(1800);
+	const flashfs_part_t part = { config.data(), config.size() };
+
+	CHECK(flashfs_write_file("/config.json", &part, 1));
+
+	// The keymap gets loaded while the commit that follows an eject is still running
+	flashfs_mapping_t mapping;
+
+	CHECK(flashfs_map_file("/config.json", &mapping));
+	CHECK(!mapping.is_copy);
+	CHECK(map_matches(mapping, config));
+
+	finish_commit();
+	flashfs_unmap_file(&mapping);
+
+	// Already laid out, mapping it again doesn't log anything
+	const size_t programmed = flashsim_get_programmed_bytes();
+
+	CHECK(flashfs_map_file("/config.json", &mapping));
+	CHECK(!mapping.is_copy);
+	CHECK(map_matches(mapping, config));
+	CHECK_EQUAL(flashsim_get_programmed_bytes(), programmed);
+	CHECK(!flashfs_has_changes());
+
+	flashfs_unmap_file(&mapping);
+
+	// Still in one piece after a power cycle
+	flashfs_init();
+
+	CHECK(flashfs_map_file("/config.json", &mapping));
+	CHECK(!mapping.is_copy);
+	CHECK(map_matches(mapping, config));
+
+	flashfs_unmap_file(&mapping);
+}
+
+static void test_map_large_file()
+{
+	flashsim_reset();
+	flashfs_init();
+
+	// More than a log block holds uncompressed
+	const std::string config = make_config(5000);
+	const flashfs_part_t part = { config.data(), config.size() };
+
+	CHECK(flashfs_write_file("/config.json", &part, 1));
+	finish_commit();
+
+	flashfs_mapping_t mapping;
+
+	CHECK(flashfs_map_file("/config.json", &mapping));
+	CHECK(mapping.is_copy);
+	CHECK(map_matches(mapping, config));
+
+	flashfs_unmap_file(&mapping);
+}
+
+int main()
+{
+	RUN_TEST(test_map_file);
+	RUN_TEST(test_map_large_file);
+
+	return test_result();
+}
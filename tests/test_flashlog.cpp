@@ -0,0 +1,364 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <random>
+#include <vector>
+#include <hardware/flash.h>
+#include "flashsim.h"
+#include "test.h"
+#include "logic/flashfs.h"
+#include "logic/flashlog.h"
+
+typedef std::array<uint8_t, DISK_SECTOR_SIZE> sector_t;
+
+constexpr uint32_t log_offset = PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE * FLASHLOG_BLOCK_COUNT;
+
+// Every header and every byte of record data gets through the CRC at most twice while mounting, once when looking
+// for the last commit and once more when checking the records
+constexpr size_t max_mount_crc_bytes = 2 * FLASHLOG_BLOCK_COUNT * FLASH_SECTOR_SIZE;
+
+static std::mt19937 s_random(1234);
+
+// Random data doesn't compress, so each of these takes up a full record
+static sector_t make_sector(bool is_compressible)
+{
+	sector_t sector;
+
+	for(size_t i = 0; i < sector.size(); ++ i)
+		sector[i] = (is_compressible && i >= 16) ? sector[i % 16] : (uint8_t)s_random();
+
+	return sector;
+}
+
+static uint32_t count_erases()
+{
+	uint32_t count = 0;
+
+	for(size_t i = 0; i < FLASHLOG_BLOCK_COUNT; ++ i)
+		count += flashsim_get_erase_count(log_offset + i * FLASH_SECTOR_SIZE);
+
+	return count;
+}
+
+// Work a single call may do: one GC step moving a record or erasing its victim, then its own record, which might
+// have to start a freshly erased block
+constexpr uint32_t max_call_erases = 2;
+constexpr size_t max_call_programmed = 2 * (DISK_SECTOR_SIZE + 16) + 16;
+
+template<typename function_t>
+static bool call_bounded(function_t function)
+{
+	const uint32_t erases = count_erases();
+	const size_t programmed = flashsim_get_programmed_bytes();
+
+	const bool result = function();
+
+	CHECK(count_erases() - erases <= max_call_erases);
+	CHECK(flashsim_get_programmed_bytes() - programmed <= max_call_programmed);
+
+	return result;
+}
+
+// Writes and commits are turned away while the collector makes room, flashfs tries again on a later tick
+static bool write_sector(uint32_t lba, const sector_t &sector)
+{
+	for(int i = 0; i < 64; ++ i)
+	{
+		if(call_bounded([&] { return flashlog_write(lba, sector.data()); }))
+			return true;
+	}
+
+	return false;
+}
+static bool commit()
+{
+	for(int i = 0; i < 64; ++ i)
+	{
+		if(call_bounded([] { return flashlog_commit(); }))
+			return true;
+	}
+
+	return false;
+}
+
+// What flashfs_task() does between host writes
+static void collect_garbage()
+{
+	for(int i = 0; i < 16 && flashlog_free_blocks() < FLASHLOG_RESERVE_BLOCKS; ++ i)
+		flashlog_gc_step();
+}
+
+static bool read_matches(uint32_t lba, const sector_t &expected)
+{
+	sector_t sector;
+	flashlog_read_sector(lba, sector.data());
+
+	return sector == expected;
+}
+
+static void format_log()
+{
+	flashsim_reset();
+
+	CHECK(!flashlog_mount());
+	flashlog_format();
+}
+
+static void test_wear_levelling()
+{
+	format_log();
+
+	std::vector<sector_t> committed(DISK_SECTOR_COUNT, sector_t{});
+
+	// Cold data, written once and never touched again, pins its blocks unless the collector moves it on its own
+	for(uint32_t lba = 256; lba < 320; ++ lba)
+	{
+		committed[lba] = make_sector(true);
+		CHECK(write_sector(lba, committed[lba]));
+	}
+
+	CHECK(commit());
+
+	size_t max_mount_cost = 0;
+
+	for(int cycle = 0; cycle < 16000; ++ cycle)
+	{
+		const int count = 1 + s_random() % 6;
+
+		for(int i = 0; i < count; ++ i)
+		{
+			const uint32_t lba = s_random() % 32;
+
+			committed[lba] = make_sector(s_random() % 4 == 0);
+			CHECK(write_sector(lba, committed[lba]));
+		}
+
+		CHECK(commit());
+		collect_garbage();
+
+		if(cycle % 100 != 99)
+			continue;
+
+		flashsim_clear_crc_bytes();
+		CHECK(flashlog_mount());
+
+		max_mount_cost = std::max(max_mount_cost, flashsim_get_crc_bytes());
+
+		for(uint32_t lba = 0; lba < DISK_SECTOR_COUNT; ++ lba)
+			CHECK(read_matches(lba, committed[lba]));
+	}
+
+	uint32_t min_erases = UINT32_MAX;
+	uint32_t max_erases = 0;
+	const uint32_t total_erases = count_erases();
+
+	for(size_t i = 0; i < FLASHLOG_BLOCK_COUNT; ++ i)
+	{
+		const uint32_t erases = flashsim_get_erase_count(log_offset + i * FLASH_SECTOR_SIZE);
+
+		min_erases = std::min(min_erases, erases);
+		max_erases = std::max(max_erases, erases);
+	}
+
+	printf("  erases per block: %u to %u, %u in total. Mount read at most %zu bytes\n", min_erases, max_erases, total_erases, max_mount_cost);
+
+	// Enough erases that blocks holding cold data must have been moved to stay within the threshold
+	CHECK(total_erases / FLASHLOG_BLOCK_COUNT > 2 * FLASHLOG_WEAR_THRESHOLD);
+	CHECK(max_erases - min_erases <= FLASHLOG_WEAR_THRESHOLD + 2);
+
+	// The mount has a fixed cost, however long the log has been in use
+	CHECK(max_mount_cost <= max_mount_crc_bytes);
+}
+
+// Without idle time for the collector every bit of GC lands on writes, which still only do a step each. With the
+// log two thirds full most victims hold several live records
+static void test_write_without_background_gc()
+{
+	format_log();
+
+	std::vector<sector_t> committed(DISK_SECTOR_COUNT, sector_t{});
+
+	for(int cycle = 0; cycle < 2000; ++ cycle)
+	{
+		const uint32_t lba = s_random() % 200;
+
+		committed[lba] = make_sector(false);
+		CHECK(write_sector(lba, committed[lba]));
+
+		if(cycle % 8 == 7)
+			CHECK(commit());
+	}
+
+	CHECK(commit());
+	CHECK(flashlog_mount());
+
+	for(uint32_t lba = 0; lba < DISK_SECTOR_COUNT; ++ lba)
+		CHECK(read_matches(lba, committed[lba]));
+}
+
+static void test_power_cut_before_commit()
+{
+	format_log();
+
+	const sector_t first = make_sector(false);
+	const sector_t second = make_sector(true);
+
+	CHECK(write_sector(5, first));
+	CHECK(commit());
+
+	CHECK(write_sector(5, second));
+	CHECK(read_matches(5, second));
+
+	// Power lost before the commit record went out
+	CHECK(flashlog_mount());
+	CHECK(read_matches(5, first));
+	CHECK(!flashlog_has_uncommitted());
+
+	// The abandoned record must not come back with the next commit
+	CHECK(write_sector(6, second));
+	CHECK(commit());
+	CHECK(flashlog_mount());
+	CHECK(read_matches(5, first));
+	CHECK(read_matches(6, second));
+}
+
+static void test_torn_commit_record()
+{
+	for(size_t torn_after = 0; torn_after < sizeof(uint32_t) * 4; torn_after += 3)
+	{
+		format_log();
+
+		const sector_t first = make_sector(true);
+		const sector_t second = make_sector(false);
+
+		CHECK(write_sector(9, first));
+		CHECK(commit());
+
+		CHECK(write_sector(9, second));
+
+		// Only part of the commit record makes it to flash
+		flashsim_cut_power_after(torn_after);
+		flashlog_commit();
+		flashsim_power_on();
+
+		CHECK(flashlog_mount());
+		CHECK(read_matches(9, first));
+
+		// The log keeps working after the torn record
+		CHECK(write_sector(9, second));
+		CHECK(commit());
+		CHECK(flashlog_mount());
+		CHECK(read_matches(9, second));
+	}
+}
+
+static bool is_range_mapped(uint32_t lba, const std::vector<sector_t> &sectors)
+{
+	const uint8_t *start = flashlog_get_sector_address(lba);
+	if(!start)
+		return false;
+
+	for(size_t i = 0; i < sectors.size(); ++ i)
+	{
+		if(flashlog_get_sector_address(lba + i) != start + i * DISK_SECTOR_SIZE || memcmp(start + i * DISK_SECTOR_SIZE, sectors[i].data(), DISK_SECTOR_SIZE) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+// What flashfs_map_file() does with a file that got logged sector by sector, compressed and possibly out of order
+static void test_write_range()
+{
+	format_log();
+
+	const uint32_t lba = 40;
+	std::vector<sector_t> file;
+
+	for(int i = 0; i < 4; ++ i)
+		file.push_back(make_sector(true));
+
+	CHECK(write_sector(7, make_sector(false)));
+
+	for(size_t i = file.size(); i-- > 0;)
+		CHECK(write_sector(lba + i, file[i]));
+
+	CHECK(commit());
+	CHECK(!is_range_mapped(lba, file));
+
+	std::vector<uint8_t> data;
+
+	for(const sector_t &sector : file)
+		data.insert(data.end(), sector.begin(), sector.end());
+
+	const uint8_t *address = flashlog_write_range(lba, file.size(), data.data());
+
+	CHECK(address != nullptr);
+	CHECK(address == flashlog_get_sector_address(lba));
+	CHECK(is_range_mapped(lba, file));
+	CHECK(flashlog_has_uncommitted());
+
+	// Records appended after the run don't land on top of it, before or after a remount
+	const sector_t other = make_sector(false);
+
+	CHECK(write_sector(8, other));
+	CHECK(commit());
+	CHECK(flashlog_mount());
+	CHECK(write_sector(9, other));
+	CHECK(commit());
+
+	CHECK(is_range_mapped(lba, file));
+	CHECK(read_matches(8, other));
+	CHECK(read_matches(9, other));
+
+	// A run that doesn't fit a single block is turned away
+	std::vector<uint8_t> large(8 * DISK_SECTOR_SIZE);
+	CHECK(flashlog_write_range(lba, 8, large.data()) == nullptr);
+	CHECK(is_range_mapped(lba, file));
+}
+
+// Losing power halfway through the run leaves the committed copies in place
+static void test_torn_range()
+{
+	format_log();
+
+	const uint32_t lba = 12;
+	std::vector<sector_t> file;
+	std::vector<uint8_t> data;
+
+	for(int i = 0; i < 3; ++ i)
+	{
+		file.push_back(make_sector(true));
+		data.insert(data.end(), file.back().begin(), file.back().end());
+
+		CHECK(write_sector(lba + i, file.back()));
+	}
+
+	CHECK(commit());
+
+	flashsim_cut_power_after(data.size() + 24);
+	flashlog_write_range(lba, file.size(), data.data());
+	flashsim_power_on();
+
+	CHECK(flashlog_mount());
+
+	for(size_t i = 0; i < file.size(); ++ i)
+		CHECK(read_matches(lba + i, file[i]));
+
+	CHECK(flashlog_write_range(lba, file.size(), data.data()) != nullptr);
+	CHECK(commit());
+	CHECK(flashlog_mount());
+	CHECK(is_range_mapped(lba, file));
+}
+
+int main()
+{
+	RUN_TEST(test_wear_levelling);
+	RUN_TEST(test_write_without_background_gc);
+	RUN_TEST(test_power_cut_before_commit);
+	RUN_TEST(test_torn_commit_record);
+	RUN_TEST(test_write_range);
+	RUN_TEST(test_torn_range);
+
+	return test_result();
+}
@@ -0,0 +1,348 @@
+#include <string>
+#include <tusb.h>
+#include "test.h"
+#include "logic/keylayer.h"
+#include "logic/layerstack.h"
+
+// Keys of the base layer
+constexpr uint8_t key_a = 0;
+constexpr uint8_t key_b = 1;
+constexpr uint8_t key_momentary = 2; // Layer 1
+constexpr uint8_t key_toggle = 3;    // Layer 2
+constexpr uint8_t key_one_shot = 4;  // Layer 3
+constexpr uint8_t key_mod = 5;
+constexpr uint8_t key_c = 6;
+constexpr uint8_t key_d = 7;
+constexpr uint8_t key_e = 8;         // Transparent all the way down
+
+static const char *const s_keymap = R"({
+	"name": "stack",
+	"layers": [
+		{
+			"base": {
+				"0": { "v": "A" }, "1": { "v": "B" },
+				"2": { "t": "layer", "v": 1 }, "3": { "t": "layer", "v": 2, "mode": "toggle" },
+				"4": { "t": "layer", "v": 3, "mode": "oneshot" }, "5": { "t": "mod" },
+				"6": { "v": "C" }, "7": { "v": "D" }, "8": { "t": "transparent" }
+			},
+			"mod": { "0": { "v": "X" }, "1": { "v": "Z" } },
+			"combos": [ { "keys": [ 0, 1 ], "v": "Q" }, { "keys": [ 6, 7 ], "v": "F" } ]
+		},
+		{
+			"name": "momentary",
+			"base": { "0": { "t": "transparent" }, "1": { "v": "1" }, "2": { "t": "transparent" }, "3": { "t": "transparent" },
+				"4": { "t": "transparent" }, "5": { "t": "transparent" }, "6": { "t": "transparent" }, "8": { "t": "transparent" } },
+			"combos": [ { "keys": [ 0, 1 ], "v": "W" } ]
+		},
+		{
+			"name": "toggle",
+			"base": { "0": { "v": "2" }, "1": { "t": "transparent" }, "2": { "t": "transparent" }, "3": { "t": "transparent" },
+				"4": { "t": "transparent" }, "5": { "t": "transparent" }, "6": { "t": "transparent" }, "8": { "t": "transparent" } },
+			"mod": { "0": { "v": "Y" } },
+			"combos": [ { "keys": [ 6, 7 ], "t": "transparent" }, { "keys": [ 7, 8 ], "v": "G" } ]
+		},
+		{
+			"name": "oneshot",
+			"base": { "0": { "t": "transparent" }, "1": { "v": "3" }, "2": { "t": "transparent" }, "3": { "t": "transparent" },
+				"4": { "t": "transparent" }, "5": { "t": "transparent" } }
+		}
+	]
+})";
+
+// Key events go through the stack the way application::update_layer_stack() feeds it, flattening the layers again
+// after every change
+struct fixture_t
+{
+	std::string source = s_keymap;
+	json_t pool[128];
+	keymap_t *map = nullptr;
+
+	layerstack_t stack;
+	resolved_keylayer_t layer;
+	resolved_keylayer_t scratch;
+
+	fixture_t()
+	{
+		const json_t *root = json_create(source.data(), pool, std::size(pool));
+		CHECK(root != nullptr);
+
+		map = root ? parse_keymap(root, nullptr) : nullptr;
+		CHECK(map != nullptr);
+
+		resolve();
+	}
+	~fixture_t()
+	{
+		delete map;
+	}
+
+	void resolve()
+	{
+		if(!map)
+			return;
+
+		uint8_t layers[LAYER_STACK_DEPTH + 1];
+		const size_t count = stack.get_stack(0, layers);
+
+		map->resolve_stack(layers, count, &layer, &scratch);
+	}
+
+	void key(uint8_t key, bool is_press)
+	{
+		const resolved_keylayer_t::entry_t *entry = is_press ? layer.get_entry(key, false) : nullptr;
+
+		if(map && stack.update(key, is_press, entry, map->layers.size()))
+			resolve();
+	}
+	void tap(uint8_t key)
+	{
+		this->key(key, true);
+		this->key(key, false);
+	}
+
+	uint8_t get_keycode(uint8_t key, bool mod = false) const
+	{
+		const keymacro_t macro = layer.get_macros(mod)[key].macro;
+		return (macro.get_type() == keymacro_t::type_t::hid_key) ? macro.get_keycode() : HID_KEY_NONE;
+	}
+	uint8_t get_combo_keycode(uint16_t mask) const
+	{
+		for(size_t i = 0; i < layer.combo_count; ++ i)
+		{
+			if(layer.combos[i].mask == mask)
+				return layer.combos[i].entry.macro.get_keycode();
+		}
+
+		return HID_KEY_NONE;
+	}
+};
+
+static void test_transparent_keys()
+{
+	fixture_t fixture;
+
+	CHECK_EQUAL(fixture.get_keycode(key_a), HID_KEY_A);
+	CHECK_EQUAL(fixture.layer.macros[key_e].macro.get_type(), keymacro_t::type_t::none);
+
+	fixture.key(key_momentary, true);
+
+	CHECK_EQUAL(fixture.stack.get_depth(), 1);
+	CHECK_EQUAL(fixture.get_keycode(key_a), HID_KEY_A);
+	CHECK_EQUAL(fixture.get_keycode(key_b), HID_KEY_1);
+
+	// Falls through two layers, down to the page
+	fixture.key(key_momentary, false);
+	fixture.tap(key_toggle);
+	fixture.key(key_momentary, true);
+
+	CHECK_EQUAL(fixture.stack.get_depth(), 2);
+	CHECK_EQUAL(fixture.get_keycode(key_a), HID_KEY_2);
+	CHECK_EQUAL(fixture.get_keycode(key_b), HID_KEY_1);
+	CHECK_EQUAL(fixture.get_keycode(key_c), HID_KEY_C);
+
+	// Still transparent at the bottom, it does nothing
+	CHECK_EQUAL(fixture.layer.macros[key_e].macro.get_type(), keymacro_t::type_t::none);
+
+	fixture.key(key_momentary, false);
+
+	CHECK_EQUAL(fixture.get_keycode(key_b), HID_KEY_B);
+}
+
+static void test_mod_blocks()
+{
+	fixture_t fixture;
+
+	// No mod block on the layer, the mod keys of the page stay
+	fixture.key(key_momentary, true);
+
+	CHECK(fixture.layer.has_mod);
+	CHECK_EQUAL(fixture.get_keycode(key_a, true), HID_KEY_X);
+	CHECK_EQUAL(fixture.get_keycode(key_b, true), HID_KEY_Z);
+
+	fixture.key(key_momentary, false);
+	fixture.tap(key_toggle);
+
+	CHECK_EQUAL(fixture.get_keycode(key_a, true), HID_KEY_Y);
+	CHECK_EQUAL(fixture.get_keycode(key_a), HID_KEY_2);
+}
+
+static void test_combos()
+{
+	fixture_t fixture;
+
+	CHECK_EQUAL(fixture.layer.combo_count, 2);
+	CHECK_EQUAL(fixture.get_combo_keycode(0b11), HID_KEY_Q);
+
+	// Same keys replace the combo below, new ones are added and transparent ones leave it alone
+	fixture.tap(key_toggle);
+
+	CHECK_EQUAL(fixture.layer.combo_count, 3);
+	CHECK_EQUAL(fixture.get_combo_keycode(0b11), HID_KEY_Q);
+	CHECK_EQUAL(fixture.get_combo_keycode(0b11000000), HID_KEY_F);
+	CHECK_EQUAL(fixture.get_combo_keycode(0b110000000), HID_KEY_G);
+
+	fixture.key(key_momentary, true);
+
+	CHECK_EQUAL(fixture.layer.combo_count, 3);
+	CHECK_EQUAL(fixture.get_combo_keycode(0b11), HID_KEY_W);
+
+	fixture.key(key_momentary, false);
+
+	CHECK_EQUAL(fixture.get_combo_keycode(0b11), HID_KEY_Q);
+}
+
+static void test_toggle()
+{
+	fixture_t fixture;
+
+	fixture.tap(key_toggle);
+	CHECK_EQUAL(fixture.stack.get_depth(), 1);
+
+	// A momentary layer on top goes away on its own
+	fixture.key(key_momentary, true);
+	CHECK_EQUAL(fixture.stack.get_depth(), 2);
+
+	fixture.key(key_momentary, false);
+	CHECK_EQUAL(fixture.stack.get_depth(), 1);
+	CHECK_EQUAL(fixture.get_keycode(key_a), HID_KEY_2);
+
+	// The toggle key is transparent on its layer, pressing it again takes the layer off
+	fixture.tap(key_toggle);
+	CHECK_EQUAL(fixture.stack.get_depth(), 0);
+	CHECK_EQUAL(fixture.get_keycode(key_a), HID_KEY_A);
+
+	// Layers the keymap doesn't have are ignored
+	resolved_keylayer_t::entry_t missing = {};
+	missing.macro = keymacro_t::make(keymacro_t::type_t::layer, 9);
+
+	CHECK(!fixture.stack.update(key_a, true, &missing, fixture.map->layers.size()));
+	CHECK_EQUAL(fixture.stack.get_depth(), 0);
+}
+
+static void test_one_shot()
+{
+	fixture_t fixture;
+
+	fixture.tap(key_one_shot);
+
+	CHECK_EQUAL(fixture.stack.get_depth(), 1);
+	CHECK_EQUAL(fixture.get_keycode(key_b), HID_KEY_3);
+
+	// Mod keys don't use it up
+	fixture.tap(key_mod);
+	CHECK_EQUAL(fixture.stack.get_depth(), 1);
+
+	// The next key does, the layer stays until it's released
+	fixture.key(key_b, true);
+
+	CHECK_EQUAL(fixture.stack.get_depth(), 1);
+	CHECK_EQUAL(fixture.stack.get_layer(0).key, key_b);
+
+	fixture.key(key_a, true);
+	fixture.key(key_a, false);
+	CHECK_EQUAL(fixture.stack.get_depth(), 1);
+
+	fixture.key(key_b, false);
+
+	CHECK_EQUAL(fixture.stack.get_depth(), 0);
+	CHECK_EQUAL(fixture.get_keycode(key_b), HID_KEY_B);
+
+	// Pressed twice while waiting, it comes off again
+	fixture.tap(key_one_shot);
+	fixture.tap(key_one_shot);
+	CHECK_EQUAL(fixture.stack.get_depth(), 0);
+}
+
+static void test_release_keys()
+{
+	fixture_t fixture;
+
+	fixture.tap(key_toggle);
+	fixture.key(key_momentary, true);
+	fixture.tap(key_one_shot);
+
+	CHECK_EQUAL(fixture.stack.get_depth(), 3);
+
+	// What application::discard_key_events() does, only the momentary layer went with its key
+	CHECK(fixture.stack.release_keys());
+	CHECK_EQUAL(fixture.stack.get_depth(), 2);
+	CHECK_EQUAL(fixture.stack.get_layer(0).layer, 2);
+	CHECK_EQUAL(fixture.stack.get_layer(1).layer, 3);
+	CHECK(!fixture.stack.release_keys());
+
+	// Full, further layers are ignored
+	fixture.stack.clear();
+
+	for(size_t i = 0; i < LAYER_STACK_DEPTH + 2; ++ i)
+		fixture.key(key_momentary, true);
+
+	CHECK_EQUAL(fixture.stack.get_depth(), LAYER_STACK_DEPTH);
+
+	fixture.key(key_momentary, false);
+	CHECK_EQUAL(fixture.stack.get_depth(), 0);
+}
+
+static void test_empty_layer()
+{
+	// The layer without keys keeps its slot, so the layer key and the "inherit" index still find the layer after it
+	std::string source = R"({
+		"name": "gap",
+		"layers": [
+			{ "base": { "0": { "t": "layer", "v": 2 }, "1": { "v": "A" } } },
+			{ "name": "empty" },
+			{ "name": "target", "base": { "0": { "t": "transparent" }, "1": { "v": "X" } } },
+			{ "inherit": 2, "base": { "0": { "v": "Y" } } }
+		]
+	})";
+
+	json_t pool[64];
+	const json_t *root = json_create(source.data(), pool, std::size(pool));
+	CHECK(root != nullptr);
+
+	keymap_t *map = root ? parse_keymap(root, nullptr) : nullptr;
+	CHECK(map != nullptr);
+
+	if(!map)
+		return;
+
+	CHECK_EQUAL(map->layers.size(), 4);
+
+	resolved_keylayer_t layer;
+	resolved_keylayer_t scratch;
+	map->resolve_layer(0, &layer);
+
+	layerstack_t stack;
+	CHECK(stack.update(key_a, true, layer.get_entry(key_a, false), map->layers.size()));
+
+	uint8_t layers[LAYER_STACK_DEPTH + 1];
+	map->resolve_stack(layers, stack.get_stack(0, layers), &layer, &scratch);
+
+	CHECK_EQUAL(layer.macros[key_b].macro.get_keycode(), HID_KEY_X);
+
+	map->resolve_layer(3, &layer);
+
+	CHECK_EQUAL(layer.macros[key_a].macro.get_keycode(), HID_KEY_Y);
+	CHECK_EQUAL(layer.macros[key_b].macro.get_keycode(), HID_KEY_X);
+
+	delete map;
+
+	// Nothing but empty layers is still no keymap
+	std::string empty = R"({ "name": "empty", "layers": [ {}, {} ] })";
+	root = json_create(empty.data(), pool, std::size(pool));
+
+	CHECK(root != nullptr);
+	CHECK(!root || !parse_keymap(root, nullptr));
+}
+
+int main()
+{
+	RUN_TEST(test_transparent_keys);
+	RUN_TEST(test_mod_blocks);
+	RUN_TEST(test_combos);
+	RUN_TEST(test_toggle);
+	RUN_TEST(test_one_shot);
+	RUN_TEST(test_release_keys);
+	RUN_TEST(test_empty_layer);
+
+	return test_result();
+}
@@ -0,0 +1,286 @@
+#include <cstring>
+#include <string>
+#include <vector>
+#include <tusb.h>
+#include "test.h"
+#include "logic/keylayer.h"
+#include "logic/sequenceplayer.h"
+
+struct sent_t
+{
+	uint32_t time_ms;
+	uint8_t modifier;
+	uint8_t keycode;
+	uint8_t keycode2;
+};
+
+// Compiles a single "macro" key with the given steps and returns its bytecode, end op included
+static std::vector<uint8_t> compile(const std::string &steps)
+{
+	std::string source = "{\"name\":\"sequence\",\"layers\":[{\"base\":[{\"t\":\"macro\",\"v\":" + steps + "}]}]}";
+
+	json_t pool[64];
+	const json_t *root = json_create(source.data(), pool, std::size(pool));
+	CHECK(root != nullptr);
+
+	std::vector<uint8_t> code;
+
+	keymap_t *map = root ? parse_keymap(root, nullptr) : nullptr;
+	CHECK(map != nullptr);
+
+	if(!map)
+		return code;
+
+	resolved_keylayer_t layer;
+	map->resolve_layer(0, &layer);
+
+	const uint8_t *sequence = layer.macros[0].get_sequence();
+	CHECK(sequence != nullptr);
+
+	if(sequence)
+		code.assign(sequence, (const uint8_t *)map->bytecode.data() + map->bytecode.size());
+
+	delete map;
+	return code;
+}
+
+// Drives the player the way application::send_keyboard_report() does once per tick: only changes go out, and only
+// while the endpoint is ready, which it is again poll_ms after a report was queued. A queued report counts as sent
+struct host_t
+{
+	sequenceplayer_t player;
+	uint32_t poll_ms;
+	uint32_t now_ms = 0;
+	uint32_t ready_ms = 0;
+
+	hid_keyboard_report_t last = {};
+	std::vector<sent_t> reports;
+
+	explicit host_t(uint32_t poll_ms) : poll_ms(poll_ms) {}
+
+	void tick()
+	{
+		while(true)
+		{
+			const bool has_advanced = player.advance(now_ms * 1000ull);
+			const hid_keyboard_report_t &report = player.get_report();
+
+			if(now_ms < ready_ms)
+				break;
+
+			if(memcmp(&report, &last, sizeof(report)) == 0)
+			{
+				player.mark_sent();
+
+				if(has_advanced)
+					continue;
+
+				break;
+			}
+
+			reports.push_back({ now_ms, report.modifier, report.keycode[0], report.keycode[1] });
+
+			last = report;
+			ready_ms = now_ms + poll_ms;
+			player.mark_sent();
+
+			break;
+		}
+
+		now_ms ++;
+	}
+	void run(uint32_t duration_ms)
+	{
+		const uint32_t end_ms = now_ms + duration_ms;
+
+		while(now_ms < end_ms)
+			tick();
+	}
+};
+
+static void test_compile()
+{
+	const std::vector<uint8_t> code = compile(R"(["A", { "press": "B", "m": "lshft" }, { "delay": 300 }, { "release": "B", "m": "lshft" }, { "tap": "C" }])");
+
+	const uint8_t expected[] = {
+		(uint8_t)sequenceop_t::tap, HID_KEY_A, 0,
+		(uint8_t)sequenceop_t::press, HID_KEY_B, KEYBOARD_MODIFIER_LEFTSHIFT,
+		(uint8_t)sequenceop_t::delay, 300 & 0xff, 300 >> 8,
+		(uint8_t)sequenceop_t::release, HID_KEY_B, KEYBOARD_MODIFIER_LEFTSHIFT,
+		(uint8_t)sequenceop_t::tap, HID_KEY_C, 0,
+		(uint8_t)sequenceop_t::end };
+
+	CHECK_EQUAL(code.size(), std::size(expected));
+
+	for(size_t i = 0; i < std::min(code.size(), std::size(expected)); ++ i)
+		CHECK_EQUAL(code[i], expected[i]);
+
+	// Delays past 16 bits are clamped
+	const std::vector<uint8_t> long_delay = compile(R"([{ "delay": 100000 }])");
+
+	CHECK_EQUAL(long_delay.size(), 4);
+
+	if(long_delay.size() == 4)
+	{
+		CHECK_EQUAL(long_delay[1], 0xff);
+		CHECK_EQUAL(long_delay[2], 0xff);
+	}
+}
+
+static void test_key_ops()
+{
+	const std::vector<uint8_t> code = compile(R"(["A", { "press": "B", "m": "lshft" }, { "press": "C" }, { "release": "B", "m": "lshft" }, { "release": "C" }])");
+	host_t host(1);
+
+	host.player.start(code.data());
+	host.run(50);
+
+	// Taps go out as a press and a release, held keys stay packed at the front of the report
+	const sent_t expected[] = {
+		{ 0, 0, HID_KEY_A, HID_KEY_NONE },
+		{ 1, 0, HID_KEY_NONE, HID_KEY_NONE },
+		{ 2, KEYBOARD_MODIFIER_LEFTSHIFT, HID_KEY_B, HID_KEY_NONE },
+		{ 3, KEYBOARD_MODIFIER_LEFTSHIFT, HID_KEY_B, HID_KEY_C },
+		{ 4, 0, HID_KEY_C, HID_KEY_NONE },
+		{ 5, 0, HID_KEY_NONE, HID_KEY_NONE } };
+
+	CHECK_EQUAL(host.reports.size(), std::size(expected));
+
+	for(size_t i = 0; i < std::min(host.reports.size(), std::size(expected)); ++ i)
+	{
+		CHECK_EQUAL(host.reports[i].time_ms, expected[i].time_ms);
+		CHECK_EQUAL(host.reports[i].modifier, expected[i].modifier);
+		CHECK_EQUAL(host.reports[i].keycode, expected[i].keycode);
+		CHECK_EQUAL(host.reports[i].keycode2, expected[i].keycode2);
+	}
+
+	CHECK(!host.player.is_playing());
+}
+
+static void test_delay_pacing()
+{
+	const std::vector<uint8_t> code = compile(R"([{ "press": "A" }, { "delay": 100 }, { "release": "A" }, "B"])");
+
+	// Reports never go out faster than the host takes them, and the delay starts the tick after the press was
+	// queued whatever the host's pace, as long as it's shorter than the delay
+	for(const uint32_t poll_ms : { 1u, 8u, 32u })
+	{
+		host_t host(poll_ms);
+
+		host.player.start(code.data());
+		host.run(400);
+
+		CHECK_EQUAL(host.reports.size(), 4);
+
+		if(host.reports.size() != 4)
+			continue;
+
+		CHECK_EQUAL(host.reports[0].keycode, HID_KEY_A);
+		CHECK_EQUAL(host.reports[1].keycode, HID_KEY_NONE);
+		CHECK_EQUAL(host.reports[1].time_ms - host.reports[0].time_ms, 100 + 1);
+		CHECK_EQUAL(host.reports[2].keycode, HID_KEY_B);
+		CHECK_EQUAL(host.reports[2].time_ms - host.reports[1].time_ms, poll_ms);
+		CHECK_EQUAL(host.reports[3].keycode, HID_KEY_NONE);
+		CHECK_EQUAL(host.reports[3].time_ms - host.reports[2].time_ms, poll_ms);
+
+		CHECK(!host.player.is_playing());
+	}
+}
+
+static void test_end()
+{
+	// Keys still held when the bytecode ends are released along with it
+	const std::vector<uint8_t> code = compile(R"([{ "press": "A", "m": "lctrl" }, { "press": "B" }])");
+	host_t host(1);
+
+	host.player.start(code.data());
+	host.run(20);
+
+	CHECK_EQUAL(host.reports.size(), 3);
+	CHECK(!host.player.is_playing());
+
+	if(host.reports.size() == 3)
+	{
+		CHECK_EQUAL(host.reports[1].modifier, KEYBOARD_MODIFIER_LEFTCTRL);
+		CHECK_EQUAL(host.reports[1].keycode2, HID_KEY_B);
+		CHECK_EQUAL(host.reports[2].modifier, 0);
+		CHECK_EQUAL(host.reports[2].keycode, HID_KEY_NONE);
+	}
+
+	// Nothing held, the end doesn't add a report of its own
+	const std::vector<uint8_t> taps = compile(R"(["A"])");
+	host_t tap_host(1);
+
+	tap_host.player.start(taps.data());
+	tap_host.run(20);
+
+	CHECK_EQUAL(tap_host.reports.size(), 2);
+	CHECK(!tap_host.player.is_playing());
+
+	// An empty sequence ends right away
+	const std::vector<uint8_t> empty = compile("[]");
+	host_t empty_host(1);
+
+	empty_host.player.start(empty.data());
+	empty_host.run(20);
+
+	CHECK(empty_host.reports.empty());
+	CHECK(!empty_host.player.is_playing());
+}
+
+static void test_stop()
+{
+	const std::vector<uint8_t> code = compile(R"([{ "press": "A", "m": "lalt" }, { "delay": 1000 }, "B"])");
+	host_t host(1);
+
+	host.player.start(code.data());
+	host.run(50);
+
+	CHECK_EQUAL(host.reports.size(), 1);
+
+	// Stopped in the middle of the delay, whatever it holds is released and nothing else follows
+	host.player.stop();
+	host.run(2000);
+
+	CHECK(!host.player.is_playing());
+	CHECK_EQUAL(host.reports.size(), 2);
+
+	if(host.reports.size() == 2)
+	{
+		CHECK_EQUAL(host.reports[1].modifier, 0);
+		CHECK_EQUAL(host.reports[1].keycode, HID_KEY_NONE);
+	}
+
+	// Restarting while playing does the same before starting over
+	host.player.start(code.data());
+	host.run(50);
+	host.player.start(code.data());
+	host.run(50);
+
+	CHECK_EQUAL(host.reports.size(), 5);
+
+	if(host.reports.size() == 5)
+	{
+		CHECK_EQUAL(host.reports[3].keycode, HID_KEY_NONE);
+		CHECK_EQUAL(host.reports[4].keycode, HID_KEY_A);
+	}
+
+	// Nothing held, nothing to send
+	host_t idle(1);
+
+	idle.player.stop();
+	idle.run(10);
+
+	CHECK(idle.reports.empty());
+}
+
+int main()
+{
+	RUN_TEST(test_compile);
+	RUN_TEST(test_key_ops);
+	RUN_TEST(test_delay_pacing);
+	RUN_TEST(test_end);
+	RUN_TEST(test_stop);
+
+	return test_result();
+}
@@ -0,0 +1,124 @@
+#include <pico/time.h>
+#include "test.h"
+#include "flashsim.h"
+#include "logic/settings.h"
+
+constexpr uint32_t page_key = 1000; // Evictable values from here on, like the per keymap pages
+
+static void flush()
+{
+	host_time_us += SETTINGS_IDLE_WRITE_MS * 1000ull;
+	settings_task();
+}
+
+static bool has_value(uint32_t key, uint32_t expected)
+{
+	uint32_t value;
+	return settings_get(key, &value) && value == expected;
+}
+
+static void test_persist()
+{
+	flashsim_reset();
+	settings_init();
+
+	settings_set(1, 10);
+	settings_set(2, 20);
+	CHECK(has_value(1, 10));
+
+	// Nothing goes out while values keep changing
+	host_time_us += (SETTINGS_IDLE_WRITE_MS - 1) * 1000ull;
+	settings_task();
+	CHECK_EQUAL(flashsim_get_programmed_bytes(), 0);
+
+	flush();
+	settings_init();
+
+	CHECK(has_value(1, 10));
+	CHECK(has_value(2, 20));
+	CHECK(!has_value(3, 0));
+
+	// Rewritten often enough to go through several compactions, the latest value wins
+	for(uint32_t i = 0; i < 600; ++ i)
+	{
+		settings_set(1, i);
+		flush();
+	}
+
+	settings_init();
+
+	CHECK(has_value(1, 599));
+	CHECK(has_value(2, 20));
+}
+
+static void test_eviction()
+{
+	flashsim_reset();
+	settings_init();
+
+	settings_set(1, 10);
+
+	for(uint32_t i = 0; i < SETTINGS_MAX_ENTRIES - 1; ++ i)
+		settings_set(page_key + i, i, true);
+
+	// The first page was written again, the second one is now the least recently written
+	settings_set(page_key, 100, true);
+	settings_set(page_key + SETTINGS_MAX_ENTRIES, 0, true);
+
+	CHECK(has_value(1, 10));
+	CHECK(has_value(page_key, 100));
+	CHECK(!has_value(page_key + 1, 1));
+	CHECK(has_value(page_key + 2, 2));
+	CHECK(has_value(page_key + SETTINGS_MAX_ENTRIES, 0));
+
+	// The order survives the journal being replayed
+	flush();
+	settings_init();
+
+	settings_set(page_key + SETTINGS_MAX_ENTRIES + 1, 0, true);
+
+	CHECK(has_value(page_key, 100));
+	CHECK(!has_value(page_key + 2, 2));
+	CHECK(has_value(page_key + 3, 3));
+
+	// And compaction
+	for(uint32_t i = 0; i < 300; ++ i)
+	{
+		settings_set(1, i);
+		flush();
+	}
+
+	settings_init();
+	settings_set(page_key + SETTINGS_MAX_ENTRIES + 2, 0, true);
+
+	CHECK(has_value(1, 299));
+	CHECK(has_value(page_key, 100));
+	CHECK(!has_value(page_key + 3, 3));
+	CHECK(has_value(page_key + 4, 4));
+}
+
+static void test_full()
+{
+	flashsim_reset();
+	settings_init();
+
+	for(uint32_t i = 0; i < SETTINGS_MAX_ENTRIES; ++ i)
+		settings_set(i + 1, i);
+
+	// Nothing to evict, the new value is turned away but the existing ones can still change
+	settings_set(page_key, 0, true);
+	settings_set(1, 100);
+
+	CHECK(!has_value(page_key, 0));
+	CHECK(has_value(1, 100));
+	CHECK(has_value(SETTINGS_MAX_ENTRIES, SETTINGS_MAX_ENTRIES - 1));
+}
+
+int main()
+{
+	RUN_TEST(test_persist);
+	RUN_TEST(test_eviction);
+	RUN_TEST(test_full);
+
+	return test_result();
+}
@@ -0,0 +1,210 @@
+#include <initializer_list>
+#include <tusb.h>
+#include "test.h"
+#include "logic/tapholdresolver.h"
+
+constexpr uint8_t key_a = 0; // The tap-hold key in every test
+constexpr uint8_t key_b = 1;
+constexpr uint16_t term_ms = 200;
+
+struct expected_t
+{
+	uint8_t key;
+	bool is_press;
+	keyrole_t role;
+};
+
+static taphold_t make_tap_hold(uint8_t flags)
+{
+	taphold_t tap_hold = {};
+	tap_hold.keycode = HID_KEY_A;
+	tap_hold.hold_modifier = KEYBOARD_MODIFIER_LEFTCTRL;
+	tap_hold.term_ms = term_ms;
+	tap_hold.flags = flags;
+
+	return tap_hold;
+}
+
+static void push(tapholdresolver_t &resolver, uint32_t time_ms, uint8_t key, bool is_press, const taphold_t *tap_hold = nullptr)
+{
+	keyevent_t event = {};
+	event.time_us = time_ms * 1000ull;
+	event.key = key;
+	event.is_press = is_press;
+
+	resolver.push(event, is_press ? tap_hold : nullptr);
+}
+
+// Everything that came out since the last call, in order
+static void check_output(tapholdresolver_t &resolver, std::initializer_list<expected_t> expected)
+{
+	keyevent_t event;
+
+	for(const expected_t &next : expected)
+	{
+		if(!resolver.pop(&event))
+		{
+			CHECK(!"fewer events than expected");
+			return;
+		}
+
+		CHECK_EQUAL(event.key, next.key);
+		CHECK_EQUAL(event.is_press, next.is_press);
+		CHECK_EQUAL(event.role, next.role);
+	}
+
+	CHECK(!resolver.pop(&event));
+}
+
+static void test_tap()
+{
+	const taphold_t tap_hold = make_tap_hold(0);
+	tapholdresolver_t resolver;
+
+	push(resolver, 0, key_a, true, &tap_hold);
+	resolver.update(50 * 1000);
+
+	check_output(resolver, {});
+	CHECK(!resolver.is_idle());
+
+	push(resolver, 80, key_a, false);
+
+	check_output(resolver, {
+		{ key_a, true, keyrole_t::tap },
+		{ key_a, false, keyrole_t::tap } });
+	CHECK(resolver.is_idle());
+}
+
+static void test_hold_past_term()
+{
+	const taphold_t tap_hold = make_tap_hold(0);
+	tapholdresolver_t resolver;
+
+	push(resolver, 0, key_a, true, &tap_hold);
+	resolver.update((term_ms - 1) * 1000);
+
+	check_output(resolver, {});
+
+	resolver.update(term_ms * 1000);
+
+	check_output(resolver, { { key_a, true, keyrole_t::hold } });
+
+	push(resolver, 500, key_a, false);
+
+	check_output(resolver, { { key_a, false, keyrole_t::hold } });
+	CHECK(resolver.is_idle());
+}
+
+// Another key tapped while the tap-hold key is down, all within the term
+static void test_nested_tap(uint8_t flags, keyrole_t role)
+{
+	const taphold_t tap_hold = make_tap_hold(flags);
+	tapholdresolver_t resolver;
+
+	push(resolver, 0, key_a, true, &tap_hold);
+	push(resolver, 20, key_b, true);
+	push(resolver, 60, key_b, false);
+	push(resolver, 100, key_a, false);
+
+	check_output(resolver, {
+		{ key_a, true, role },
+		{ key_b, true, keyrole_t::normal },
+		{ key_b, false, keyrole_t::normal },
+		{ key_a, false, role } });
+}
+
+static void test_permissive_hold()
+{
+	test_nested_tap(0, keyrole_t::tap);
+	test_nested_tap(taphold_t::permissive_hold, keyrole_t::hold);
+
+	// The other key still being down when the tap-hold key comes up isn't enough
+	const taphold_t tap_hold = make_tap_hold(taphold_t::permissive_hold);
+	tapholdresolver_t resolver;
+
+	push(resolver, 0, key_a, true, &tap_hold);
+	push(resolver, 20, key_b, true);
+
+	check_output(resolver, {});
+
+	push(resolver, 60, key_a, false);
+	push(resolver, 100, key_b, false);
+
+	check_output(resolver, {
+		{ key_a, true, keyrole_t::tap },
+		{ key_b, true, keyrole_t::normal },
+		{ key_a, false, keyrole_t::tap },
+		{ key_b, false, keyrole_t::normal } });
+}
+
+static void test_hold_on_other_key()
+{
+	test_nested_tap(taphold_t::hold_on_other_key, keyrole_t::hold);
+
+	// Decided by the press alone, nothing waits for the release
+	const taphold_t tap_hold = make_tap_hold(taphold_t::hold_on_other_key);
+	tapholdresolver_t resolver;
+
+	push(resolver, 0, key_a, true, &tap_hold);
+	push(resolver, 20, key_b, true);
+
+	check_output(resolver, {
+		{ key_a, true, keyrole_t::hold },
+		{ key_b, true, keyrole_t::normal } });
+}
+
+// A down, B down, A up, B up: typing fast across the tap-hold key has to come out as two plain taps, in order,
+// unless hold_on_other_key asks for anything pressed meanwhile to count
+static void test_rolled_keys(uint8_t flags, keyrole_t role)
+{
+	const taphold_t tap_hold = make_tap_hold(flags);
+	tapholdresolver_t resolver;
+
+	push(resolver, 0, key_a, true, &tap_hold);
+	push(resolver, 30, key_b, true);
+	push(resolver, 50, key_a, false);
+	push(resolver, 90, key_b, false);
+	resolver.update(400 * 1000);
+
+	check_output(resolver, {
+		{ key_a, true, role },
+		{ key_b, true, keyrole_t::normal },
+		{ key_a, false, role },
+		{ key_b, false, keyrole_t::normal } });
+	CHECK(resolver.is_idle());
+}
+
+static void test_rolled_keys()
+{
+	test_rolled_keys(0, keyrole_t::tap);
+	test_rolled_keys(taphold_t::permissive_hold, keyrole_t::tap);
+	test_rolled_keys(taphold_t::hold_on_other_key, keyrole_t::hold);
+
+	// The other way round the tap-hold key comes second and the first one passes straight through
+	const taphold_t tap_hold = make_tap_hold(taphold_t::permissive_hold);
+	tapholdresolver_t resolver;
+
+	push(resolver, 0, key_b, true);
+	push(resolver, 10, key_a, true, &tap_hold);
+
+	check_output(resolver, { { key_b, true, keyrole_t::normal } });
+
+	push(resolver, 30, key_b, false);
+	push(resolver, 60, key_a, false);
+
+	check_output(resolver, {
+		{ key_a, true, keyrole_t::tap },
+		{ key_b, false, keyrole_t::normal },
+		{ key_a, false, keyrole_t::tap } });
+}
+
+int main()
+{
+	RUN_TEST(test_tap);
+	RUN_TEST(test_hold_past_term);
+	RUN_TEST(test_permissive_hold);
+	RUN_TEST(test_hold_on_other_key);
+	RUN_TEST(test_rolled_keys);
+
+	return test_result();
+}
@@ -0,0 +1,180 @@
+#include <cstring>
+#include <string>
+#include <vector>
+#include <tusb.h>
+#include "test.h"
+#include "logic/keylayer.h"
+
+struct report_t
+{
+	uint8_t modifier;
+	uint8_t keycode;
+};
+
+// Parses a keymap with a single "type" key and returns the reports its type ops hold, checking the op layout on
+// the way. Counts are little endian
+static std::vector<report_t> parse_typed_text(const std::string &text, size_t *op_count = nullptr)
+{
+	std::string source = "{\"name\":\"typing\",\"layers\":[{\"base\":[{\"t\":\"type\",\"v\":\"" + text + "\"}]}]}";
+
+	json_t pool[32];
+	const json_t *root = json_create(source.data(), pool, std::size(pool));
+	CHECK(root != nullptr);
+
+	std::vector<report_t> reports;
+
+	keymap_t *map = root ? parse_keymap(root, nullptr) : nullptr;
+	CHECK(map != nullptr);
+
+	if(!map)
+		return reports;
+
+	resolved_keylayer_t layer;
+	map->resolve_layer(0, &layer);
+
+	const uint8_t *code = layer.macros[0].get_sequence();
+	const uint8_t *code_end = map->bytecode.data() + map->bytecode.size();
+	CHECK(code != nullptr);
+
+	size_t ops = 0;
+
+	while(code && *code == (uint8_t)sequenceop_t::type)
+	{
+		const uint16_t count = code[1] | (code[2] << 8);
+		CHECK(count > 0);
+
+		// There's at least the end op left after the reports
+		if(code + 3 + count * 2 >= code_end)
+		{
+			CHECK(code + 3 + count * 2 < code_end);
+			code = nullptr;
+			break;
+		}
+
+		for(uint16_t i = 0; i < count; ++ i)
+			reports.push_back({ code[3 + i * 2], code[4 + i * 2] });
+
+		code += 3 + count * 2;
+		ops ++;
+	}
+
+	CHECK(code && *code == (uint8_t)sequenceop_t::end);
+
+	if(op_count)
+		*op_count = ops;
+
+	delete map;
+	return reports;
+}
+
+// A key only registers again after a release, and typing always ends with everything released
+static void check_well_formed(const std::vector<report_t> &reports)
+{
+	CHECK(!reports.empty());
+
+	for(size_t i = 1; i < reports.size(); ++ i)
+		CHECK(reports[i].keycode == HID_KEY_NONE || reports[i].keycode != reports[i - 1].keycode);
+
+	if(!reports.empty())
+	{
+		CHECK_EQUAL(reports.back().modifier, 0);
+		CHECK_EQUAL(reports.back().keycode, HID_KEY_NONE);
+	}
+}
+
+static void test_repeated_letters()
+{
+	const std::vector<report_t> reports = parse_typed_text("aardvark");
+
+	// Eight letters, a release between the two a's and the final release
+	CHECK_EQUAL(reports.size(), 10);
+	check_well_formed(reports);
+
+	const uint8_t expected[] = { HID_KEY_A, HID_KEY_NONE, HID_KEY_A, HID_KEY_R, HID_KEY_D, HID_KEY_V, HID_KEY_A, HID_KEY_R, HID_KEY_K, HID_KEY_NONE };
+
+	for(size_t i = 0; i < std::min(reports.size(), std::size(expected)); ++ i)
+	{
+		CHECK_EQUAL(reports[i].keycode, expected[i]);
+		CHECK_EQUAL(reports[i].modifier, 0);
+	}
+}
+
+static void test_shift_changes()
+{
+	const std::vector<report_t> reports = parse_typed_text("aBcD");
+
+	CHECK_EQUAL(reports.size(), 5);
+	check_well_formed(reports);
+
+	const uint8_t modifiers[] = { 0, KEYBOARD_MODIFIER_LEFTSHIFT, 0, KEYBOARD_MODIFIER_LEFTSHIFT, 0 };
+	const uint8_t keycodes[] = { HID_KEY_A, HID_KEY_B, HID_KEY_C, HID_KEY_D, HID_KEY_NONE };
+
+	for(size_t i = 0; i < std::min(reports.size(), std::size(keycodes)); ++ i)
+	{
+		CHECK_EQUAL(reports[i].modifier, modifiers[i]);
+		CHECK_EQUAL(reports[i].keycode, keycodes[i]);
+	}
+
+	// Same key, only the shift state differs, which still needs the release in between
+	const std::vector<report_t> same_key = parse_typed_text("aA");
+
+	CHECK_EQUAL(same_key.size(), 4);
+	check_well_formed(same_key);
+
+	if(same_key.size() == 4)
+	{
+		CHECK_EQUAL(same_key[1].keycode, HID_KEY_NONE);
+		CHECK_EQUAL(same_key[2].modifier, KEYBOARD_MODIFIER_LEFTSHIFT);
+		CHECK_EQUAL(same_key[2].keycode, HID_KEY_A);
+	}
+}
+
+static void test_unmapped_characters()
+{
+	// Outside of ASCII, skipped without breaking up the rest. The dash is folded into a plain one
+	const std::vector<report_t> reports = parse_typed_text("a\xc3\xa9" "b\xe2\x82\xac\xe2\x80\x94");
+
+	CHECK_EQUAL(reports.size(), 4);
+	check_well_formed(reports);
+
+	const uint8_t keycodes[] = { HID_KEY_A, HID_KEY_B, HID_KEY_MINUS, HID_KEY_NONE };
+
+	for(size_t i = 0; i < std::min(reports.size(), std::size(keycodes)); ++ i)
+		CHECK_EQUAL(reports[i].keycode, keycodes[i]);
+
+	// Nothing typeable leaves an empty sequence rather than a lone release
+	size_t ops = 0;
+	parse_typed_text("\xc3\xa9\xc3\xa9", &ops);
+
+	CHECK_EQUAL(ops, 0);
+}
+
+static void test_count_byte_order()
+{
+	// 300 letters and the final release, more than the low byte holds. A count written the other way round reads
+	// back as 0x2d01, past the end of the bytecode
+	std::string text;
+
+	for(size_t i = 0; i < 150; ++ i)
+		text += "ab";
+
+	size_t ops = 0;
+	const std::vector<report_t> reports = parse_typed_text(text, &ops);
+
+	CHECK_EQUAL(ops, 1);
+	CHECK_EQUAL(reports.size(), 301);
+	check_well_formed(reports);
+
+	for(size_t i = 0; i + 1 < reports.size(); ++ i)
+		CHECK_EQUAL(reports[i].keycode, (i % 2 == 0) ? HID_KEY_A : HID_KEY_B);
+}
+
+int main()
+{
+	RUN_TEST(test_repeated_letters);
+	RUN_TEST(test_shift_changes);
+	RUN_TEST(test_unmapped_characters);
+	RUN_TEST(test_count_byte_order);
+
+	return test_result();
+}
@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+# Pushes keymaps to the macropad and switches between them over its raw HID configuration channel
+
+import argparse
+import json
+import os
+import sys
+import time
+
+from macropad_hid import Channel, ChannelError, PROTOCOL_VERSION, find_device
+
+
+def load_keymaps(path):
+	# Either a single keymap object, or a whole config.json worth of them
+	with open(path, encoding="utf-8") as file:
+		config = json.load(file)
+
+	if isinstance(config, dict):
+		config = [config]
+
+	# Non-ASCII text stays as it is, Channel.push() sends it UTF-8 encoded like config.json has it
+	return [json.dumps(keymap, separators=(",", ":"), ensure_ascii=False) for keymap in config if isinstance(keymap, dict)]
+
+
+def push_file(channel, path, persist):
+	keymaps = load_keymaps(path)
+	start = time.monotonic()
+	failures = channel.state()["persist_failures"]
+
+	# Bases come first, so every keymap can already inherit from the ones pushed before it
+	for text in keymaps:
+		channel.push(text, persist)
+
+	if persist:
+		channel.wait_for_persists(failures)
+
+	print("Pushed %d keymap(s) in %d ms" % (len(keymaps), (time.monotonic() - start) * 1000))
+
+
+def main():
+	parser = argparse.ArgumentParser(description="Configure the macropad over raw HID")
+	parser.add_argument("--device", help="hidraw device node, found automatically by default")
+
+	commands = parser.add_subparsers(dest="command", required=True)
+	commands.add_parser("info", help="print protocol information")
+	commands.add_parser("state", help="print the active keymap and layer")
+
+	select = commands.add_parser("select", help="switch to a keymap by name, or by index with --index")
+	select.add_argument("keymap")
+	select.add_argument("--index", action="store_true")
+
+	layer = commands.add_parser("layer", help="switch to a layer of the active keymap")
+	layer.add_argument("layer", type=int)
+
+	push = commands.add_parser("push", help="push keymaps from a JSON file")
+	push.add_argument("file")
+	push.add_argument("--persist", action="store_true", help="also store them in config.json")
+	push.add_argument("--watch", action="store_true", help="push again whenever the file changes")
+
+	args = parser.parse_args()
+
+	device = args.device or find_device()
+	if not device:
+		sys.exit("No macropad found")
+
+	channel = Channel(device)
+
+	try:
+		version, max_size = channel.info()
+		if version != PROTOCOL_VERSION:
+			sys.exit("Unsupported protocol version %d" % version)
+
+		if args.command == "info":
+			print("%s: protocol version %d, keymaps up to %d bytes" % (device, version, max_size))
+			return
+
+		if args.command in ("state", "select", "layer"):
+			if args.command == "select":
+				state = channel.select_keymap(int(args.keymap)) if args.index else channel.select_name(args.keymap)
+			elif args.command == "layer":
+				state = channel.select_layer(args.layer)
+			else:
+				state = channel.state()
+
+			print("Keymap %d/%d (name hash %08x), layer %d/%d" % (state["keymap"] + 1, state["keymap_count"], state["name_hash"], state["layer"] + 1, state["layer_count"]))
+			return
+
+		push_file(channel, args.file, args.persist)
+
+		last_modified = os.stat(args.file).st_mtime
+
+		while args.watch:
+			time.sleep(0.2)
+
+			modified = os.stat(args.file).st_mtime
+			if modified == last_modified:
+				continue
+
+			last_modified = modified
+
+			try:
+				push_file(channel, args.file, args.persist)
+			except (ChannelError, ValueError) as error:
+				print("Push failed: %s" % error)
+
+	except ChannelError as error:
+		sys.exit("Failed: %s" % error)
+	finally:
+		channel.close()
+
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+# Switches the macropad's keymap to follow the focused window. A command prints something identifying the window,
+# by default its class through xdotool, and rules map that to a keymap name. Without rules the output is used as
+# the keymap name directly. Each switch is a single raw HID request
+
+import argparse
+import json
+import re
+import subprocess
+import sys
+import time
+
+from macropad_hid import Channel, ChannelError, STATUS_NOT_FOUND, find_device
+
+DEFAULT_COMMAND = "xdotool getactivewindow getwindowclassname"
+
+
+def load_rules(path):
+	# JSON object of regular expression to keymap name, first match wins
+	if not path:
+		return []
+
+	with open(path, encoding="utf-8") as file:
+		rules = json.load(file)
+
+	return [(re.compile(pattern), name) for pattern, name in rules.items()]
+
+
+def query_window(command):
+	try:
+		result = subprocess.run(command, shell=True, capture_output=True, text=True, timeout=2)
+	except subprocess.TimeoutExpired:
+		return None
+
+	return result.stdout.strip() if result.returncode == 0 else None
+
+
+def resolve_keymap(window, rules, default):
+	if not rules:
+		return window or default
+
+	for pattern, name in rules:
+		if window and pattern.search(window):
+			return name
+
+	return default
+
+
+def run(args, rules):
+	channel = None
+	current = None
+
+	while True:
+		time.sleep(args.interval)
+
+		name = resolve_keymap(query_window(args.command), rules, args.default)
+		if not name or name == current:
+			continue
+
+		try:
+			if channel is None:
+				device = args.device or find_device()
+				if not device:
+					continue
+
+				channel = Channel(device)
+
+			try:
+				channel.select_name(name)
+			except ChannelError as error:
+				# Windows without a keymap of their own fall back to the default one
+				if error.status != STATUS_NOT_FOUND or not args.default or name == args.default:
+					raise
+
+				channel.select_name(args.default)
+
+			if args.verbose:
+				print("Switched to %s" % name)
+
+			current = name
+
+		except ChannelError as error:
+			print("Switching to %s failed: %s" % (name, error), file=sys.stderr)
+			current = name
+
+		except OSError:
+			# Unplugged, try again once it comes back
+			if channel:
+				channel.close()
+
+			channel = None
+			current = None
+
+
+def main():
+	parser = argparse.ArgumentParser(description="Switch macropad keymaps to follow the focused window")
+	parser.add_argument("--device", help="hidraw device node, found automatically by default")
+	parser.add_argument("--command", default=DEFAULT_COMMAND, help="command printing the focused window")
+	parser.add_argument("--rules", help="JSON file mapping window regular expressions to keymap names")
+	parser.add_argument("--default", help="keymap for windows without one")
+	parser.add_argument("--interval", type=float, default=0.25, help="polling interval in seconds")
+	parser.add_argument("--verbose", action="store_true")
+
+	args = parser.parse_args()
+
+	try:
+		run(args, load_rules(args.rules))
+	except KeyboardInterrupt:
+		pass
+
+
+if __name__ == "__main__":
+	main()
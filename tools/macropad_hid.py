@@ -0,0 +1,163 @@
+# Host side of the macropad's raw HID configuration channel (Linux, hidraw).
+# The protocol is described in source/usb/usb_rawhid.h
+
+import glob
+import os
+import struct
+import time
+import zlib
+
+USB_VID = 0xcafe
+
+REPORT_SIZE = 64
+PROTOCOL_VERSION = 3
+
+CMD_INFO = 0
+CMD_BEGIN = 1
+CMD_DATA = 2
+CMD_ACTIVATE = 3
+CMD_STATE = 4
+CMD_SELECT_KEYMAP = 5
+CMD_SELECT_NAME = 6
+CMD_SELECT_LAYER = 7
+
+FLAG_PERSIST = 1 << 0
+
+STATUS_BUSY = 6
+STATUS_NOT_FOUND = 8
+
+STATUS_NAMES = [
+	"ok",
+	"unknown command",
+	"bad state",
+	"bad length",
+	"bad crc",
+	"invalid keymap",
+	"busy, eject the volume first",
+	"io error",
+	"not found",
+]
+
+
+class ChannelError(Exception):
+	def __init__(self, status):
+		self.status = status
+
+		name = STATUS_NAMES[status] if status < len(STATUS_NAMES) else "status %d" % status
+		super().__init__(name)
+
+
+def name_hash(name):
+	# FNV-1a over the raw name, matches config_hash() on the device
+	value = 2166136261
+
+	for byte in name.encode("utf-8"):
+		value = ((value ^ byte) * 16777619) & 0xffffffff
+
+	return value if value else 1
+
+
+def find_device():
+	# The configuration channel is the HID interface with a vendor defined usage page (0xff00)
+	for path in sorted(glob.glob("/sys/class/hidraw/hidraw*")):
+		try:
+			with open(os.path.join(path, "device/uevent")) as file:
+				uevent = file.read()
+			with open(os.path.join(path, "device/report_descriptor"), "rb") as file:
+				descriptor = file.read()
+		except OSError:
+			continue
+
+		if ":%08X:" % USB_VID not in uevent.upper():
+			continue
+
+		if descriptor[:3] == b"\x06\x00\xff":
+			return "/dev/" + os.path.basename(path)
+
+	return None
+
+
+class Channel:
+	def __init__(self, path):
+		self.fd = os.open(path, os.O_RDWR)
+		self.tag = 0
+
+	def close(self):
+		os.close(self.fd)
+
+	def request(self, command, payload=b""):
+		self.tag = (self.tag + 1) & 0xff
+
+		report = bytes([command, self.tag]) + payload
+		report = report.ljust(REPORT_SIZE, b"\0")
+
+		# hidraw expects the report number first, the channel doesn't use any
+		os.write(self.fd, b"\0" + report)
+
+		while True:
+			response = os.read(self.fd, REPORT_SIZE)
+			if len(response) >= 3 and response[0] == command and response[1] == self.tag:
+				break
+
+		if response[2] != 0:
+			raise ChannelError(response[2])
+
+		return response[3:]
+
+	def info(self):
+		response = self.request(CMD_INFO)
+		version, max_size = struct.unpack_from("<BI", response)
+
+		return version, max_size
+
+	def push(self, text, persist):
+		data = text.encode("utf-8")
+
+		self.request(CMD_BEGIN, struct.pack("<II", len(data), zlib.crc32(data)))
+
+		chunk_size = REPORT_SIZE - 7
+		for offset in range(0, len(data), chunk_size):
+			chunk = data[offset:offset + chunk_size]
+			self.request(CMD_DATA, struct.pack("<IB", offset, len(chunk)) + chunk)
+
+		self.request(CMD_ACTIVATE, bytes([FLAG_PERSIST if persist else 0]))
+
+	def state(self, command=CMD_STATE, payload=b""):
+		keymap, keymap_count, hash, layer, layer_count, pending, failures, status = struct.unpack_from("<HHIBBBBB", self.request(command, payload))
+
+		return {
+			"keymap": keymap,
+			"keymap_count": keymap_count,
+			"name_hash": hash,
+			"layer": layer,
+			"layer_count": layer_count,
+			"persists_pending": pending,
+			"persist_failures": failures,
+			"persist_status": status,
+		}
+
+	def wait_for_persists(self, failures, timeout=5.0):
+		# Keymaps pushed with persist are written after the activate was answered. failures is the count from a
+		# state taken before pushing them
+		deadline = time.monotonic() + timeout
+
+		while True:
+			state = self.state()
+
+			if state["persist_failures"] != failures:
+				raise ChannelError(state["persist_status"])
+			if state["persists_pending"] == 0:
+				return
+			if time.monotonic() > deadline:
+				raise ChannelError(STATUS_BUSY)
+
+			time.sleep(0.01)
+
+	def select_keymap(self, index):
+		return self.state(CMD_SELECT_KEYMAP, struct.pack("<H", index))
+
+	def select_name(self, name):
+		return self.state(CMD_SELECT_NAME, struct.pack("<I", name_hash(name)))
+
+	def select_layer(self, layer):
+		return self.state(CMD_SELECT_LAYER, bytes([layer]))